@@ -22,6 +22,7 @@
 #include "qahira/format/private.h"
 #include "qahira/macros.h"
 #include "qahira/marshal.h"
+#include <string.h>
 
 G_DEFINE_ABSTRACT_TYPE(QahiraFormat, qahira_format, G_TYPE_OBJECT)
 
@@ -43,12 +44,19 @@ static guint signals[SIGNAL_LAST] = { 0 };
 
 struct Private {
 	GSList *types;
+	gint threads;
+	gboolean trusted;
+	GInputStream *stream; // frames source
+	cairo_surface_t *frame;
+	gboolean done; // the only frame has been returned
 };
 
 static void
 qahira_format_init(QahiraFormat *self)
 {
 	self->priv = ASSIGN_PRIVATE(self);
+	struct Private *priv = GET_PRIVATE(self);
+	priv->threads = 1;
 }
 
 static void
@@ -58,6 +66,12 @@ finalize(GObject *base)
 	if (priv->types) {
 		g_slist_free(priv->types);
 	}
+	if (priv->stream) {
+		g_object_unref(priv->stream);
+	}
+	if (priv->frame) {
+		cairo_surface_destroy(priv->frame);
+	}
 	G_OBJECT_CLASS(qahira_format_parent_class)->finalize(base);
 }
 
@@ -99,6 +113,52 @@ save(QahiraFormat *self, cairo_surface_t *surface, GOutputStream *stream,
 	return FALSE;
 }
 
+static void
+close_frames(QahiraFormat *self)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	if (priv->stream) {
+		g_object_unref(priv->stream);
+		priv->stream = NULL;
+	}
+	if (priv->frame) {
+		cairo_surface_destroy(priv->frame);
+		priv->frame = NULL;
+	}
+}
+
+static gboolean
+open_frames(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
+		GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	priv->stream = g_object_ref(stream);
+	priv->done = FALSE;
+	return TRUE;
+}
+
+/**
+ * \brief Formats without animation have a single frame.
+ */
+static cairo_surface_t *
+next_frame(QahiraFormat *self, gint *delay, GCancellable *cancel,
+		GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	if (priv->done) {
+		return NULL;
+	}
+	priv->frame = qahira_format_load(self, priv->stream, cancel, error);
+	if (G_UNLIKELY(!priv->frame)) {
+		return NULL;
+	}
+	priv->done = TRUE;
+	if (delay) {
+		*delay = 0;
+	}
+	return priv->frame;
+}
+
 static cairo_surface_t *
 surface_create(QahiraFormat *self, cairo_format_t format,
 		gint width, gint height)
@@ -134,6 +194,9 @@ qahira_format_class_init(QahiraFormatClass *klass)
 	object_class->set_property = set_property;
 	klass->load = load;
 	klass->save = save;
+	klass->open_frames = open_frames;
+	klass->next_frame = next_frame;
+	klass->close_frames = close_frames;
 	klass->surface_create = surface_create;
 	klass->surface_get_data = surface_get_data;
 	klass->surface_get_stride = surface_get_stride;
@@ -190,6 +253,33 @@ qahira_format_save(QahiraFormat *self, cairo_surface_t *surface,
 		save(self, surface, stream, cancel, error);
 }
 
+gboolean
+qahira_format_open_frames(QahiraFormat *self, GInputStream *stream,
+		GCancellable *cancel, GError **error)
+{
+	qahira_return_error_if_fail(QAHIRA_IS_FORMAT(self), FALSE, error);
+	qahira_return_error_if_fail(G_IS_INPUT_STREAM(stream), FALSE, error);
+	QAHIRA_FORMAT_GET_CLASS(self)->close_frames(self);
+	return QAHIRA_FORMAT_GET_CLASS(self)->
+		open_frames(self, stream, cancel, error);
+}
+
+cairo_surface_t *
+qahira_format_next_frame(QahiraFormat *self, gint *delay,
+		GCancellable *cancel, GError **error)
+{
+	qahira_return_error_if_fail(QAHIRA_IS_FORMAT(self), NULL, error);
+	return QAHIRA_FORMAT_GET_CLASS(self)->
+		next_frame(self, delay, cancel, error);
+}
+
+void
+qahira_format_close_frames(QahiraFormat *self)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT(self));
+	QAHIRA_FORMAT_GET_CLASS(self)->close_frames(self);
+}
+
 gboolean
 qahira_format_supports(QahiraFormat *self, const gchar *type)
 {
@@ -242,6 +332,84 @@ qahira_format_add_static_type(QahiraFormat *self, const gchar *type)
 	priv->types = g_slist_prepend(priv->types, (gpointer)string);
 }
 
+void
+qahira_format_set_threads(QahiraFormat *self, gint threads)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT(self));
+	// zero selects the number of available processors
+	GET_PRIVATE(self)->threads = MAX(threads, 0);
+}
+
+gint
+qahira_format_get_threads(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT(self), 1);
+	return GET_PRIVATE(self)->threads;
+}
+
+void
+qahira_format_set_trusted(QahiraFormat *self, gboolean trusted)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT(self));
+	GET_PRIVATE(self)->trusted = trusted ? TRUE : FALSE;
+}
+
+gboolean
+qahira_format_get_trusted(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT(self), FALSE);
+	return GET_PRIVATE(self)->trusted;
+}
+
+gint
+qahira_format_get_thread_count(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT(self), 1);
+	struct Private *priv = GET_PRIVATE(self);
+	if (priv->threads) {
+		return priv->threads;
+	}
+#if GLIB_CHECK_VERSION(2, 36, 0)
+	return g_get_num_processors();
+#else // GLIB_CHECK_VERSION
+	return 1;
+#endif // GLIB_CHECK_VERSION
+}
+
+void
+qahira_format_run(QahiraFormat *self, GFunc func, gpointer *tasks,
+		gint count, gpointer data)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT(self));
+	g_return_if_fail(func);
+	gint threads = MIN(qahira_format_get_thread_count(self), count);
+	GThreadPool *pool = NULL;
+	if (1 < threads) {
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+		if (!g_thread_supported()) {
+			g_thread_init(NULL);
+		}
+#endif // GLIB_CHECK_VERSION
+		pool = g_thread_pool_new(func, data, threads, FALSE, NULL);
+	}
+	for (gint i = 0; i < count; ++i) {
+		GError *error = NULL;
+		if (pool) {
+			g_thread_pool_push(pool, tasks[i], &error);
+		}
+		if (!pool || error) {
+			// run in the calling thread
+			if (error) {
+				g_error_free(error);
+			}
+			func(tasks[i], data);
+		}
+	}
+	if (pool) {
+		g_thread_pool_free(pool, FALSE, TRUE);
+	}
+}
+
 cairo_surface_t *
 qahira_format_surface_create(QahiraFormat *self, cairo_format_t format,
 		gint width, gint height)
@@ -289,3 +457,119 @@ qahira_surface_size(cairo_surface_t *surface, gint *width, gint *height)
 		*height = (gint)clip_height;
 	}
 }
+
+gboolean
+qahira_format_surface_is_opaque(QahiraFormat *self, cairo_surface_t *surface)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT(self), FALSE);
+	g_return_val_if_fail(surface, FALSE);
+	switch (cairo_surface_get_content(surface)) {
+	case CAIRO_CONTENT_COLOR:
+		return TRUE;
+	case CAIRO_CONTENT_COLOR_ALPHA:
+		break;
+	default:
+		return FALSE;
+	}
+	const guchar *data = qahira_format_surface_get_data(self, surface);
+	gint stride = qahira_format_surface_get_stride(self, surface);
+	if (G_UNLIKELY(!data || 0 > stride)) {
+		return FALSE;
+	}
+	gint width, height;
+	qahira_surface_size(surface, &width, &height);
+	for (gint i = 0; i < height; ++i) {
+		const guint32 *row = (const guint32 *)(data + i * stride);
+		for (gint j = 0; j < width; ++j) {
+			if (0xff000000 != (row[j] & 0xff000000)) {
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
+
+// the ARGB32 surface owning the pixels of an RGB24 view
+static const cairo_user_data_key_t opaque_key;
+
+cairo_surface_t *
+qahira_format_surface_make_opaque(QahiraFormat *self,
+		cairo_surface_t *surface)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT(self), surface);
+	g_return_val_if_fail(surface, NULL);
+	gint width, height;
+	qahira_surface_size(surface, &width, &height);
+	cairo_surface_t *opaque;
+	if (surface_create == QAHIRA_FORMAT_GET_CLASS(self)->surface_create
+			&& !g_signal_has_handler_pending(self,
+				signals[SIGNAL_SURFACE_CREATE], 0, FALSE)) {
+		// ARGB32 & RGB24 rows have the same layout, share the pixels
+		cairo_surface_flush(surface);
+		opaque = cairo_image_surface_create_for_data(
+				cairo_image_surface_get_data(surface),
+				CAIRO_FORMAT_RGB24, width, height,
+				cairo_image_surface_get_stride(surface));
+		if (CAIRO_STATUS_SUCCESS == cairo_surface_status(opaque)
+				&& CAIRO_STATUS_SUCCESS
+				== cairo_surface_set_user_data(opaque,
+					&opaque_key, surface,
+					(cairo_destroy_func_t)
+					cairo_surface_destroy)) {
+			return opaque;
+		}
+		cairo_surface_destroy(opaque);
+	}
+	// surfaces from a custom allocator are copied
+	opaque = qahira_format_surface_create(self, CAIRO_FORMAT_RGB24,
+			width, height);
+	if (G_UNLIKELY(!opaque)) {
+		return surface;
+	}
+	if (G_UNLIKELY(CAIRO_STATUS_SUCCESS != cairo_surface_status(opaque))) {
+		goto error;
+	}
+	const guchar *in = qahira_format_surface_get_data(self, surface);
+	guchar *out = qahira_format_surface_get_data(self, opaque);
+	gint in_stride = qahira_format_surface_get_stride(self, surface);
+	gint out_stride = qahira_format_surface_get_stride(self, opaque);
+	if (G_UNLIKELY(!in || !out || 0 > in_stride || 0 > out_stride)) {
+		goto error;
+	}
+	cairo_surface_flush(opaque);
+	for (gint i = 0; i < height; ++i) {
+		memcpy(out + i * out_stride, in + i * in_stride, width * 4);
+	}
+	cairo_surface_mark_dirty(opaque);
+	cairo_surface_destroy(surface);
+	return opaque;
+error:
+	// keep the original surface
+	cairo_surface_destroy(opaque);
+	return surface;
+}
+
+/**
+ * \brief Build the unpremultiply table, indexed by alpha * 256 + color.
+ */
+static gpointer
+unpremultiply_init(gpointer data)
+{
+	guint8 *table = g_malloc(256 * 256);
+	memset(table, 0, 256);
+	for (gint alpha = 1; alpha < 256; ++alpha) {
+		for (gint color = 0; color < 256; ++color) {
+			table[alpha * 256 + color] =
+				MIN(255, (color * 255 + (alpha >> 1)) / alpha);
+		}
+	}
+	return table;
+}
+
+const guint8 *
+qahira_unpremultiply_table(void)
+{
+	static GOnce once = G_ONCE_INIT;
+	g_once(&once, unpremultiply_init, NULL);
+	return once.retval;
+}
@@ -68,6 +68,17 @@ typedef gboolean
 (*QahiraFormatSave)(QahiraFormat *self, cairo_surface_t *surface,
 		GOutputStream *stream, GCancellable *cancel, GError **error);
 
+typedef gboolean
+(*QahiraFormatOpenFrames)(QahiraFormat *self, GInputStream *stream,
+		GCancellable *cancel, GError **error);
+
+typedef cairo_surface_t *
+(*QahiraFormatNextFrame)(QahiraFormat *self, gint *delay,
+		GCancellable *cancel, GError **error);
+
+typedef void
+(*QahiraFormatCloseFrames)(QahiraFormat *self);
+
 typedef cairo_surface_t *
 (*QahiraFormatSurfaceCreate)(QahiraFormat *self, cairo_format_t format,
 		gint width, gint height);
@@ -86,6 +97,9 @@ struct QahiraFormatClass_ {
 	QahiraFormatSurfaceCreate surface_create;
 	QahiraFormatSurfaceGetData surface_get_data;
 	QahiraFormatSurfaceGetStride surface_get_stride;
+	QahiraFormatOpenFrames open_frames;
+	QahiraFormatNextFrame next_frame; // owned by the format
+	QahiraFormatCloseFrames close_frames;
 };
 
 G_GNUC_NO_INSTRUMENT
@@ -100,9 +114,32 @@ gboolean
 qahira_format_save(QahiraFormat *self, cairo_surface_t *surface,
 		GOutputStream *stream, GCancellable *cancel, GError **error);
 
+gboolean
+qahira_format_open_frames(QahiraFormat *self, GInputStream *stream,
+		GCancellable *cancel, GError **error);
+
+cairo_surface_t *
+qahira_format_next_frame(QahiraFormat *self, gint *delay,
+		GCancellable *cancel, GError **error);
+
+void
+qahira_format_close_frames(QahiraFormat *self);
+
 gboolean
 qahira_format_supports(QahiraFormat *self, const gchar *type);
 
+void
+qahira_format_set_threads(QahiraFormat *self, gint threads);
+
+gint
+qahira_format_get_threads(QahiraFormat *self);
+
+void
+qahira_format_set_trusted(QahiraFormat *self, gboolean trusted);
+
+gboolean
+qahira_format_get_trusted(QahiraFormat *self);
+
 G_END_DECLS
 
 #endif // QAHIRA_FORMAT_H
@@ -45,8 +45,49 @@ G_BEGIN_DECLS
 
 typedef struct QahiraFormatJpeg_ QahiraFormatJpeg;
 
+typedef enum {
+	QAHIRA_FORMAT_JPEG_PROFILE_DEFAULT, // accurate IDCT, fast upsampling
+	QAHIRA_FORMAT_JPEG_PROFILE_FAST, // fast IDCT, merged upsampling
+	QAHIRA_FORMAT_JPEG_PROFILE_ACCURATE // accurate IDCT, fancy upsampling
+} QahiraFormatJpegProfile;
+
+typedef enum {
+	QAHIRA_FORMAT_JPEG_SUBSAMPLING_420, // 2x2 chroma subsampling
+	QAHIRA_FORMAT_JPEG_SUBSAMPLING_422, // 2x1 chroma subsampling
+	QAHIRA_FORMAT_JPEG_SUBSAMPLING_444 // no chroma subsampling
+} QahiraFormatJpegSubsampling;
+
+typedef enum {
+	QAHIRA_FORMAT_JPEG_DCT_ISLOW, // accurate integer DCT
+	QAHIRA_FORMAT_JPEG_DCT_IFAST, // fast, less accurate integer DCT
+	QAHIRA_FORMAT_JPEG_DCT_FLOAT // floating point DCT
+} QahiraFormatJpegDct;
+
+typedef enum {
+	QAHIRA_FORMAT_JPEG_TRANSFORM_NONE, // crop only
+	QAHIRA_FORMAT_JPEG_TRANSFORM_FLIP_HORIZONTAL,
+	QAHIRA_FORMAT_JPEG_TRANSFORM_FLIP_VERTICAL,
+	QAHIRA_FORMAT_JPEG_TRANSFORM_TRANSPOSE, // mirror on the main diagonal
+	QAHIRA_FORMAT_JPEG_TRANSFORM_TRANSVERSE, // mirror on the anti-diagonal
+	QAHIRA_FORMAT_JPEG_TRANSFORM_ROTATE_90, // clockwise
+	QAHIRA_FORMAT_JPEG_TRANSFORM_ROTATE_180,
+	QAHIRA_FORMAT_JPEG_TRANSFORM_ROTATE_270
+} QahiraFormatJpegTransform;
+
 typedef struct QahiraFormatJpegClass_ QahiraFormatJpegClass;
 
+typedef struct QahiraFormatJpegPlanes_ QahiraFormatJpegPlanes;
+
+struct QahiraFormatJpegPlanes_ {
+	gint width; // image width
+	gint height; // image height
+	gint components; // 1 (Y) or 3 (Y, Cb, Cr)
+	guchar *data[3];
+	gint stride[3];
+	gint plane_width[3]; // set when loading, must match the subsampling
+	gint plane_height[3];
+};
+
 struct QahiraFormatJpeg_ {
 	/*< private >*/
 	QahiraFormat parent_instance;
@@ -77,6 +118,109 @@ qahira_format_jpeg_set_quality(QahiraFormat *self, gint quality);
 gint
 qahira_format_jpeg_get_quality(QahiraFormat *self);
 
+void
+qahira_format_jpeg_set_profile(QahiraFormat *self,
+		QahiraFormatJpegProfile profile);
+
+QahiraFormatJpegProfile
+qahira_format_jpeg_get_profile(QahiraFormat *self);
+
+void
+qahira_format_jpeg_set_preview(QahiraFormat *self, gboolean preview);
+
+gboolean
+qahira_format_jpeg_get_preview(QahiraFormat *self);
+
+void
+qahira_format_jpeg_set_auto_orient(QahiraFormat *self, gboolean auto_orient);
+
+gboolean
+qahira_format_jpeg_get_auto_orient(QahiraFormat *self);
+
+void
+qahira_format_jpeg_set_format(QahiraFormat *self, cairo_format_t format);
+
+cairo_format_t
+qahira_format_jpeg_get_format(QahiraFormat *self);
+
+void
+qahira_format_jpeg_set_dither(QahiraFormat *self, gboolean dither);
+
+gboolean
+qahira_format_jpeg_get_dither(QahiraFormat *self);
+
+void
+qahira_format_jpeg_set_optimize(QahiraFormat *self, gboolean optimize);
+
+gboolean
+qahira_format_jpeg_get_optimize(QahiraFormat *self);
+
+void
+qahira_format_jpeg_set_progressive(QahiraFormat *self, gboolean progressive);
+
+gboolean
+qahira_format_jpeg_get_progressive(QahiraFormat *self);
+
+void
+qahira_format_jpeg_set_subsampling(QahiraFormat *self,
+		QahiraFormatJpegSubsampling subsampling);
+
+QahiraFormatJpegSubsampling
+qahira_format_jpeg_get_subsampling(QahiraFormat *self);
+
+void
+qahira_format_jpeg_set_restart_interval(QahiraFormat *self, gint rows);
+
+gint
+qahira_format_jpeg_get_restart_interval(QahiraFormat *self);
+
+void
+qahira_format_jpeg_set_dct_method(QahiraFormat *self,
+		QahiraFormatJpegDct method);
+
+QahiraFormatJpegDct
+qahira_format_jpeg_get_dct_method(QahiraFormat *self);
+
+void
+qahira_format_jpeg_set_target_size(QahiraFormat *self, gsize size);
+
+gsize
+qahira_format_jpeg_get_target_size(QahiraFormat *self);
+
+void
+qahira_format_jpeg_set_abbreviate(QahiraFormat *self, gboolean abbreviate);
+
+gboolean
+qahira_format_jpeg_get_abbreviate(QahiraFormat *self);
+
+gboolean
+qahira_format_jpeg_save_tables(QahiraFormat *self, GOutputStream *stream,
+		GCancellable *cancel, GError **error);
+
+gboolean
+qahira_format_jpeg_load_tables(QahiraFormat *self, GInputStream *stream,
+		GCancellable *cancel, GError **error);
+
+cairo_surface_t *
+qahira_format_jpeg_load_thumbnail(QahiraFormat *self, GInputStream *stream,
+		gint size, GCancellable *cancel, GError **error);
+
+gboolean
+qahira_format_jpeg_load_planes(QahiraFormat *self, GInputStream *stream,
+		QahiraFormatJpegPlanes *planes, GCancellable *cancel,
+		GError **error);
+
+gboolean
+qahira_format_jpeg_save_planes(QahiraFormat *self,
+		const QahiraFormatJpegPlanes *planes, GOutputStream *stream,
+		GCancellable *cancel, GError **error);
+
+gboolean
+qahira_format_jpeg_transform(QahiraFormat *self, GInputStream *input,
+		GOutputStream *output, QahiraFormatJpegTransform transform,
+		const cairo_rectangle_int_t *crop, GCancellable *cancel,
+		GError **error);
+
 G_END_DECLS
 
 #endif // QAHIRA_FORMAT_JPEG_H
@@ -43,6 +43,36 @@ G_BEGIN_DECLS
 	(G_TYPE_INSTANCE_GET_CLASS((instance), QAHIRA_TYPE_FORMAT_PNG, \
 		QahiraFormatPngClass))
 
+typedef enum {
+	QAHIRA_FORMAT_PNG_FILTER_NONE = 1 << 0,
+	QAHIRA_FORMAT_PNG_FILTER_SUB = 1 << 1, // difference to the left
+	QAHIRA_FORMAT_PNG_FILTER_UP = 1 << 2, // difference to the row above
+	QAHIRA_FORMAT_PNG_FILTER_AVG = 1 << 3, // left & above average
+	QAHIRA_FORMAT_PNG_FILTER_PAETH = 1 << 4, // Paeth predictor
+	QAHIRA_FORMAT_PNG_FILTER_ALL = 0x1f // best filter for each row
+} QahiraFormatPngFilter;
+
+typedef enum {
+	QAHIRA_FORMAT_PNG_STRATEGY_AUTO, // filtered unless rows are unfiltered
+	QAHIRA_FORMAT_PNG_STRATEGY_DEFAULT, // zlib default
+	QAHIRA_FORMAT_PNG_STRATEGY_FILTERED, // favor Huffman coding
+	QAHIRA_FORMAT_PNG_STRATEGY_HUFFMAN_ONLY, // no string matching
+	QAHIRA_FORMAT_PNG_STRATEGY_RLE, // match the previous pixel only
+	QAHIRA_FORMAT_PNG_STRATEGY_FIXED // no dynamic Huffman codes
+} QahiraFormatPngStrategy;
+
+typedef enum {
+	QAHIRA_FORMAT_PNG_PRESET_DEFAULT, // libpng defaults
+	QAHIRA_FORMAT_PNG_PRESET_FAST, // unfiltered, run-length (screenshots)
+	QAHIRA_FORMAT_PNG_PRESET_SMALL // adaptive filters, best compression
+} QahiraFormatPngPreset;
+
+typedef enum {
+	QAHIRA_FORMAT_PNG_BACKEND_DEFAULT, // selected at configure time
+	QAHIRA_FORMAT_PNG_BACKEND_LIBPNG,
+	QAHIRA_FORMAT_PNG_BACKEND_SPNG // requires libspng
+} QahiraFormatPngBackend;
+
 typedef struct QahiraFormatPng_ QahiraFormatPng;
 
 typedef struct QahiraFormatPngClass_ QahiraFormatPngClass;
@@ -53,9 +83,14 @@ struct QahiraFormatPng_ {
 	gpointer priv;
 };
 
+typedef void
+(*QahiraFormatPngProgressive)(QahiraFormat *self, cairo_surface_t *surface);
+
 struct QahiraFormatPngClass_ {
 	/*< private >*/
 	QahiraFormatClass parent_class;
+	/*< public >*/
+	QahiraFormatPngProgressive progressive;
 };
 
 G_GNUC_NO_INSTRUMENT
@@ -78,6 +113,55 @@ qahira_format_set_interlace(QahiraFormat *self, gboolean interlace);
 gboolean
 qahira_format_get_interlace(QahiraFormat *self);
 
+void
+qahira_format_png_set_backend(QahiraFormat *self,
+		QahiraFormatPngBackend backend);
+
+QahiraFormatPngBackend
+qahira_format_png_get_backend(QahiraFormat *self);
+
+void
+qahira_format_png_set_filters(QahiraFormat *self,
+		QahiraFormatPngFilter filters);
+
+QahiraFormatPngFilter
+qahira_format_png_get_filters(QahiraFormat *self);
+
+void
+qahira_format_png_set_strategy(QahiraFormat *self,
+		QahiraFormatPngStrategy strategy);
+
+QahiraFormatPngStrategy
+qahira_format_png_get_strategy(QahiraFormat *self);
+
+void
+qahira_format_png_set_window_bits(QahiraFormat *self, gint window_bits);
+
+gint
+qahira_format_png_get_window_bits(QahiraFormat *self);
+
+void
+qahira_format_png_set_memory_level(QahiraFormat *self, gint memory_level);
+
+gint
+qahira_format_png_get_memory_level(QahiraFormat *self);
+
+void
+qahira_format_png_set_preset(QahiraFormat *self,
+		QahiraFormatPngPreset preset);
+
+void
+qahira_format_png_set_colors(QahiraFormat *self, gint colors);
+
+gint
+qahira_format_png_get_colors(QahiraFormat *self);
+
+void
+qahira_format_png_set_dither(QahiraFormat *self, gboolean dither);
+
+gboolean
+qahira_format_png_get_dither(QahiraFormat *self);
+
 G_END_DECLS
 
 #endif // QAHIRA_FORMAT_PNG_H
@@ -39,6 +39,15 @@ G_GNUC_INTERNAL
 gboolean
 qahira_format_supports_intern_string(QahiraFormat *self, const gchar *type);
 
+G_GNUC_INTERNAL
+gint
+qahira_format_get_thread_count(QahiraFormat *self);
+
+G_GNUC_INTERNAL
+void
+qahira_format_run(QahiraFormat *self, GFunc func, gpointer *tasks,
+		gint count, gpointer data);
+
 G_GNUC_INTERNAL
 cairo_surface_t *
 qahira_format_surface_create(QahiraFormat *self, cairo_format_t format,
@@ -57,6 +66,19 @@ G_GNUC_INTERNAL
 void
 qahira_surface_size(cairo_surface_t *surface, gint *width, gint *height);
 
+G_GNUC_INTERNAL
+gboolean
+qahira_format_surface_is_opaque(QahiraFormat *self, cairo_surface_t *surface);
+
+G_GNUC_INTERNAL
+cairo_surface_t *
+qahira_format_surface_make_opaque(QahiraFormat *self,
+		cairo_surface_t *surface);
+
+G_GNUC_INTERNAL
+const guint8 *
+qahira_unpremultiply_table(void);
+
 G_END_DECLS
 
 #endif // QAHIRA_FORMAT_PRIVATE_H
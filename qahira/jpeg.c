@@ -24,6 +24,7 @@
 #include "qahira/error.h"
 #include "qahira/format/jpeg.h"
 #include "qahira/format/private.h"
+#include "qahira/macros.h"
 #include "qahira/marshal.h"
 #include "qahira/utility.h"
 #include <stdio.h>
@@ -48,8 +49,23 @@ enum Signals {
 
 static guint signals[SIGNAL_LAST] = { 0 };
 
+// the I/O buffer grows from the minimum to the maximum size
+#define QAHIRA_JPEG_BUFFER_MIN (1024 * 4)
 #define QAHIRA_JPEG_BUFFER_SIZE (1024 * 32)
 
+// smallest image (in pixels) coded in parallel
+#define QAHIRA_JPEG_PARALLEL_SIZE (1024 * 1024)
+
+// bands or strips per worker thread, evens out differing complexity
+#define QAHIRA_JPEG_BANDS_PER_THREAD (2)
+
+// rows passed to jpeg_write_scanlines() per call
+#define QAHIRA_JPEG_ROWS (16)
+
+typedef void
+(*Convert)(j_decompress_ptr cinfo, JSAMPARRAY lines, gint count,
+		guchar *out, gint row_step, gint pixel_step);
+
 struct Private {
 	struct jpeg_decompress_struct decompress;
 	struct jpeg_compress_struct compress;
@@ -60,13 +76,31 @@ struct Private {
 	GOutputStream *output;
 	GCancellable *cancel;
 	JOCTET *buffer;
+	gsize size; // size of buffer
 	gint quality;
-	gsize size;
+	gboolean optimize;
+	gboolean progressive;
+	QahiraFormatJpegSubsampling subsampling;
+	gint restart; // MCU rows between restart markers
+	gsize target; // maximum output size in bytes
+	gboolean abbreviate; // omit tables written by save_tables()
+	QahiraFormatJpegDct dct;
+	QahiraFormatJpegProfile profile;
+	gboolean preview;
+	cairo_format_t format; // surface format for decoded images
+	gboolean dither; // dither 16-bit output
 	guchar **lines;
-	gsize count;
+	Convert convert;
+	gboolean direct; // scan lines are decoded into the surface
+	GByteArray *record;
 	cairo_surface_t *surface;
 	guchar *data;
 	gint stride;
+	gboolean auto_orient;
+	gint orientation; // EXIF orientation of the image being decoded
+	gssize origin; // offset of the first decoded pixel
+	gint row_step;
+	gint pixel_step;
 	GError **error;
 	sigjmp_buf env;
 	gchar message[JMSG_LENGTH_MAX];
@@ -111,6 +145,34 @@ init_source(j_decompress_ptr cinfo)
 	// do nothing
 }
 
+/**
+ * \brief Allocate or grow the I/O buffer.
+ *
+ * The buffer doubles each time the stream fills it, small images are
+ * coded with a small buffer. Must not be called while the buffer holds
+ * data.
+ */
+static void
+grow_buffer(struct Private *priv)
+{
+	if (priv->buffer && QAHIRA_JPEG_BUFFER_SIZE <= priv->size) {
+		return;
+	}
+	gsize size = priv->buffer ? priv->size * 2 : QAHIRA_JPEG_BUFFER_MIN;
+	JOCTET *buffer = g_try_realloc(priv->buffer, size);
+	if (G_UNLIKELY(!buffer)) {
+		if (priv->buffer) {
+			// keep using the current buffer
+			return;
+		}
+		g_set_error(priv->error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
+				Q_("jpeg: out of memory"));
+		siglongjmp(priv->env, 1);
+	}
+	priv->buffer = buffer;
+	priv->size = size;
+}
+
 /**
  * \brief Fill the JPEG input buffer.
  */
@@ -118,10 +180,10 @@ static gboolean
 fill_input_buffer(j_decompress_ptr cinfo)
 {
 	struct Private *priv = cinfo->client_data;
-	if (G_UNLIKELY(!priv->buffer)) {
-		g_set_error(priv->error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
-				Q_("jpeg: input buffer is NULL"));
-		siglongjmp(priv->env, 1);
+	if (!priv->buffer || cinfo->src->next_input_byte
+			== priv->buffer + priv->size) {
+		// the previous read filled the buffer
+		grow_buffer(priv);
 	}
 	if (G_UNLIKELY(!priv->input)) {
 		goto eoi;
@@ -134,6 +196,9 @@ fill_input_buffer(j_decompress_ptr cinfo)
 	if (G_UNLIKELY(0 == bytes)) {
 		goto eoi;
 	}
+	if (priv->record) {
+		g_byte_array_append(priv->record, priv->buffer, bytes);
+	}
 	cinfo->src->bytes_in_buffer = bytes;
 exit:
 	cinfo->src->next_input_byte = priv->buffer;
@@ -177,8 +242,11 @@ static void
 init_destination(j_compress_ptr cinfo)
 {
 	struct Private *priv = cinfo->client_data;
+	if (!priv->buffer) {
+		grow_buffer(priv);
+	}
 	cinfo->dest->next_output_byte = priv->buffer;
-	cinfo->dest->free_in_buffer = QAHIRA_JPEG_BUFFER_SIZE;
+	cinfo->dest->free_in_buffer = priv->size;
 }
 
 /**
@@ -198,7 +266,7 @@ empty_output_buffer(j_compress_ptr cinfo)
 				Q_("jpeg: output stream is NULL"));
 		siglongjmp(priv->env, 1);
 	}
-	gsize size = QAHIRA_JPEG_BUFFER_SIZE;
+	gsize size = priv->size;
 	guchar *buffer = priv->buffer;
 	while (size) {
 		gssize bytes = g_output_stream_write(priv->output, buffer,
@@ -209,8 +277,10 @@ empty_output_buffer(j_compress_ptr cinfo)
 		size -= bytes;
 		buffer += bytes;
 	}
+	// the buffer was flushed
+	grow_buffer(priv);
 	cinfo->dest->next_output_byte = priv->buffer;
-	cinfo->dest->free_in_buffer = QAHIRA_JPEG_BUFFER_SIZE;
+	cinfo->dest->free_in_buffer = priv->size;
 	return TRUE;
 }
 
@@ -231,7 +301,7 @@ term_destination(j_compress_ptr cinfo)
 				Q_("jpeg: output stream is NULL"));
 		siglongjmp(priv->env, 1);
 	}
-	gsize size = QAHIRA_JPEG_BUFFER_SIZE - cinfo->dest->free_in_buffer;
+	gsize size = priv->size - cinfo->dest->free_in_buffer;
 	guchar *buffer = priv->buffer;
 	while (size) {
 		gssize bytes = g_output_stream_write(priv->output, buffer,
@@ -254,38 +324,25 @@ qahira_format_jpeg_init(QahiraFormatJpeg *self)
 		jpeg_std_error(&priv->error_mgr);
 	priv->error_mgr.error_exit = error_exit;
 	priv->error_mgr.output_message = output_message;
-	GError *error = NULL;
-	priv->error = &error;
-	if (sigsetjmp(priv->env, 1)) {
-		g_message("jpeg: %s", error->message);
-		g_error_free(error);
-		return;
-	}
-	// initialize decompress
-	jpeg_create_decompress(&priv->decompress);
+	// the codecs are created on first use, jpeg_create_*() keeps the
+	// error manager & client data
 	priv->decompress.client_data = priv;
-	// initialize compress
-	jpeg_create_compress(&priv->compress);
 	priv->compress.client_data = priv;
 	priv->quality = 75;
+	priv->subsampling = QAHIRA_FORMAT_JPEG_SUBSAMPLING_420;
+	priv->dct = QAHIRA_FORMAT_JPEG_DCT_ISLOW;
+	priv->profile = QAHIRA_FORMAT_JPEG_PROFILE_DEFAULT;
+	priv->format = CAIRO_FORMAT_RGB24;
 	// initialize source manager
-	priv->decompress.src = &priv->source_mgr;
 	priv->source_mgr.init_source = init_source;
 	priv->source_mgr.fill_input_buffer = fill_input_buffer;
 	priv->source_mgr.skip_input_data = skip_input_data;
 	priv->source_mgr.resync_to_restart = jpeg_resync_to_restart;
 	priv->source_mgr.term_source = term_source;
 	// initialize destination manager
-	priv->compress.dest = &priv->destination_mgr;
 	priv->destination_mgr.init_destination = init_destination;
 	priv->destination_mgr.empty_output_buffer = empty_output_buffer;
 	priv->destination_mgr.term_destination = term_destination;
-	// initialize I/O buffer
-	priv->size = QAHIRA_JPEG_BUFFER_SIZE;
-	priv->buffer = g_try_malloc(priv->size);
-	if (G_UNLIKELY(!priv->buffer)) {
-		g_message("%s", Q_("jpeg: out of memory"));
-	}
 }
 
 static void
@@ -313,6 +370,36 @@ finalize(GObject *base)
 	G_OBJECT_CLASS(qahira_format_jpeg_parent_class)->finalize(base);
 }
 
+/**
+ * \brief Create the decompressor on first use.
+ *
+ * Must be called after sigsetjmp(priv->env).
+ */
+static void
+create_decompress(QahiraFormat *self)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	if (!priv->decompress.mem) {
+		jpeg_create_decompress(&priv->decompress);
+		priv->decompress.src = &priv->source_mgr;
+	}
+}
+
+/**
+ * \brief Create the compressor on first use.
+ *
+ * Must be called after sigsetjmp(priv->env).
+ */
+static void
+create_compress(QahiraFormat *self)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	if (!priv->compress.mem) {
+		jpeg_create_compress(&priv->compress);
+		priv->compress.dest = &priv->destination_mgr;
+	}
+}
+
 /**
  * \brief Convert a JPEG color space value to a string.
  */
@@ -340,20 +427,19 @@ colorspace_name(J_COLOR_SPACE colorspace)
 /**
  * \brief Convert JPEG grayscale to RGB.
  */
-static inline void
-convert_grayscale(QahiraFormat *self)
+static void
+convert_grayscale(j_decompress_ptr cinfo, JSAMPARRAY lines, gint count,
+		guchar *data, gint row_step, gint pixel_step)
 {
-	struct Private *priv = GET_PRIVATE(self);
-	for (gint i = 0; i < priv->decompress.rec_outbuf_height; ++i) {
-		guchar *in = priv->lines[i];
-		guchar *out = priv->data + priv->stride
-			* (i + priv->decompress.output_scanline - 1);
-		for (gint j = 0; j < priv->decompress.output_width; ++j) {
+	for (gint i = 0; i < count; ++i) {
+		guchar *in = lines[i];
+		guchar *out = data + row_step * i;
+		for (gint j = 0; j < cinfo->output_width; ++j) {
 			out[QAHIRA_R] = in[0];
 			out[QAHIRA_G] = in[0];
 			out[QAHIRA_B] = in[0];
 			++in;
-			out += 4;
+			out += pixel_step;
 		}
 	}
 }
@@ -361,325 +447,2748 @@ convert_grayscale(QahiraFormat *self)
 /**
  * \brief Convert RGB
  */
-static inline void
-convert_rgb(QahiraFormat *self)
+static void
+convert_rgb(j_decompress_ptr cinfo, JSAMPARRAY lines, gint count,
+		guchar *data, gint row_step, gint pixel_step)
 {
-	struct Private *priv = GET_PRIVATE(self);
-	for (gint i = 0; i < priv->decompress.rec_outbuf_height; ++i) {
-		guchar *in = priv->lines[i];
-		guchar *out = priv->data + priv->stride
-			* (i + priv->decompress.output_scanline - 1);
-		for (gint j = 0; j < priv->decompress.output_width; ++j) {
+	for (gint i = 0; i < count; ++i) {
+		guchar *in = lines[i];
+		guchar *out = data + row_step * i;
+		for (gint j = 0; j < cinfo->output_width; ++j) {
 			out[QAHIRA_R] = in[0];
 			out[QAHIRA_G] = in[1];
 			out[QAHIRA_B] = in[2];
 			in += 3;
-			out += 4;
+			out += pixel_step;
 		}
 	}
 }
 
+/**
+ * \brief Divide a product of two 8-bit values by 255 with rounding.
+ */
+static inline guint
+div255(guint x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
 /**
  * \brief Convert JPEG CMYK to RGB.
  */
-static inline void
-convert_cmyk(QahiraFormat *self)
+static void
+convert_cmyk(j_decompress_ptr cinfo, JSAMPARRAY lines, gint count,
+		guchar *data, gint row_step, gint pixel_step)
 {
-	struct Private *priv = GET_PRIVATE(self);
-	for (gint i = 0; i < priv->decompress.rec_outbuf_height; ++i) {
-		guchar *in = priv->lines[i];
-		guchar *out = priv->data + priv->stride
-			* (i + priv->decompress.output_scanline - 1);
-		for (gint j = 0; j < priv->decompress.output_width; ++j) {
-			guchar c = in[0];
-			guchar m = in[1];
-			guchar y = in[2];
-			guchar k = in[3];
-			if (priv->decompress.saw_Adobe_marker) {
-				out[QAHIRA_R] = k * c / 255;
-				out[QAHIRA_G] = k * m / 255;
-				out[QAHIRA_B] = k * y / 255;
-			} else {
-				out[QAHIRA_R] = (255 - k) * (255 - c) / 255;
-				out[QAHIRA_G] = (255 - k) * (255 - m) / 255;
-				out[QAHIRA_B] = (255 - k) * (255 - y) / 255;
-			}
-			out += 4;
+	for (gint i = 0; i < count; ++i) {
+		const guchar *in = lines[i];
+		guchar *out = data + row_step * i;
+		for (gint j = 0; j < cinfo->output_width; ++j) {
+			guint k = 255 - in[3];
+			out[QAHIRA_R] = div255(k * (255 - in[0]));
+			out[QAHIRA_G] = div255(k * (255 - in[1]));
+			out[QAHIRA_B] = div255(k * (255 - in[2]));
+			out += pixel_step;
 			in += 4;
 		}
 	}
 }
 
 /**
- * \brief Load JPEG scan lines.
+ * \brief Convert inverted (Adobe) JPEG CMYK to RGB.
  */
-static inline gboolean
-load_lines(QahiraFormat *self, GError **error)
+static void
+convert_cmyk_adobe(j_decompress_ptr cinfo, JSAMPARRAY lines, gint count,
+		guchar *data, gint row_step, gint pixel_step)
 {
-	struct Private *priv = GET_PRIVATE(self);
-	while (priv->decompress.output_scanline
-			< priv->decompress.output_height) {
-		gint n = jpeg_read_scanlines(&priv->decompress, priv->lines,
-				priv->decompress.rec_outbuf_height);
-		if (!n) {
-			break;
+	for (gint i = 0; i < count; ++i) {
+		const guchar *in = lines[i];
+		guchar *out = data + row_step * i;
+		for (gint j = 0; j < cinfo->output_width; ++j) {
+			guint k = in[3];
+			out[QAHIRA_R] = div255(k * in[0]);
+			out[QAHIRA_G] = div255(k * in[1]);
+			out[QAHIRA_B] = div255(k * in[2]);
+			out += pixel_step;
+			in += 4;
 		}
-		switch (priv->decompress.out_color_space) {
-		case JCS_GRAYSCALE:
-			convert_grayscale(self);
-			break;
-		case JCS_RGB:
-			convert_rgb(self);
-			break;
-		case JCS_CMYK:
-			convert_cmyk(self);
-			break;
-		default:
-			g_set_error(error, QAHIRA_ERROR,
-					QAHIRA_ERROR_UNSUPPORTED,
-					Q_("jpeg: colorspace %s unsupported"),
-					colorspace_name(priv->decompress.out_color_space));
-			return FALSE;
+	}
+}
+
+#if HAVE_DECL_JCS_RGB565
+/**
+ * \brief Copy RGB565 output to a 16-bit surface.
+ *
+ * Only used when the surface is rotated or mirrored, otherwise scan lines
+ * are decoded directly into the surface.
+ */
+static void
+convert_rgb565(j_decompress_ptr cinfo, JSAMPARRAY lines, gint count,
+		guchar *data, gint row_step, gint pixel_step)
+{
+	for (gint i = 0; i < count; ++i) {
+		const guint16 *in = (const guint16 *)lines[i];
+		guchar *out = data + row_step * i;
+		for (gint j = 0; j < cinfo->output_width; ++j) {
+			*(guint16 *)out = in[j];
+			out += pixel_step;
 		}
 	}
-	return TRUE;
 }
+#endif
+
+#define QAHIRA_YCC_BITS (16)
+#define QAHIRA_YCC_HALF (1 << (QAHIRA_YCC_BITS - 1))
+#define QAHIRA_YCC_FIX(x) ((gint)((x) * (1 << QAHIRA_YCC_BITS) + 0.5))
 
 /**
- * \brief Progressively load JPEG scan lines.
+ * \brief YCbCr to RGB lookup tables, identical to those used by libjpeg.
  */
-static inline gboolean
-load_progressive(QahiraFormat *self, GError **error)
+static struct {
+	gint cr_r[256];
+	gint cb_b[256];
+	gint cr_g[256];
+	gint cb_g[256];
+} ycc;
+
+static gpointer
+ycc_init(gpointer data)
+{
+	for (gint i = 0; i < 256; ++i) {
+		gint x = i - 128;
+		ycc.cr_r[i] = (QAHIRA_YCC_FIX(1.40200) * x + QAHIRA_YCC_HALF)
+			>> QAHIRA_YCC_BITS;
+		ycc.cb_b[i] = (QAHIRA_YCC_FIX(1.77200) * x + QAHIRA_YCC_HALF)
+			>> QAHIRA_YCC_BITS;
+		ycc.cr_g[i] = -QAHIRA_YCC_FIX(0.71414) * x;
+		ycc.cb_g[i] = -QAHIRA_YCC_FIX(0.34414) * x + QAHIRA_YCC_HALF;
+	}
+	return NULL;
+}
+
+static inline guint
+clamp(gint x)
+{
+	return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+/**
+ * \brief Convert inverted (Adobe) JPEG YCCK to RGB.
+ *
+ * Fuses the YCC to CMY transform with the CMYK to RGB conversion. The
+ * inverted CMY channels are the RGB values of the YCC triplet.
+ */
+static void
+convert_ycck_adobe(j_decompress_ptr cinfo, JSAMPARRAY lines, gint count,
+		guchar *data, gint row_step, gint pixel_step)
+{
+	for (gint i = 0; i < count; ++i) {
+		const guchar *in = lines[i];
+		guchar *out = data + row_step * i;
+		for (gint j = 0; j < cinfo->output_width; ++j) {
+			gint y = in[0];
+			guint k = in[3];
+			guint r = clamp(y + ycc.cr_r[in[2]]);
+			guint g = clamp(y + ((ycc.cb_g[in[1]] + ycc.cr_g[in[2]])
+						>> QAHIRA_YCC_BITS));
+			guint b = clamp(y + ycc.cb_b[in[1]]);
+			out[QAHIRA_R] = div255(k * (255 - r));
+			out[QAHIRA_G] = div255(k * (255 - g));
+			out[QAHIRA_B] = div255(k * (255 - b));
+			out += pixel_step;
+			in += 4;
+		}
+	}
+}
+
+/**
+ * \brief Select the output color space & converter for an image.
+ *
+ * Must be called after jpeg_read_header().
+ *
+ * \return The converter, or NULL if the color space is unsupported.
+ */
+static Convert
+set_output(QahiraFormat *self)
 {
 	struct Private *priv = GET_PRIVATE(self);
-	gboolean in_output = FALSE;
-	while (!jpeg_input_complete(&priv->decompress)) {
-		if (!in_output) {
-			gint scan = priv->decompress.input_scan_number;
-			if (jpeg_start_output(&priv->decompress, scan)) {
-				in_output = TRUE;
-			} else {
-				break;
-			}
+	j_decompress_ptr cinfo = &priv->decompress;
+#if HAVE_DECL_JCS_RGB565
+	if (CAIRO_FORMAT_RGB16_565 == priv->format
+			&& (JCS_GRAYSCALE == cinfo->out_color_space
+				|| JCS_RGB == cinfo->out_color_space)) {
+		cinfo->out_color_space = JCS_RGB565;
+		cinfo->dither_mode = priv->dither
+			? JDITHER_ORDERED
+			: JDITHER_NONE;
+		return convert_rgb565;
+	}
+#endif
+	switch (cinfo->out_color_space) {
+	case JCS_GRAYSCALE:
+		return convert_grayscale;
+	case JCS_RGB:
+		return convert_rgb;
+	case JCS_CMYK:
+		if (JCS_YCCK == cinfo->jpeg_color_space
+				&& cinfo->saw_Adobe_marker) {
+			static GOnce once = G_ONCE_INIT;
+			g_once(&once, ycc_init, NULL);
+			// skip the intermediate CMYK conversion
+			cinfo->out_color_space = JCS_YCCK;
+			return convert_ycck_adobe;
 		}
-		if (!load_lines(self, error)) {
-			return FALSE;
+		return cinfo->saw_Adobe_marker
+			? convert_cmyk_adobe
+			: convert_cmyk;
+	default:
+		return NULL;
+	}
+}
+
+/**
+ * \brief EXIF (TIFF) data saved from an APP1 marker.
+ */
+struct Exif {
+	const JOCTET *data; // TIFF header
+	guint size;
+	gboolean motorola; // big-endian byte order
+};
+
+static inline guint
+exif_get16(const struct Exif *exif, guint offset)
+{
+	const JOCTET *p = exif->data + offset;
+	return exif->motorola ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
+
+static inline guint32
+exif_get32(const struct Exif *exif, guint offset)
+{
+	const JOCTET *p = exif->data + offset;
+	return exif->motorola
+		? ((guint32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]
+		: ((guint32)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+/**
+ * \brief Find the EXIF data in the saved markers.
+ */
+static gboolean
+exif_init(struct Exif *exif, j_decompress_ptr cinfo)
+{
+	for (jpeg_saved_marker_ptr marker = cinfo->marker_list; marker;
+			marker = marker->next) {
+		if (JPEG_APP0 + 1 != marker->marker
+				|| 14 > marker->data_length
+				|| memcmp(marker->data, "Exif\0\0", 6)) {
+			continue;
 		}
-		if (priv->decompress.output_scanline >=
-				priv->decompress.output_height
-				&& jpeg_finish_output(&priv->decompress)) {
-			g_signal_emit(self, signals[SIGNAL_PROGRESSIVE], 0,
-					priv->surface);
-			in_output = FALSE;
+		exif->data = marker->data + 6;
+		exif->size = marker->data_length - 6;
+		if (!memcmp(exif->data, "II\x2a\0", 4)) {
+			exif->motorola = FALSE;
+		} else if (!memcmp(exif->data, "MM\0\x2a", 4)) {
+			exif->motorola = TRUE;
+		} else {
+			continue;
 		}
+		return TRUE;
 	}
-	return TRUE;
+	return FALSE;
 }
 
-static cairo_surface_t *
-load(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
-		GError **error)
+/**
+ * \brief Get the offset of an image file directory.
+ *
+ * Offsets come from the file, they are compared against the remaining
+ * size so that they cannot wrap (exif_init() ensures a size of 8).
+ *
+ * \param index 0 for the primary image, 1 for the thumbnail
+ *
+ * \return The IFD offset, or zero if it does not exist.
+ */
+static guint32
+exif_ifd(const struct Exif *exif, gint index)
 {
-	struct Private *priv = GET_PRIVATE(self);
-	if (sigsetjmp(priv->env, 1)) {
-		goto error;
+	guint32 offset = exif_get32(exif, 4);
+	while (offset && index--) {
+		// the entry count & the next IFD offset
+		if (offset > exif->size - 6) {
+			return 0;
+		}
+		guint count = exif_get16(exif, offset);
+		if (count > (exif->size - offset - 6) / 12) {
+			return 0;
+		}
+		offset = exif_get32(exif, offset + 2 + 12 * count);
 	}
-	priv->error = error;
-	priv->input = g_object_ref(stream);
-	if (cancel) {
-		priv->cancel = g_object_ref(cancel);
+	return offset <= exif->size - 2 ? offset : 0;
+}
+
+/**
+ * \brief Find the entry of a tag in an image file directory.
+ *
+ * \return The entry offset, or zero if the tag does not exist.
+ */
+static guint32
+exif_find_tag(const struct Exif *exif, guint32 ifd, guint tag)
+{
+	if (!ifd) {
+		return 0;
 	}
-	jpeg_abort_decompress(&priv->decompress);
-	jpeg_save_markers(&priv->decompress, JPEG_APP0 + 1, 0xffff);
-	jpeg_read_header(&priv->decompress, TRUE);
-	jpeg_start_decompress(&priv->decompress);
-	priv->surface = qahira_format_surface_create(self, CAIRO_FORMAT_RGB24,
-			priv->decompress.output_width,
-			priv->decompress.output_height);
+	guint count = exif_get16(exif, ifd);
+	for (guint i = 0; i < count; ++i) {
+		guint32 entry = ifd + 2 + 12 * i;
+		if (entry + 12 > exif->size) {
+			return 0;
+		}
+		if (tag == exif_get16(exif, entry)) {
+			return entry;
+		}
+	}
+	return 0;
+}
+
+/**
+ * \brief Get the value of a SHORT or LONG tag.
+ */
+static gboolean
+exif_get_tag(const struct Exif *exif, guint32 ifd, guint tag, guint32 *value)
+{
+	guint32 entry = exif_find_tag(exif, ifd, tag);
+	if (!entry) {
+		return FALSE;
+	}
+	switch (exif_get16(exif, entry + 2)) {
+	case 3: // SHORT
+		*value = exif_get16(exif, entry + 8);
+		return TRUE;
+	case 4: // LONG
+		*value = exif_get32(exif, entry + 8);
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/**
+ * \brief Get the EXIF orientation of the primary image.
+ *
+ * \return The orientation (1-8), 1 if it is missing or invalid.
+ */
+static gint
+read_orientation(j_decompress_ptr cinfo)
+{
+	struct Exif exif;
+	guint32 orientation;
+	if (exif_init(&exif, cinfo)
+			&& exif_get_tag(&exif, exif_ifd(&exif, 0), 0x0112,
+				&orientation)
+			&& 1 <= orientation && 8 >= orientation) {
+		return orientation;
+	}
+	return 1;
+}
+
+/**
+ * \brief Reset the EXIF orientation of the primary image to 1.
+ *
+ * The saved markers are modified in place before they are copied.
+ */
+static void
+reset_orientation(j_decompress_ptr cinfo)
+{
+	struct Exif exif;
+	if (!exif_init(&exif, cinfo)) {
+		return;
+	}
+	guint32 entry = exif_find_tag(&exif, exif_ifd(&exif, 0), 0x0112);
+	if (!entry) {
+		return;
+	}
+	JOCTET *value = (JOCTET *)exif.data + entry + 8;
+	switch (exif_get16(&exif, entry + 2)) {
+	case 3: // SHORT
+		memset(value, 0, 2);
+		value[exif.motorola ? 1 : 0] = 1;
+		break;
+	case 4: // LONG
+		memset(value, 0, 4);
+		value[exif.motorola ? 3 : 0] = 1;
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * \brief Apply the decoder speed/quality trade-off.
+ *
+ * Must be called between jpeg_read_header() and jpeg_start_decompress().
+ */
+static inline void
+set_profile(QahiraFormat *self)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	switch (priv->profile) {
+	case QAHIRA_FORMAT_JPEG_PROFILE_FAST:
+		// integer IDCT & merged upsampling
+		priv->decompress.dct_method = JDCT_IFAST;
+		priv->decompress.do_fancy_upsampling = FALSE;
+		priv->decompress.do_block_smoothing = FALSE;
+		break;
+	case QAHIRA_FORMAT_JPEG_PROFILE_ACCURATE:
+		// slow integer IDCT & triangle filter upsampling
+		priv->decompress.dct_method = JDCT_ISLOW;
+		priv->decompress.do_fancy_upsampling = TRUE;
+		priv->decompress.do_block_smoothing = TRUE;
+		break;
+	case QAHIRA_FORMAT_JPEG_PROFILE_DEFAULT:
+	default:
+		priv->decompress.dct_method = JDCT_ISLOW;
+		priv->decompress.do_fancy_upsampling = FALSE;
+		priv->decompress.do_block_smoothing = FALSE;
+		break;
+	}
+}
+
+/**
+ * \brief Create the destination surface.
+ */
+static gboolean
+create_surface(QahiraFormat *self, cairo_format_t format, gint width,
+		gint height, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	priv->surface = qahira_format_surface_create(self, format, width,
+			height);
 	if (!priv->surface) {
 		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
 				Q_("jpeg: out of memory"));
-		goto exit;
+		return FALSE;
 	}
 	cairo_status_t err = cairo_surface_status(priv->surface);
 	if (CAIRO_STATUS_SUCCESS != err) {
 		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_CAIRO,
 				"jpeg: %s", cairo_status_to_string(err));
-		goto error;
+		return FALSE;
 	}
 	priv->data = qahira_format_surface_get_data(self, priv->surface);
 	if (G_UNLIKELY(!priv->data)) {
 		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
 				Q_("jpeg: surface data is NULL"));
-		goto error;
+		return FALSE;
 	}
 	priv->stride = qahira_format_surface_get_stride(self, priv->surface);
 	if (G_UNLIKELY(0 > priv->stride)) {
 		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
 				Q_("jpeg: invalid stride"));
-		goto error;
+		return FALSE;
 	}
-	if (priv->count != priv->decompress.rec_outbuf_height) {
-		priv->lines = priv->decompress.mem->alloc_sarray(
-				(j_common_ptr)&priv->decompress,
-				JPOOL_IMAGE, priv->stride,
-				priv->decompress.rec_outbuf_height);
-		if (G_UNLIKELY(!priv->lines)) {
-			g_set_error(error, QAHIRA_ERROR,
-					QAHIRA_ERROR_NO_MEMORY,
-					Q_("jpeg: out of memory"));
-			goto error;
+	cairo_surface_flush(priv->surface);
+	return TRUE;
+}
+
+/**
+ * \brief Create the destination surface for the decoded image.
+ *
+ * The surface is rotated and mirrored per priv->orientation. Decoded row y
+ * starts at priv->data + priv->origin + y * priv->row_step, consecutive
+ * pixels are priv->pixel_step bytes apart.
+ */
+static gboolean
+create_oriented_surface(QahiraFormat *self, gint width, gint height,
+		GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	cairo_format_t format = CAIRO_FORMAT_RGB24;
+	gint size = 4; // bytes per pixel
+#if HAVE_DECL_JCS_RGB565
+	if (JCS_RGB565 == priv->decompress.out_color_space) {
+		format = CAIRO_FORMAT_RGB16_565;
+		size = 2;
+	}
+#endif
+	gboolean swap = 5 <= priv->orientation;
+	if (!create_surface(self, format, swap ? height : width,
+				swap ? width : height, error)) {
+		return FALSE;
+	}
+	gint stride = priv->stride;
+	switch (priv->orientation) {
+	case 2: // mirror horizontal
+		priv->origin = (width - 1) * size;
+		priv->row_step = stride;
+		priv->pixel_step = -size;
+		break;
+	case 3: // rotate 180
+		priv->origin = (height - 1) * stride + (width - 1) * size;
+		priv->row_step = -stride;
+		priv->pixel_step = -size;
+		break;
+	case 4: // mirror vertical
+		priv->origin = (height - 1) * stride;
+		priv->row_step = -stride;
+		priv->pixel_step = size;
+		break;
+	case 5: // transpose
+		priv->origin = 0;
+		priv->row_step = size;
+		priv->pixel_step = stride;
+		break;
+	case 6: // rotate 90 clockwise
+		priv->origin = (height - 1) * size;
+		priv->row_step = -size;
+		priv->pixel_step = stride;
+		break;
+	case 7: // transverse
+		priv->origin = (height - 1) * size + (width - 1) * stride;
+		priv->row_step = -size;
+		priv->pixel_step = -stride;
+		break;
+	case 8: // rotate 270 clockwise
+		priv->origin = (width - 1) * stride;
+		priv->row_step = size;
+		priv->pixel_step = -stride;
+		break;
+	case 1:
+	default:
+		priv->origin = 0;
+		priv->row_step = stride;
+		priv->pixel_step = size;
+		break;
+	}
+	return TRUE;
+}
+
+/**
+ * \brief Load JPEG scan lines.
+ */
+static inline gboolean
+load_lines(QahiraFormat *self, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	while (priv->decompress.output_scanline
+			< priv->decompress.output_height) {
+		if (priv->direct) {
+			gint last = priv->decompress.output_height - 1;
+			for (gint i = 0; i < priv->decompress.rec_outbuf_height;
+					++i) {
+				gint row = MIN(priv->decompress.output_scanline
+						+ i, last);
+				priv->lines[i] = priv->data + priv->stride * row;
+			}
+		}
+		gint n = jpeg_read_scanlines(&priv->decompress, priv->lines,
+				priv->decompress.rec_outbuf_height);
+		if (!n) {
+			break;
+		}
+		if (priv->direct) {
+			continue;
+		}
+		priv->convert(&priv->decompress, priv->lines, n,
+				priv->data + priv->origin + priv->row_step
+				* (priv->decompress.output_scanline - n),
+				priv->row_step, priv->pixel_step);
+	}
+	return TRUE;
+}
+
+/**
+ * \brief Progressively load JPEG scan lines.
+ */
+static inline gboolean
+load_progressive(QahiraFormat *self, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	gboolean in_output = FALSE;
+	while (!jpeg_input_complete(&priv->decompress)) {
+		if (!in_output) {
+			gint scan = priv->decompress.input_scan_number;
+			if (jpeg_start_output(&priv->decompress, scan)) {
+				in_output = TRUE;
+			} else {
+				break;
+			}
+		}
+		if (!load_lines(self, error)) {
+			return FALSE;
+		}
+		if (priv->decompress.output_scanline >=
+				priv->decompress.output_height
+				&& jpeg_finish_output(&priv->decompress)) {
+			g_signal_emit(self, signals[SIGNAL_PROGRESSIVE], 0,
+					priv->surface);
+			in_output = FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * \brief Load the first usable scan of a progressive JPEG.
+ *
+ * The first scan usually holds only the DC coefficients, i.e. a low
+ * quality rendition of the image. The remaining scans are not read.
+ */
+static inline gboolean
+load_preview(QahiraFormat *self, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	jpeg_start_output(&priv->decompress,
+			priv->decompress.input_scan_number);
+	if (!load_lines(self, error)) {
+		return FALSE;
+	}
+	jpeg_finish_output(&priv->decompress);
+	return TRUE;
+}
+
+/**
+ * \brief Check if multi-pass output will be observed.
+ */
+static inline gboolean
+has_progressive_handler(QahiraFormat *self)
+{
+	if (QAHIRA_FORMAT_JPEG_GET_CLASS(self)->progressive) {
+		return TRUE;
+	}
+	return g_signal_has_handler_pending(self, signals[SIGNAL_PROGRESSIVE],
+			0, TRUE);
+}
+
+/**
+ * \brief Decode the image with the main decompressor.
+ */
+static gboolean
+decode(QahiraFormat *self, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	// without a listener a progressive image is decoded in a single pass
+	priv->decompress.buffered_image = priv->decompress.progressive_mode
+		&& (priv->preview || has_progressive_handler(self));
+	jpeg_start_decompress(&priv->decompress);
+	if (!create_oriented_surface(self, priv->decompress.output_width,
+				priv->decompress.output_height, error)) {
+		return FALSE;
+	}
+#if HAVE_DECL_JCS_RGB565
+	// 16-bit output needs no conversion unless the image is reoriented
+	priv->direct = JCS_RGB565 == priv->decompress.out_color_space
+		&& 0 == priv->origin && priv->stride == priv->row_step;
+#else
+	priv->direct = FALSE;
+#endif
+	// the image pool is released by jpeg_finish_decompress()
+	if (priv->direct) {
+		priv->lines = priv->decompress.mem->alloc_small(
+				(j_common_ptr)&priv->decompress, JPOOL_IMAGE,
+				priv->decompress.rec_outbuf_height
+					* sizeof(JSAMPROW));
+	} else {
+		priv->lines = priv->decompress.mem->alloc_sarray(
+				(j_common_ptr)&priv->decompress, JPOOL_IMAGE,
+				priv->decompress.output_width
+					* priv->decompress.output_components,
+				priv->decompress.rec_outbuf_height);
+	}
+	if (G_UNLIKELY(!priv->lines)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
+				Q_("jpeg: out of memory"));
+		return FALSE;
+	}
+	if (priv->decompress.buffered_image) {
+		if (priv->preview) {
+			if (!load_preview(self, error)) {
+				return FALSE;
+			}
+		} else {
+			if (!load_progressive(self, error)) {
+				return FALSE;
+			}
+		}
+	} else {
+		if (!load_lines(self, error)) {
+			return FALSE;
+		}
+	}
+	if (priv->decompress.buffered_image && priv->preview) {
+		// discard the remaining scans
+		jpeg_abort_decompress(&priv->decompress);
+	} else {
+		jpeg_finish_decompress(&priv->decompress);
+	}
+	return TRUE;
+}
+
+/**
+ * \brief Fill the JPEG input buffer from memory.
+ *
+ * All data is supplied up front, running out means the data is truncated.
+ */
+static boolean
+memory_fill_input_buffer(j_decompress_ptr cinfo)
+{
+	static const JOCTET eoi[2] = { (JOCTET)0xff, (JOCTET)JPEG_EOI };
+	cinfo->src->next_input_byte = eoi;
+	cinfo->src->bytes_in_buffer = 2;
+	return TRUE;
+}
+
+/**
+ * \brief Skip JPEG input data in memory.
+ */
+static void
+memory_skip_input_data(j_decompress_ptr cinfo, glong bytes)
+{
+	if (0 < bytes) {
+		if (bytes > cinfo->src->bytes_in_buffer) {
+			(void)memory_fill_input_buffer(cinfo);
+		} else {
+			cinfo->src->next_input_byte += bytes;
+			cinfo->src->bytes_in_buffer -= bytes;
+		}
+	}
+}
+
+/**
+ * \brief A horizontal band of a JPEG decoded by a worker thread.
+ */
+typedef struct Band_ {
+	struct jpeg_decompress_struct decompress;
+	struct jpeg_source_mgr source_mgr;
+	struct jpeg_error_mgr error_mgr;
+	sigjmp_buf env;
+	JOCTET *data; // a complete JPEG holding only this band
+	gsize size;
+	gint row; // first destination row
+	GError *error;
+} Band;
+
+/**
+ * \brief Convert a band JPEG error to a GError.
+ */
+G_GNUC_NORETURN
+static void
+band_error_exit(j_common_ptr cinfo)
+{
+	Band *band = cinfo->client_data;
+	gchar message[JMSG_LENGTH_MAX];
+	cinfo->err->format_message(cinfo, message);
+	g_set_error(&band->error, QAHIRA_ERROR,
+			cinfo->err->msg_code == JERR_OUT_OF_MEMORY
+				? QAHIRA_ERROR_NO_MEMORY
+				: QAHIRA_ERROR_CORRUPT_IMAGE,
+			Q_("jpeg: %s"), message);
+	siglongjmp(band->env, 1);
+}
+
+static void
+band_free(Band *band)
+{
+	if (band) {
+		g_free(band->data);
+		g_clear_error(&band->error);
+		g_free(band);
+	}
+}
+
+/**
+ * \brief Copy the decoding tables of the main decompressor to a band.
+ *
+ * Abbreviated images rely on tables loaded from an earlier stream, the
+ * band header only holds the tables defined by the image itself.
+ */
+static void
+copy_tables(j_decompress_ptr dest, j_decompress_ptr src)
+{
+	for (gint i = 0; i < NUM_QUANT_TBLS; ++i) {
+		if (src->quant_tbl_ptrs[i]) {
+			dest->quant_tbl_ptrs[i] =
+				jpeg_alloc_quant_table((j_common_ptr)dest);
+			*dest->quant_tbl_ptrs[i] = *src->quant_tbl_ptrs[i];
+		}
+	}
+	for (gint i = 0; i < NUM_HUFF_TBLS; ++i) {
+		if (src->dc_huff_tbl_ptrs[i]) {
+			dest->dc_huff_tbl_ptrs[i] =
+				jpeg_alloc_huff_table((j_common_ptr)dest);
+			*dest->dc_huff_tbl_ptrs[i] = *src->dc_huff_tbl_ptrs[i];
+		}
+		if (src->ac_huff_tbl_ptrs[i]) {
+			dest->ac_huff_tbl_ptrs[i] =
+				jpeg_alloc_huff_table((j_common_ptr)dest);
+			*dest->ac_huff_tbl_ptrs[i] = *src->ac_huff_tbl_ptrs[i];
+		}
+	}
+}
+
+/**
+ * \brief Decode a band into the destination surface (worker thread).
+ */
+static void
+load_band(gpointer data, gpointer user_data)
+{
+	Band *band = data;
+	struct Private *priv = user_data;
+	if (sigsetjmp(band->env, 1)) {
+		jpeg_destroy_decompress(&band->decompress);
+		return;
+	}
+	band->decompress.err = jpeg_std_error(&band->error_mgr);
+	band->error_mgr.error_exit = band_error_exit;
+	band->error_mgr.output_message = output_message;
+	jpeg_create_decompress(&band->decompress);
+	band->decompress.client_data = band;
+	band->decompress.src = &band->source_mgr;
+	band->source_mgr.init_source = init_source;
+	band->source_mgr.fill_input_buffer = memory_fill_input_buffer;
+	band->source_mgr.skip_input_data = memory_skip_input_data;
+	band->source_mgr.resync_to_restart = jpeg_resync_to_restart;
+	band->source_mgr.term_source = term_source;
+	band->source_mgr.next_input_byte = band->data;
+	band->source_mgr.bytes_in_buffer = band->size;
+	copy_tables(&band->decompress, &priv->decompress);
+	jpeg_read_header(&band->decompress, TRUE);
+	band->decompress.out_color_space = priv->decompress.out_color_space;
+	band->decompress.dither_mode = priv->decompress.dither_mode;
+	band->decompress.dct_method = priv->decompress.dct_method;
+	band->decompress.do_fancy_upsampling =
+		priv->decompress.do_fancy_upsampling;
+	jpeg_start_decompress(&band->decompress);
+	JSAMPARRAY lines = band->decompress.mem->alloc_sarray(
+			(j_common_ptr)&band->decompress, JPOOL_IMAGE,
+			band->decompress.output_width
+				* band->decompress.output_components,
+			band->decompress.rec_outbuf_height);
+	while (band->decompress.output_scanline
+			< band->decompress.output_height) {
+		if (priv->cancel && g_cancellable_set_error_if_cancelled(
+					priv->cancel, &band->error)) {
+			break;
+		}
+		gint n = jpeg_read_scanlines(&band->decompress, lines,
+				band->decompress.rec_outbuf_height);
+		if (!n) {
+			break;
+		}
+		priv->convert(&band->decompress, lines, n,
+				priv->data + priv->origin + priv->row_step
+				* (band->row + band->decompress.output_scanline
+					- n),
+				priv->row_step, priv->pixel_step);
+	}
+	jpeg_destroy_decompress(&band->decompress);
+}
+
+/**
+ * \brief Check if the image can be split at restart markers.
+ *
+ * Must be called after jpeg_read_header().
+ */
+static inline gboolean
+can_load_parallel(QahiraFormat *self)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	j_decompress_ptr cinfo = &priv->decompress;
+	if (!cinfo->restart_interval || cinfo->progressive_mode
+			|| cinfo->arith_code) {
+		return FALSE;
+	}
+	// all components must be interleaved in a single scan
+	if (cinfo->comps_in_scan != cinfo->num_components) {
+		return FALSE;
+	}
+	if (cinfo->scale_num != cinfo->scale_denom) {
+		return FALSE;
+	}
+	// fancy vertical upsampling blends rows across band edges
+	if (cinfo->do_fancy_upsampling && 1 < cinfo->max_v_samp_factor) {
+		return FALSE;
+	}
+	if ((gsize)cinfo->image_width * cinfo->image_height
+			< QAHIRA_JPEG_PARALLEL_SIZE) {
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * \brief Buffer the remainder of the input stream.
+ */
+static gboolean
+read_remaining(QahiraFormat *self, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	for (;;) {
+		guint length = priv->record->len;
+		g_byte_array_set_size(priv->record,
+				length + QAHIRA_JPEG_BUFFER_SIZE);
+		gssize bytes = g_input_stream_read(priv->input,
+				priv->record->data + length,
+				QAHIRA_JPEG_BUFFER_SIZE,
+				priv->cancel, error);
+		if (G_UNLIKELY(-1 == bytes)) {
+			g_byte_array_set_size(priv->record, length);
+			return FALSE;
+		}
+		g_byte_array_set_size(priv->record, length + bytes);
+		if (!bytes) {
+			return TRUE;
+		}
+	}
+}
+
+/**
+ * \brief Locate the restart markers of a single scan JPEG.
+ *
+ * \param sof [out] Offset of the SOF0/SOF1 marker
+ * \param sos [out] Offset of the entropy coded data
+ * \param eos [out] Offset of the EOI marker
+ *
+ * \return The restart marker offsets, or NULL if the scan cannot be split.
+ */
+static GArray *
+find_restarts(const JOCTET *data, gsize size, gsize *sof, gsize *sos,
+		gsize *eos)
+{
+	if (4 > size || 0xff != data[0] || 0xd8 != data[1]) {
+		return NULL;
+	}
+	gsize pos = 2;
+	*sof = 0;
+	for (;;) {
+		if (pos + 4 > size || 0xff != data[pos]) {
+			return NULL;
+		}
+		JOCTET marker = data[pos + 1];
+		if (0xff == marker) {
+			++pos; // fill byte
+			continue;
+		}
+		gsize length = (data[pos + 2] << 8) | data[pos + 3];
+		if (0xc0 == marker || 0xc1 == marker) {
+			*sof = pos;
+		} else if (0xc0 <= marker && 0xcf >= marker && 0xc4 != marker) {
+			// progressive, lossless & arithmetic coding
+			return NULL;
+		} else if (0xda == marker) {
+			*sos = pos + 2 + length;
+			break;
+		} else if (0xd0 <= marker && 0xd9 >= marker) {
+			return NULL;
+		}
+		pos += 2 + length;
+	}
+	if (!*sof || *sos > size) {
+		return NULL;
+	}
+	GArray *restarts = g_array_new(FALSE, FALSE, sizeof(gsize));
+	const JOCTET *p = data + *sos;
+	const JOCTET *end = data + size - 1;
+	while (p < end) {
+		p = memchr(p, 0xff, end - p);
+		if (!p) {
+			break;
+		}
+		JOCTET marker = p[1];
+		if (0x00 == marker) {
+			p += 2; // stuffed zero byte
+		} else if (0xff == marker) {
+			++p; // fill byte
+		} else if (0xd0 <= marker && 0xd7 >= marker) {
+			if ((restarts->len & 7) != marker - 0xd0) {
+				break;
+			}
+			gsize offset = p - data;
+			g_array_append_val(restarts, offset);
+			p += 2;
+		} else {
+			if (JPEG_EOI != marker) {
+				break; // DNL or another scan
+			}
+			*eos = p - data;
+			return restarts;
+		}
+	}
+	g_array_free(restarts, TRUE);
+	return NULL;
+}
+
+static inline guint
+gcd(guint a, guint b)
+{
+	while (b) {
+		guint t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/**
+ * \brief Split the buffered JPEG into independently decodable bands.
+ *
+ * Each band is a complete JPEG made of the original headers (with the
+ * image height adjusted) and the entropy coded segments between two
+ * restart markers that fall on MCU row boundaries.
+ *
+ * \return An array of \a count bands, or NULL if the image cannot be split.
+ */
+static Band **
+split_bands(QahiraFormat *self, gint *count)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	j_decompress_ptr cinfo = &priv->decompress;
+	const JOCTET *data = priv->record->data;
+	gsize sof, sos, eos;
+	GArray *restarts = find_restarts(data, priv->record->len,
+			&sof, &sos, &eos);
+	if (!restarts) {
+		return NULL;
+	}
+	Band **bands = NULL;
+	// MCU dimensions
+	gint mcu_width = DCTSIZE * cinfo->max_h_samp_factor;
+	gint mcu_height = DCTSIZE * cinfo->max_v_samp_factor;
+	if (1 == cinfo->comps_in_scan) {
+		mcu_width /= cinfo->comp_info[0].h_samp_factor;
+		mcu_height /= cinfo->comp_info[0].v_samp_factor;
+	}
+	guint columns = (cinfo->image_width + mcu_width - 1) / mcu_width;
+	guint rows = (cinfo->image_height + mcu_height - 1) / mcu_height;
+	guint interval = cinfo->restart_interval;
+	guint segments = ((guint64)columns * rows + interval - 1) / interval;
+	if (restarts->len + 1 != segments) {
+		goto exit;
+	}
+	// the number of MCU rows between restart markers on a row boundary
+	guint step = interval / gcd(interval, columns);
+	guint units = (rows + step - 1) / step;
+	gint n = MIN(units, QAHIRA_JPEG_BANDS_PER_THREAD
+			* qahira_format_get_thread_count(self));
+	if (2 > n) {
+		goto exit;
+	}
+	bands = g_try_new0(Band *, n);
+	if (G_UNLIKELY(!bands)) {
+		goto exit;
+	}
+	for (gint i = 0; i < n; ++i) {
+		guint first = (guint64)units * i / n * step;
+		guint last = MIN((guint64)units * (i + 1) / n * step, rows);
+		guint segment = (guint64)first * columns / interval;
+		guint next = last < rows
+			? (guint64)last * columns / interval
+			: segments;
+		gsize start = segment
+			? g_array_index(restarts, gsize, segment - 1) + 2
+			: sos;
+		gsize end = last < rows
+			? g_array_index(restarts, gsize, next - 1)
+			: eos;
+		gint height = MIN(last * mcu_height, cinfo->image_height)
+			- first * mcu_height;
+		Band *band = bands[i] = g_try_new0(Band, 1);
+		if (G_UNLIKELY(!band)) {
+			goto error;
+		}
+		band->size = sos + (end - start) + 2;
+		band->data = g_try_malloc(band->size);
+		if (G_UNLIKELY(!band->data)) {
+			goto error;
+		}
+		band->row = first * mcu_height;
+		memcpy(band->data, data, sos);
+		band->data[sof + 5] = (height >> 8) & 0xff;
+		band->data[sof + 6] = height & 0xff;
+		memcpy(band->data + sos, data + start, end - start);
+		// renumber the restart markers from zero
+		for (guint j = segment; j + 1 < next; ++j) {
+			gsize offset = g_array_index(restarts, gsize, j);
+			band->data[sos + offset - start + 1] =
+				0xd0 + ((j - segment) & 7);
+		}
+		band->data[band->size - 2] = (JOCTET)0xff;
+		band->data[band->size - 1] = (JOCTET)JPEG_EOI;
+	}
+	*count = n;
+exit:
+	g_array_free(restarts, TRUE);
+	return bands;
+error:
+	for (gint i = 0; i < n; ++i) {
+		band_free(bands[i]);
+	}
+	g_free(bands);
+	bands = NULL;
+	goto exit;
+}
+
+/**
+ * \brief Restart decoding from the buffered stream.
+ */
+static void
+rewind_source(QahiraFormat *self)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	jpeg_abort_decompress(&priv->decompress);
+	priv->source_mgr.next_input_byte = priv->record->data;
+	priv->source_mgr.bytes_in_buffer = priv->record->len;
+	jpeg_read_header(&priv->decompress, TRUE);
+	set_profile(self);
+	priv->convert = set_output(self);
+}
+
+/**
+ * \brief Decode bands between restart markers concurrently.
+ *
+ * On success either the image has been decoded into priv->surface, or
+ * the image cannot be split and the decompressor has been rewound to
+ * decode the buffered stream serially.
+ */
+static gboolean
+load_parallel(QahiraFormat *self, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	if (!can_load_parallel(self)) {
+		g_byte_array_free(priv->record, TRUE);
+		priv->record = NULL;
+		return TRUE;
+	}
+	if (!read_remaining(self, error)) {
+		return FALSE;
+	}
+	// the input stream is now buffered in memory
+	g_object_unref(priv->input);
+	priv->input = NULL;
+	gint count = 0;
+	Band **bands = split_bands(self, &count);
+	if (!bands) {
+		rewind_source(self);
+		return TRUE;
+	}
+	gboolean status = create_oriented_surface(self,
+			priv->decompress.image_width,
+			priv->decompress.image_height, error);
+	if (status) {
+		qahira_format_run(self, load_band, (gpointer *)bands, count,
+				priv);
+	}
+	for (gint i = 0; i < count; ++i) {
+		if (status && bands[i]->error) {
+			g_propagate_error(error, bands[i]->error);
+			bands[i]->error = NULL;
+			status = FALSE;
+		}
+		band_free(bands[i]);
+	}
+	g_free(bands);
+	jpeg_abort_decompress(&priv->decompress);
+	return status;
+}
+
+/**
+ * \brief Load a JPEG image.
+ *
+ * \param orientation The EXIF orientation to apply, 0 to read it from the
+ *                    image if enabled
+ */
+static cairo_surface_t *
+load_image(QahiraFormat *self, GInputStream *stream, gint orientation,
+		GCancellable *cancel, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	if (sigsetjmp(priv->env, 1)) {
+		goto error;
+	}
+	priv->error = error;
+	priv->input = g_object_ref(stream);
+	if (cancel) {
+		priv->cancel = g_object_ref(cancel);
+	}
+	create_decompress(self);
+	jpeg_abort_decompress(&priv->decompress);
+	priv->source_mgr.next_input_byte = NULL;
+	priv->source_mgr.bytes_in_buffer = 0;
+	if (1 < qahira_format_get_thread_count(self)) {
+		// keep the input in case the image can be split
+		priv->record = g_byte_array_new();
+	}
+	jpeg_save_markers(&priv->decompress, JPEG_APP0 + 1, 0xffff);
+	jpeg_read_header(&priv->decompress, TRUE);
+	if (!orientation) {
+		orientation = priv->auto_orient
+			? read_orientation(&priv->decompress)
+			: 1;
+	}
+	priv->orientation = orientation;
+	set_profile(self);
+	priv->convert = set_output(self);
+	if (G_UNLIKELY(!priv->convert)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_UNSUPPORTED,
+				Q_("jpeg: colorspace %s unsupported"),
+				colorspace_name(
+					priv->decompress.out_color_space));
+		goto error;
+	}
+	if (priv->record) {
+		if (!load_parallel(self, error)) {
+			goto error;
+		}
+	}
+	if (!priv->surface) {
+		if (!decode(self, error)) {
+			goto error;
+		}
+	}
+	cairo_surface_mark_dirty(priv->surface);
+exit:
+	if (priv->record) {
+		g_byte_array_free(priv->record, TRUE);
+		priv->record = NULL;
+	}
+	if (priv->input) {
+		g_object_unref(priv->input);
+		priv->input = NULL;
+	}
+	if (priv->cancel) {
+		g_object_unref(priv->cancel);
+		priv->cancel = NULL;
+	}
+	cairo_surface_t *surface = priv->surface;
+	priv->surface = NULL;
+	return surface;
+error:
+	// release the image pool now rather than on the next load
+	jpeg_abort_decompress(&priv->decompress);
+	if (priv->surface) {
+		cairo_surface_destroy(priv->surface);
+		priv->surface = NULL;
+	}
+	goto exit;
+}
+
+static cairo_surface_t *
+load(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
+		GError **error)
+{
+	return load_image(self, stream, 0, cancel, error);
+}
+
+/**
+ * \brief Load the tables of abbreviated images from a tables-only stream.
+ *
+ * The tables are kept by the decompressor until a later stream redefines
+ * them.
+ */
+static gboolean
+load_tables(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
+		GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	gboolean status = TRUE;
+	if (sigsetjmp(priv->env, 1)) {
+		goto error;
+	}
+	priv->error = error;
+	priv->input = g_object_ref(stream);
+	if (cancel) {
+		priv->cancel = g_object_ref(cancel);
+	}
+	create_decompress(self);
+	jpeg_abort_decompress(&priv->decompress);
+	priv->source_mgr.next_input_byte = NULL;
+	priv->source_mgr.bytes_in_buffer = 0;
+	if (JPEG_HEADER_TABLES_ONLY
+			!= jpeg_read_header(&priv->decompress, FALSE)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
+				Q_("jpeg: stream does not contain only tables"));
+		goto error;
+	}
+exit:
+	if (priv->input) {
+		g_object_unref(priv->input);
+		priv->input = NULL;
+	}
+	if (priv->cancel) {
+		g_object_unref(priv->cancel);
+		priv->cancel = NULL;
+	}
+	return status;
+error:
+	status = FALSE;
+	goto exit;
+}
+
+/**
+ * \brief Find the JPEG thumbnail in EXIF IFD1 or a JFXX marker.
+ */
+static gboolean
+find_jpeg_thumbnail(j_decompress_ptr cinfo, const JOCTET **data,
+		guint *size)
+{
+	struct Exif exif;
+	if (exif_init(&exif, cinfo)) {
+		guint32 ifd = exif_ifd(&exif, 1);
+		guint32 offset, length;
+		if (exif_get_tag(&exif, ifd, 0x0201, &offset)
+				&& exif_get_tag(&exif, ifd, 0x0202, &length)
+				&& length && offset < exif.size
+				&& length <= exif.size - offset) {
+			*data = exif.data + offset;
+			*size = length;
+			return TRUE;
+		}
+	}
+	for (jpeg_saved_marker_ptr marker = cinfo->marker_list; marker;
+			marker = marker->next) {
+		if (JPEG_APP0 == marker->marker && 6 < marker->data_length
+				&& !memcmp(marker->data, "JFXX\0\x10", 6)) {
+			*data = marker->data + 6;
+			*size = marker->data_length - 6;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/**
+ * \brief Find an uncompressed RGB thumbnail in a JFIF or JFXX marker.
+ *
+ * \return The first RGB triplet, or NULL.
+ */
+static const JOCTET *
+find_rgb_thumbnail(j_decompress_ptr cinfo, gint *width, gint *height)
+{
+	for (jpeg_saved_marker_ptr marker = cinfo->marker_list; marker;
+			marker = marker->next) {
+		if (JPEG_APP0 != marker->marker) {
+			continue;
+		}
+		guint offset;
+		if (14 <= marker->data_length
+				&& !memcmp(marker->data, "JFIF\0", 5)) {
+			offset = 12;
+		} else if (8 <= marker->data_length
+				&& !memcmp(marker->data, "JFXX\0\x13", 6)) {
+			offset = 6;
+		} else {
+			continue;
+		}
+		*width = marker->data[offset];
+		*height = marker->data[offset + 1];
+		if (*width && *height && offset + 2 + 3 * *width * *height
+				<= marker->data_length) {
+			return marker->data + offset + 2;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * \brief Load an uncompressed RGB thumbnail.
+ */
+static gboolean
+load_rgb_thumbnail(QahiraFormat *self, const JOCTET *data, gint width,
+		gint height, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	if (!create_surface(self, CAIRO_FORMAT_RGB24, width, height, error)) {
+		return FALSE;
+	}
+	for (gint i = 0; i < height; ++i) {
+		guchar *out = priv->data + priv->stride * i;
+		for (gint j = 0; j < width; ++j) {
+			out[QAHIRA_R] = data[0];
+			out[QAHIRA_G] = data[1];
+			out[QAHIRA_B] = data[2];
+			data += 3;
+			out += 4;
+		}
+	}
+	return TRUE;
+}
+
+static cairo_surface_t *
+load_thumbnail(QahiraFormat *self, GInputStream *stream, gint size,
+		GCancellable *cancel, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	GInputStream *thumbnail = NULL;
+	if (sigsetjmp(priv->env, 1)) {
+		goto error;
+	}
+	priv->error = error;
+	priv->input = g_object_ref(stream);
+	if (cancel) {
+		priv->cancel = g_object_ref(cancel);
+	}
+	create_decompress(self);
+	jpeg_abort_decompress(&priv->decompress);
+	priv->source_mgr.next_input_byte = NULL;
+	priv->source_mgr.bytes_in_buffer = 0;
+	jpeg_save_markers(&priv->decompress, JPEG_APP0, 0xffff);
+	jpeg_save_markers(&priv->decompress, JPEG_APP0 + 1, 0xffff);
+	jpeg_read_header(&priv->decompress, TRUE);
+	// thumbnails share the orientation of the primary image
+	gint orientation = priv->auto_orient
+		? read_orientation(&priv->decompress)
+		: 1;
+	const JOCTET *data;
+	guint length;
+	gint width, height;
+	if (find_jpeg_thumbnail(&priv->decompress, &data, &length)) {
+		// the marker data is released with the decompressor
+		guchar *copy = g_try_malloc(length);
+		if (G_UNLIKELY(!copy)) {
+			g_set_error(error, QAHIRA_ERROR,
+					QAHIRA_ERROR_NO_MEMORY,
+					Q_("jpeg: out of memory"));
+			goto error;
+		}
+		memcpy(copy, data, length);
+		thumbnail = g_memory_input_stream_new_from_data(copy, length,
+				g_free);
+	} else if ((data = find_rgb_thumbnail(&priv->decompress,
+					&width, &height))) {
+		if (!load_rgb_thumbnail(self, data, width, height, error)) {
+			goto error;
+		}
+	} else if (0 < size) {
+		// decode at the smallest scale covering the requested size
+		gint edge = MAX(priv->decompress.image_width,
+				priv->decompress.image_height);
+		priv->decompress.scale_num = 1;
+		priv->decompress.scale_denom = 8;
+		while (priv->decompress.scale_num < 8 && (edge
+				* priv->decompress.scale_num + 7) / 8 < size) {
+			++priv->decompress.scale_num;
+		}
+		priv->orientation = orientation;
+		set_profile(self);
+		priv->convert = set_output(self);
+		if (G_UNLIKELY(!priv->convert)) {
+			g_set_error(error, QAHIRA_ERROR,
+					QAHIRA_ERROR_UNSUPPORTED,
+					Q_("jpeg: colorspace %s unsupported"),
+					colorspace_name(
+					priv->decompress.out_color_space));
+			goto error;
+		}
+		if (!decode(self, error)) {
+			goto error;
+		}
+	} else {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
+				Q_("jpeg: no thumbnail"));
+		goto error;
+	}
+	if (priv->surface) {
+		cairo_surface_mark_dirty(priv->surface);
+	}
+exit:
+	jpeg_abort_decompress(&priv->decompress);
+	jpeg_save_markers(&priv->decompress, JPEG_APP0, 0);
+	if (priv->input) {
+		g_object_unref(priv->input);
+		priv->input = NULL;
+	}
+	if (priv->cancel) {
+		g_object_unref(priv->cancel);
+		priv->cancel = NULL;
+	}
+	cairo_surface_t *surface = priv->surface;
+	priv->surface = NULL;
+	if (thumbnail) {
+		// the embedded image is a complete JPEG
+		surface = load_image(self, thumbnail, orientation, cancel,
+				error);
+		g_object_unref(thumbnail);
+	}
+	return surface;
+error:
+	if (priv->surface) {
+		cairo_surface_destroy(priv->surface);
+		priv->surface = NULL;
+	}
+	if (thumbnail) {
+		g_object_unref(thumbnail);
+		thumbnail = NULL;
+	}
+	goto exit;
+}
+
+/**
+ * \brief Source image parameters shared by the JPEG encoders.
+ */
+struct Encode {
+	QahiraFormat *self;
+	cairo_content_t content;
+	const guchar *data;
+	gint width;
+	gint height;
+	gint stride;
+	gint components;
+	J_COLOR_SPACE color_space;
+	gint packed; // bytes per packed row, 0 if rows are not copied
+	const guint8 *unpremultiply;
+};
+
+/**
+ * \brief Apply the encoder parameters.
+ *
+ * \param height The number of rows to compress
+ */
+static void
+set_parameters(const struct Encode *encode, j_compress_ptr cinfo,
+		gint height)
+{
+	struct Private *priv = GET_PRIVATE(encode->self);
+	cinfo->image_width = encode->width;
+	cinfo->image_height = height;
+	cinfo->input_components = encode->components;
+	cinfo->in_color_space = encode->color_space;
+	jpeg_set_defaults(cinfo);
+	jpeg_set_quality(cinfo, priv->quality, TRUE);
+	if (JCS_YCbCr == cinfo->jpeg_color_space) {
+		switch (priv->subsampling) {
+		case QAHIRA_FORMAT_JPEG_SUBSAMPLING_444:
+			cinfo->comp_info[0].h_samp_factor = 1;
+			cinfo->comp_info[0].v_samp_factor = 1;
+			break;
+		case QAHIRA_FORMAT_JPEG_SUBSAMPLING_422:
+			cinfo->comp_info[0].h_samp_factor = 2;
+			cinfo->comp_info[0].v_samp_factor = 1;
+			break;
+		case QAHIRA_FORMAT_JPEG_SUBSAMPLING_420:
+		default:
+			cinfo->comp_info[0].h_samp_factor = 2;
+			cinfo->comp_info[0].v_samp_factor = 2;
+			break;
+		}
+	}
+	switch (priv->dct) {
+	case QAHIRA_FORMAT_JPEG_DCT_IFAST:
+		cinfo->dct_method = JDCT_IFAST;
+		break;
+	case QAHIRA_FORMAT_JPEG_DCT_FLOAT:
+		cinfo->dct_method = JDCT_FLOAT;
+		break;
+	case QAHIRA_FORMAT_JPEG_DCT_ISLOW:
+	default:
+		cinfo->dct_method = JDCT_ISLOW;
+		break;
+	}
+	cinfo->optimize_coding = priv->optimize;
+	cinfo->restart_in_rows = priv->restart;
+	if (priv->progressive) {
+		jpeg_simple_progression(cinfo);
+	}
+}
+
+/**
+ * \brief Pack rows of cairo pixels for the JPEG encoder.
+ *
+ * Rows the encoder can read directly are not copied, \a lines then points
+ * into the surface.
+ */
+static void
+pack_rows(const struct Encode *encode, gint row, gint count,
+		guchar *buffer, JSAMPARRAY lines)
+{
+	for (gint i = 0; i < count; ++i) {
+		const guchar *data = encode->data + (row + i) * encode->stride;
+		if (!encode->packed) {
+			lines[i] = (JSAMPROW)data;
+			continue;
+		}
+		guchar *out = lines[i] = buffer + i * encode->packed;
+		switch (encode->content) {
+		case CAIRO_CONTENT_COLOR:
+			for (gint j = 0; j < encode->width; ++j) {
+				out[0] = data[QAHIRA_R];
+				out[1] = data[QAHIRA_G];
+				out[2] = data[QAHIRA_B];
+				data += 4;
+				out += 3;
+			}
+			break;
+		case CAIRO_CONTENT_COLOR_ALPHA:
+			for (gint j = 0; j < encode->width; ++j) {
+				const guint8 *table = encode->unpremultiply
+					+ data[QAHIRA_A] * 256;
+				out[0] = table[data[QAHIRA_R]];
+				out[1] = table[data[QAHIRA_G]];
+				out[2] = table[data[QAHIRA_B]];
+				data += 4;
+				out += 3;
+			}
+			break;
+		default:
+			g_assert_not_reached();
+		}
+	}
+}
+
+/**
+ * \brief Compress JPEG scan lines.
+ *
+ * \param row The first source row
+ * \param buffer Storage for QAHIRA_JPEG_ROWS packed rows
+ */
+static gboolean
+save_lines(const struct Encode *encode, j_compress_ptr cinfo, gint row,
+		guchar *buffer, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(encode->self);
+	JSAMPROW lines[QAHIRA_JPEG_ROWS];
+	while (cinfo->next_scanline < cinfo->image_height) {
+		if (priv->cancel && g_cancellable_set_error_if_cancelled(
+					priv->cancel, error)) {
+			return FALSE;
+		}
+		gint n = MIN(QAHIRA_JPEG_ROWS,
+				cinfo->image_height - cinfo->next_scanline);
+		pack_rows(encode, row + cinfo->next_scanline, n, buffer,
+				lines);
+		jpeg_write_scanlines(cinfo, lines, n);
+	}
+	return TRUE;
+}
+
+/**
+ * \brief A JPEG destination manager writing to memory.
+ */
+typedef struct MemoryDestination_ {
+	struct jpeg_destination_mgr pub;
+	GByteArray *data;
+} MemoryDestination;
+
+/**
+ * \brief JPEG memory destination initialization.
+ */
+static void
+memory_init_destination(j_compress_ptr cinfo)
+{
+	MemoryDestination *dest = (MemoryDestination *)cinfo->dest;
+	g_byte_array_set_size(dest->data, QAHIRA_JPEG_BUFFER_SIZE);
+	dest->pub.next_output_byte = dest->data->data;
+	dest->pub.free_in_buffer = dest->data->len;
+}
+
+/**
+ * \brief Grow the JPEG memory destination.
+ */
+static boolean
+memory_empty_output_buffer(j_compress_ptr cinfo)
+{
+	MemoryDestination *dest = (MemoryDestination *)cinfo->dest;
+	guint size = dest->data->len;
+	g_byte_array_set_size(dest->data, 2 * size);
+	dest->pub.next_output_byte = dest->data->data + size;
+	dest->pub.free_in_buffer = size;
+	return TRUE;
+}
+
+/**
+ * \brief Trim the JPEG memory destination to the compressed size.
+ */
+static void
+memory_term_destination(j_compress_ptr cinfo)
+{
+	MemoryDestination *dest = (MemoryDestination *)cinfo->dest;
+	g_byte_array_set_size(dest->data,
+			dest->data->len - dest->pub.free_in_buffer);
+}
+
+/**
+ * \brief Initialize a JPEG memory destination.
+ */
+static void
+memory_destination(j_compress_ptr cinfo, MemoryDestination *dest,
+		GByteArray *data)
+{
+	dest->pub.init_destination = memory_init_destination;
+	dest->pub.empty_output_buffer = memory_empty_output_buffer;
+	dest->pub.term_destination = memory_term_destination;
+	dest->data = data;
+	cinfo->dest = &dest->pub;
+}
+
+/**
+ * \brief Rows of an image compressed into memory by a worker thread.
+ */
+typedef struct Strip_ {
+	struct jpeg_compress_struct compress;
+	MemoryDestination destination;
+	struct jpeg_error_mgr error_mgr;
+	sigjmp_buf env;
+	GByteArray *data; // a complete JPEG holding only this strip
+	gint row; // first source row
+	gint height;
+	guint restart_interval; // 0 for the configured interval
+	gint quality; // 0 for the configured quality
+	GError *error;
+} Strip;
+
+/**
+ * \brief Convert a strip JPEG error to a GError.
+ */
+G_GNUC_NORETURN
+static void
+strip_error_exit(j_common_ptr cinfo)
+{
+	Strip *strip = cinfo->client_data;
+	gchar message[JMSG_LENGTH_MAX];
+	cinfo->err->format_message(cinfo, message);
+	g_set_error(&strip->error, QAHIRA_ERROR,
+			cinfo->err->msg_code == JERR_OUT_OF_MEMORY
+				? QAHIRA_ERROR_NO_MEMORY
+				: QAHIRA_ERROR_FAILURE,
+			Q_("jpeg: %s"), message);
+	siglongjmp(strip->env, 1);
+}
+
+static void
+strip_free(Strip *strip)
+{
+	if (strip) {
+		if (strip->data) {
+			g_byte_array_free(strip->data, TRUE);
+		}
+		g_clear_error(&strip->error);
+		g_free(strip);
+	}
+}
+
+/**
+ * \brief Compress a strip into memory (worker thread).
+ */
+static void
+save_strip(gpointer data, gpointer user_data)
+{
+	Strip *strip = data;
+	const struct Encode *encode = user_data;
+	guchar *buffer = NULL;
+	if (encode->packed) {
+		buffer = g_try_malloc(QAHIRA_JPEG_ROWS * encode->packed);
+		if (G_UNLIKELY(!buffer)) {
+			g_set_error(&strip->error, QAHIRA_ERROR,
+					QAHIRA_ERROR_NO_MEMORY,
+					Q_("jpeg: out of memory"));
+			return;
+		}
+	}
+	if (sigsetjmp(strip->env, 1)) {
+		goto exit;
+	}
+	strip->compress.err = jpeg_std_error(&strip->error_mgr);
+	strip->error_mgr.error_exit = strip_error_exit;
+	strip->error_mgr.output_message = output_message;
+	jpeg_create_compress(&strip->compress);
+	strip->compress.client_data = strip;
+	memory_destination(&strip->compress, &strip->destination,
+			strip->data);
+	set_parameters(encode, &strip->compress, strip->height);
+	if (strip->restart_interval) {
+		strip->compress.restart_in_rows = 0;
+		strip->compress.restart_interval = strip->restart_interval;
+	}
+	if (strip->quality) {
+		jpeg_set_quality(&strip->compress, strip->quality, TRUE);
+	}
+	jpeg_start_compress(&strip->compress, TRUE);
+	if (!save_lines(encode, &strip->compress, strip->row, buffer,
+				&strip->error)) {
+		goto exit;
+	}
+	jpeg_finish_compress(&strip->compress);
+exit:
+	g_free(buffer);
+	jpeg_destroy_compress(&strip->compress);
+}
+
+/**
+ * \brief Write data to the output stream.
+ */
+static gboolean
+write_data(QahiraFormat *self, const guchar *data, gsize size,
+		GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	while (size) {
+		gssize bytes = g_output_stream_write(priv->output, data,
+				size, priv->cancel, error);
+		if (G_UNLIKELY(-1 == bytes)) {
+			return FALSE;
+		}
+		size -= bytes;
+		data += bytes;
+	}
+	return TRUE;
+}
+
+/**
+ * \brief Join compressed strips into a single JPEG.
+ *
+ * The headers of the first strip are written with the height of the whole
+ * image, followed by the entropy coded data of every strip. Restart markers
+ * are renumbered and one is inserted between consecutive strips.
+ */
+static gboolean
+write_strips(QahiraFormat *self, Strip **strips, gint count, gint height,
+		GError **error)
+{
+	guint segment = 0;
+	for (gint i = 0; i < count; ++i) {
+		JOCTET *data = strips[i]->data->data;
+		gsize sof, sos, eos;
+		GArray *restarts = find_restarts(data, strips[i]->data->len,
+				&sof, &sos, &eos);
+		if (G_UNLIKELY(!restarts)) {
+			g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
+					Q_("jpeg: invalid strip"));
+			return FALSE;
+		}
+		for (guint j = 0; j < restarts->len; ++j) {
+			gsize offset = g_array_index(restarts, gsize, j);
+			data[offset + 1] = 0xd0 + ((segment + j) & 7);
+		}
+		segment += restarts->len;
+		g_array_free(restarts, TRUE);
+		if (!i) {
+			data[sof + 5] = (height >> 8) & 0xff;
+			data[sof + 6] = height & 0xff;
+			if (!write_data(self, data, sos, error)) {
+				return FALSE;
+			}
+		}
+		if (!write_data(self, data + sos, eos - sos, error)) {
+			return FALSE;
+		}
+		JOCTET marker[2] = { (JOCTET)0xff, (JOCTET)JPEG_EOI };
+		if (i + 1 < count) {
+			marker[1] = 0xd0 + (segment++ & 7);
+		}
+		if (!write_data(self, marker, sizeof(marker), error)) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * \brief Compress strips of rows concurrently.
+ *
+ * Strips are cut on MCU row boundaries and end in a restart marker, so the
+ * joined result is identical to a serial encode with the same restart
+ * interval.
+ *
+ * Must be called after set_parameters() on priv->compress.
+ *
+ * \param done [out] FALSE if the image should be compressed serially
+ */
+static gboolean
+save_parallel(const struct Encode *encode, gboolean *done, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(encode->self);
+	j_compress_ptr cinfo = &priv->compress;
+	*done = FALSE;
+	if ((gsize)encode->width * encode->height
+			< QAHIRA_JPEG_PARALLEL_SIZE) {
+		return TRUE;
+	}
+	// strips cannot share optimized tables or progressive scans
+	if (priv->optimize || priv->progressive) {
+		return TRUE;
+	}
+	gint max_h = 1, max_v = 1;
+	for (gint i = 0; i < cinfo->num_components; ++i) {
+		max_h = MAX(max_h, cinfo->comp_info[i].h_samp_factor);
+		max_v = MAX(max_v, cinfo->comp_info[i].v_samp_factor);
+	}
+	gint mcu_height = DCTSIZE * max_v;
+	guint columns = (encode->width + DCTSIZE * max_h - 1)
+		/ (DCTSIZE * max_h);
+	guint rows = (encode->height + mcu_height - 1) / mcu_height;
+	gint count = MIN(rows, QAHIRA_JPEG_BANDS_PER_THREAD
+			* qahira_format_get_thread_count(encode->self));
+	if (2 > count) {
+		return TRUE;
+	}
+	// MCU rows per strip
+	guint step = (rows + count - 1) / count;
+	guint interval;
+	if (priv->restart) {
+		// strips must end on a requested restart marker
+		if (0xffff < columns * priv->restart) {
+			return TRUE;
+		}
+		step = (step + priv->restart - 1) / priv->restart
+			* priv->restart;
+		interval = columns * priv->restart;
+	} else {
+		// restart only between strips when the interval fits
+		interval = 0xffff < columns * step ? columns : columns * step;
+	}
+	count = (rows + step - 1) / step;
+	if (2 > count) {
+		return TRUE;
+	}
+	*done = TRUE;
+	gboolean status = TRUE;
+	Strip **strips = g_try_new0(Strip *, count);
+	if (G_UNLIKELY(!strips)) {
+		goto oom;
+	}
+	for (gint i = 0; i < count; ++i) {
+		Strip *strip = strips[i] = g_try_new0(Strip, 1);
+		if (G_UNLIKELY(!strip)) {
+			goto oom;
+		}
+		strip->data = g_byte_array_new();
+		strip->row = i * step * mcu_height;
+		strip->height = MIN(encode->height - strip->row,
+				step * mcu_height);
+		strip->restart_interval = interval;
+	}
+	qahira_format_run(encode->self, save_strip, (gpointer *)strips,
+			count, (gpointer)encode);
+	for (gint i = 0; i < count; ++i) {
+		if (strips[i]->error) {
+			g_propagate_error(error, strips[i]->error);
+			strips[i]->error = NULL;
+			status = FALSE;
+			goto exit;
+		}
+	}
+	status = write_strips(encode->self, strips, count, encode->height,
+			error);
+exit:
+	if (strips) {
+		for (gint i = 0; i < count; ++i) {
+			strip_free(strips[i]);
+		}
+		g_free(strips);
+	}
+	return status;
+oom:
+	g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
+			Q_("jpeg: out of memory"));
+	status = FALSE;
+	goto exit;
+}
+
+/**
+ * \brief Compress the image at the highest quality that fits a size.
+ *
+ * Each round compresses the image at one quality per thread, spread
+ * evenly over the remaining range, and narrows the range around the
+ * largest result that fits. With a single thread this is a binary search.
+ */
+static gboolean
+save_target(const struct Encode *encode, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(encode->self);
+	gint threads = qahira_format_get_thread_count(encode->self);
+	Strip **trials = g_try_new0(Strip *, threads);
+	if (G_UNLIKELY(!trials)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
+				Q_("jpeg: out of memory"));
+		return FALSE;
+	}
+	gboolean status = TRUE;
+	Strip *best = NULL;
+	gint low = 1, high = 100;
+	while (low <= high) {
+		gint count = MIN(threads, high - low + 1);
+		for (gint i = 0; i < count; ++i) {
+			Strip *trial = trials[i] = g_try_new0(Strip, 1);
+			if (G_UNLIKELY(!trial)) {
+				g_set_error(error, QAHIRA_ERROR,
+						QAHIRA_ERROR_NO_MEMORY,
+						Q_("jpeg: out of memory"));
+				status = FALSE;
+				goto exit;
+			}
+			trial->data = g_byte_array_new();
+			trial->height = encode->height;
+			trial->quality = low
+				+ (high - low + 1) * (2 * i + 1) / (2 * count);
+		}
+		qahira_format_run(encode->self, save_strip,
+				(gpointer *)trials, count, (gpointer)encode);
+		gint fit = -1;
+		for (gint i = 0; i < count; ++i) {
+			if (trials[i]->error) {
+				g_propagate_error(error, trials[i]->error);
+				trials[i]->error = NULL;
+				status = FALSE;
+				goto exit;
+			}
+			if (trials[i]->data->len <= priv->target) {
+				fit = i;
+			}
+		}
+		if (0 <= fit) {
+			low = trials[fit]->quality + 1;
+			strip_free(best);
+			best = trials[fit];
+			trials[fit] = NULL;
+		}
+		if (fit + 1 < count) {
+			high = trials[fit + 1]->quality - 1;
+		}
+		for (gint i = 0; i < count; ++i) {
+			strip_free(trials[i]);
+			trials[i] = NULL;
+		}
+	}
+	if (!best) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
+				Q_("jpeg: image does not fit in %" G_GSIZE_FORMAT
+					" bytes"), priv->target);
+		status = FALSE;
+		goto exit;
+	}
+	status = write_data(encode->self, best->data->data, best->data->len,
+			error);
+exit:
+	for (gint i = 0; i < threads; ++i) {
+		strip_free(trials[i]);
+	}
+	g_free(trials);
+	strip_free(best);
+	return status;
+}
+
+static gboolean
+save(QahiraFormat *self, cairo_surface_t *surface, GOutputStream *stream,
+		GCancellable *cancel, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	struct Encode encode = {
+		.self = self,
+		.content = cairo_surface_get_content(surface)
+	};
+	gboolean status = TRUE;
+	guchar *buffer = NULL;
+	qahira_surface_size(surface, &encode.width, &encode.height);
+	if (!encode.width || !encode.height) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
+				Q_("jpeg: invalid dimensions [%d x %d]"),
+				encode.width, encode.height);
+		goto error;
+	}
+	priv->error = error;
+	if (sigsetjmp(priv->env, 1)) {
+		goto error;
+	}
+	priv->output = g_object_ref(stream);
+	if (cancel) {
+		priv->cancel = g_object_ref(cancel);
+	}
+	encode.data = qahira_format_surface_get_data(self, surface);
+	if (G_UNLIKELY(!encode.data)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
+				Q_("jpeg: surface data is NULL"));
+		goto error;
+	}
+	encode.stride = qahira_format_surface_get_stride(self, surface);
+	if (0 > encode.stride) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
+				Q_("jpeg: invalid stride"));
+		goto error;
+	}
+	if (CAIRO_CONTENT_COLOR_ALPHA == encode.content
+			&& qahira_format_surface_is_opaque(self, surface)) {
+		// opaque pixels need not be unpremultiplied
+		encode.content = CAIRO_CONTENT_COLOR;
+	}
+	switch (encode.content) {
+	case CAIRO_CONTENT_COLOR:
+#ifdef JCS_EXTENSIONS
+		// libjpeg-turbo reads cairo pixels directly
+		encode.components = 4;
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+		encode.color_space = JCS_EXT_BGRX;
+#else
+		encode.color_space = JCS_EXT_XRGB;
+#endif
+		break;
+#else
+		// fall through
+#endif // JCS_EXTENSIONS
+	case CAIRO_CONTENT_COLOR_ALPHA:
+		encode.components = 3;
+		encode.color_space = JCS_RGB;
+		encode.packed = encode.components * encode.width;
+		encode.unpremultiply = qahira_unpremultiply_table();
+		break;
+	case CAIRO_CONTENT_ALPHA:
+		encode.components = 1;
+		encode.color_space = JCS_GRAYSCALE;
+		break;
+	default:
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_UNSUPPORTED,
+				Q_("jpeg: unsupported surface content"));
+		goto error;
+	}
+	create_compress(self);
+	jpeg_abort_compress(&priv->compress);
+	set_parameters(&encode, &priv->compress, encode.height);
+	if (priv->target) {
+		if (priv->abbreviate) {
+			// the search varies the quantization tables
+			g_set_error(error, QAHIRA_ERROR,
+					QAHIRA_ERROR_UNSUPPORTED,
+					Q_("jpeg: target size unsupported "
+						"for abbreviated images"));
+			goto error;
+		}
+		if (!save_target(&encode, error)) {
+			goto error;
+		}
+		goto exit;
+	}
+	// strips are complete images each with its own tables
+	if (1 < qahira_format_get_thread_count(self) && !priv->abbreviate) {
+		gboolean done;
+		if (!save_parallel(&encode, &done, error)) {
+			goto error;
+		}
+		if (done) {
+			goto exit;
+		}
+	}
+	if (encode.packed) {
+		buffer = g_try_malloc(QAHIRA_JPEG_ROWS * encode.packed);
+		if (G_UNLIKELY(!buffer)) {
+			g_set_error(error, QAHIRA_ERROR,
+					QAHIRA_ERROR_NO_MEMORY,
+					Q_("jpeg: out of memory"));
+			goto error;
+		}
+	}
+	if (priv->abbreviate) {
+		jpeg_suppress_tables(&priv->compress, TRUE);
+		jpeg_start_compress(&priv->compress, FALSE);
+	} else {
+		jpeg_start_compress(&priv->compress, TRUE);
+	}
+	if (!save_lines(&encode, &priv->compress, 0, buffer, error)) {
+		goto error;
+	}
+	jpeg_finish_compress(&priv->compress);
+exit:
+	g_free(buffer);
+	if (priv->output) {
+		g_object_unref(priv->output);
+		priv->output = NULL;
+	}
+	if (priv->cancel) {
+		g_object_unref(priv->cancel);
+		priv->cancel = NULL;
+	}
+	return status;
+error:
+	jpeg_abort_compress(&priv->compress);
+	status = FALSE;
+	goto exit;
+}
+
+/**
+ * \brief Write a tables-only stream for abbreviated images.
+ *
+ * The tables match those used by save() with the current quality, for
+ * both color and grayscale images.
+ */
+static gboolean
+save_tables(QahiraFormat *self, GOutputStream *stream, GCancellable *cancel,
+		GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	struct Encode encode = {
+		.self = self,
+		.width = 1,
+		.height = 1,
+		.components = 3,
+		.color_space = JCS_RGB
+	};
+	gboolean status = TRUE;
+	priv->error = error;
+	if (sigsetjmp(priv->env, 1)) {
+		goto error;
+	}
+	priv->output = g_object_ref(stream);
+	if (cancel) {
+		priv->cancel = g_object_ref(cancel);
+	}
+	create_compress(self);
+	jpeg_abort_compress(&priv->compress);
+	set_parameters(&encode, &priv->compress, encode.height);
+	jpeg_write_tables(&priv->compress);
+exit:
+	if (priv->output) {
+		g_object_unref(priv->output);
+		priv->output = NULL;
+	}
+	if (priv->cancel) {
+		g_object_unref(priv->cancel);
+		priv->cancel = NULL;
+	}
+	return status;
+error:
+	status = FALSE;
+	goto exit;
+}
+
+/**
+ * \brief A lossless transform expressed in source block coordinates.
+ */
+struct Transform {
+	gboolean swap; // transpose rows & columns
+	gboolean mirror_x; // mirror source columns
+	gboolean mirror_y; // mirror source rows
+	gint index[DCTSIZE2]; // source coefficient of each output coefficient
+	gint sign[DCTSIZE2];
+};
+
+/**
+ * \brief Decompose a transform into transposition & mirroring.
+ */
+static void
+transform_init(struct Transform *transform, QahiraFormatJpegTransform type)
+{
+	memset(transform, 0, sizeof(*transform));
+	switch (type) {
+	case QAHIRA_FORMAT_JPEG_TRANSFORM_FLIP_HORIZONTAL:
+		transform->mirror_x = TRUE;
+		break;
+	case QAHIRA_FORMAT_JPEG_TRANSFORM_FLIP_VERTICAL:
+		transform->mirror_y = TRUE;
+		break;
+	case QAHIRA_FORMAT_JPEG_TRANSFORM_TRANSPOSE:
+		transform->swap = TRUE;
+		break;
+	case QAHIRA_FORMAT_JPEG_TRANSFORM_TRANSVERSE:
+		transform->swap = TRUE;
+		transform->mirror_x = TRUE;
+		transform->mirror_y = TRUE;
+		break;
+	case QAHIRA_FORMAT_JPEG_TRANSFORM_ROTATE_90:
+		transform->swap = TRUE;
+		transform->mirror_y = TRUE;
+		break;
+	case QAHIRA_FORMAT_JPEG_TRANSFORM_ROTATE_180:
+		transform->mirror_x = TRUE;
+		transform->mirror_y = TRUE;
+		break;
+	case QAHIRA_FORMAT_JPEG_TRANSFORM_ROTATE_270:
+		transform->swap = TRUE;
+		transform->mirror_x = TRUE;
+		break;
+	case QAHIRA_FORMAT_JPEG_TRANSFORM_NONE:
+	default:
+		break;
+	}
+	// mirroring negates the odd frequencies along the mirrored axis
+	for (gint i = 0; i < DCTSIZE; ++i) {
+		for (gint j = 0; j < DCTSIZE; ++j) {
+			gint v = transform->swap ? j : i;
+			gint u = transform->swap ? i : j;
+			transform->index[i * DCTSIZE + j] = v * DCTSIZE + u;
+			transform->sign[i * DCTSIZE + j] =
+				((transform->mirror_x && (u & 1))
+				 ^ (transform->mirror_y && (v & 1))) ? -1 : 1;
+		}
+	}
+}
+
+/**
+ * \brief Source region and output geometry of a component.
+ */
+struct Plane {
+	jvirt_barray_ptr array; // output coefficients
+	JDIMENSION x, y; // region offset in source blocks
+	JDIMENSION width, height; // region size in source blocks
+};
+
+/**
+ * \brief Copy the transformed coefficients of a component.
+ */
+static gboolean
+transform_plane(QahiraFormat *self, const struct Transform *transform,
+		jvirt_barray_ptr source, const struct Plane *plane,
+		GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	j_common_ptr cinfo = (j_common_ptr)&priv->decompress;
+	JDIMENSION width = transform->swap ? plane->height : plane->width;
+	JDIMENSION height = transform->swap ? plane->width : plane->height;
+	for (JDIMENSION y = 0; y < height; ++y) {
+		if (priv->cancel && g_cancellable_set_error_if_cancelled(
+					priv->cancel, error)) {
+			return FALSE;
+		}
+		JBLOCKROW out = cinfo->mem->access_virt_barray(cinfo,
+				plane->array, y, 1, TRUE)[0];
+		for (JDIMENSION x = 0; x < width; ++x) {
+			JDIMENSION sx = transform->swap ? y : x;
+			JDIMENSION sy = transform->swap ? x : y;
+			if (transform->mirror_x) {
+				sx = plane->width - 1 - sx;
+			}
+			if (transform->mirror_y) {
+				sy = plane->height - 1 - sy;
+			}
+			const JCOEF *in = cinfo->mem->access_virt_barray(cinfo,
+					source, plane->y + sy, 1,
+					FALSE)[0][plane->x + sx];
+			for (gint k = 0; k < DCTSIZE2; ++k) {
+				out[x][k] = transform->sign[k]
+					* in[transform->index[k]];
+			}
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * \brief Configure marker saving for a transform.
+ *
+ * \param length Maximum length to save, zero to stop saving
+ */
+static void
+save_markers(j_decompress_ptr cinfo, guint length)
+{
+	jpeg_save_markers(cinfo, JPEG_COM, length);
+	for (gint i = 1; i < 16; ++i) {
+		jpeg_save_markers(cinfo, JPEG_APP0 + i, length);
+	}
+}
+
+static gboolean
+transcode(QahiraFormat *self, GInputStream *input, GOutputStream *output,
+		QahiraFormatJpegTransform type, const cairo_rectangle_int_t *crop,
+		GCancellable *cancel, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	j_decompress_ptr src = &priv->decompress;
+	j_compress_ptr dst = &priv->compress;
+	gboolean status = TRUE;
+	struct Transform transform;
+	transform_init(&transform, type);
+	priv->error = error;
+	if (sigsetjmp(priv->env, 1)) {
+		goto error;
+	}
+	priv->input = g_object_ref(input);
+	priv->output = g_object_ref(output);
+	if (cancel) {
+		priv->cancel = g_object_ref(cancel);
+	}
+	create_decompress(self);
+	create_compress(self);
+	jpeg_abort_decompress(src);
+	jpeg_abort_compress(dst);
+	priv->source_mgr.next_input_byte = NULL;
+	priv->source_mgr.bytes_in_buffer = 0;
+	// keep EXIF, ICC & comment markers
+	save_markers(src, 0xffff);
+	jpeg_read_header(src, TRUE);
+	// a single component is coded in 8x8 iMCUs
+	gint imcu_width = DCTSIZE, imcu_height = DCTSIZE;
+	if (1 < src->num_components) {
+		imcu_width *= src->max_h_samp_factor;
+		imcu_height *= src->max_v_samp_factor;
+	}
+	gint x = 0, y = 0;
+	gint width = src->image_width, height = src->image_height;
+	if (crop) {
+		// crop on iMCU boundaries, extending the region up & left
+		x = CLAMP(crop->x, 0, width) / imcu_width * imcu_width;
+		y = CLAMP(crop->y, 0, height) / imcu_height * imcu_height;
+		width = MIN((gint64)crop->x + crop->width, width) - x;
+		height = MIN((gint64)crop->y + crop->height, height) - y;
+	}
+	// partial iMCUs cannot be mirrored, drop them
+	if (transform.mirror_x) {
+		width = width / imcu_width * imcu_width;
+	}
+	if (transform.mirror_y) {
+		height = height / imcu_height * imcu_height;
+	}
+	if (0 >= width || 0 >= height) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
+				Q_("jpeg: transformed image is empty"));
+		goto error;
+	}
+	gboolean identity = !transform.swap && !transform.mirror_x
+		&& !transform.mirror_y && !x && !y
+		&& width == src->image_width && height == src->image_height;
+	struct Plane planes[MAX_COMPONENTS];
+	memset(planes, 0, sizeof(planes));
+	if (!identity) {
+		// request output arrays before the source arrays are realized
+		for (gint c = 0; c < src->num_components; ++c) {
+			jpeg_component_info *comp = src->comp_info + c;
+			gint h = 1 < src->num_components
+				? comp->h_samp_factor : 1;
+			gint v = 1 < src->num_components
+				? comp->v_samp_factor : 1;
+			struct Plane *plane = planes + c;
+			plane->x = x / imcu_width * h;
+			plane->y = y / imcu_height * v;
+			plane->width = (width * h + imcu_width - 1) / imcu_width;
+			plane->height =
+				(height * v + imcu_height - 1) / imcu_height;
+			JDIMENSION columns = transform.swap
+				? plane->height : plane->width;
+			JDIMENSION rows = transform.swap
+				? plane->width : plane->height;
+			gint out_h = transform.swap
+				? comp->v_samp_factor : comp->h_samp_factor;
+			gint out_v = transform.swap
+				? comp->h_samp_factor : comp->v_samp_factor;
+			plane->array = src->mem->request_virt_barray(
+					(j_common_ptr)src, JPOOL_IMAGE, TRUE,
+					(columns + out_h - 1) / out_h * out_h,
+					(rows + out_v - 1) / out_v * out_v,
+					out_v);
 		}
-		priv->count = priv->decompress.rec_outbuf_height;
 	}
-	priv->decompress.buffered_image = priv->decompress.progressive_mode;
-	priv->decompress.do_fancy_upsampling = FALSE;
-	priv->decompress.do_block_smoothing = FALSE;
-	cairo_surface_flush(priv->surface);
-	if (priv->decompress.buffered_image) {
-		if (!load_progressive(self, error)) {
-			goto error;
+	jvirt_barray_ptr *coefficients = jpeg_read_coefficients(src);
+	jpeg_copy_critical_parameters(src, dst);
+	dst->image_width = transform.swap ? height : width;
+	dst->image_height = transform.swap ? width : height;
+	if (transform.swap) {
+		for (gint c = 0; c < dst->num_components; ++c) {
+			jpeg_component_info *comp = dst->comp_info + c;
+			gint h = comp->h_samp_factor;
+			comp->h_samp_factor = comp->v_samp_factor;
+			comp->v_samp_factor = h;
 		}
+		for (gint i = 0; i < NUM_QUANT_TBLS; ++i) {
+			JQUANT_TBL *table = dst->quant_tbl_ptrs[i];
+			if (!table) {
+				continue;
+			}
+			for (gint j = 0; j < DCTSIZE; ++j) {
+				for (gint k = j + 1; k < DCTSIZE; ++k) {
+					UINT16 value =
+						table->quantval[j * DCTSIZE + k];
+					table->quantval[j * DCTSIZE + k] =
+						table->quantval[k * DCTSIZE + j];
+					table->quantval[k * DCTSIZE + j] = value;
+				}
+			}
+		}
+	}
+	dst->optimize_coding = priv->optimize;
+	dst->restart_in_rows = priv->restart;
+	if (priv->progressive) {
+		jpeg_simple_progression(dst);
+	}
+	if (identity) {
+		jpeg_write_coefficients(dst, coefficients);
 	} else {
-		if (!load_lines(self, error)) {
-			goto error;
+		jvirt_barray_ptr arrays[MAX_COMPONENTS];
+		for (gint c = 0; c < src->num_components; ++c) {
+			if (!transform_plane(self, &transform,
+						coefficients[c], planes + c,
+						error)) {
+				goto error;
+			}
+			arrays[c] = planes[c].array;
 		}
+		jpeg_write_coefficients(dst, arrays);
 	}
-	jpeg_finish_decompress(&priv->decompress);
-	cairo_surface_mark_dirty(priv->surface);
+	// the pixels are reoriented, viewers must not rotate them again
+	if (transform.swap || transform.mirror_x || transform.mirror_y) {
+		reset_orientation(src);
+	}
+	// copy markers, JFIF & Adobe markers are written by the library
+	for (jpeg_saved_marker_ptr marker = src->marker_list; marker;
+			marker = marker->next) {
+		if (dst->write_Adobe_marker
+				&& JPEG_APP0 + 14 == marker->marker
+				&& 5 <= marker->data_length
+				&& !memcmp(marker->data, "Adobe", 5)) {
+			continue;
+		}
+		jpeg_write_marker(dst, marker->marker, marker->data,
+				marker->data_length);
+	}
+	jpeg_finish_compress(dst);
+	jpeg_finish_decompress(src);
 exit:
+	save_markers(src, 0);
 	if (priv->input) {
 		g_object_unref(priv->input);
 		priv->input = NULL;
 	}
+	if (priv->output) {
+		g_object_unref(priv->output);
+		priv->output = NULL;
+	}
 	if (priv->cancel) {
 		g_object_unref(priv->cancel);
 		priv->cancel = NULL;
 	}
-	cairo_surface_t *surface = priv->surface;
-	priv->surface = NULL;
-	return surface;
+	return status;
 error:
-	if (priv->surface) {
-		cairo_surface_destroy(priv->surface);
-		priv->surface = NULL;
-	}
+	jpeg_abort_compress(dst);
+	jpeg_abort_decompress(src);
+	status = FALSE;
 	goto exit;
 }
 
+/**
+ * \brief Free planes allocated by load_planes().
+ */
+static void
+free_planes(QahiraFormatJpegPlanes *planes, const gboolean *allocated)
+{
+	for (gint c = 0; c < 3; ++c) {
+		if (allocated[c]) {
+			g_free(planes->data[c]);
+			planes->data[c] = NULL;
+		}
+	}
+}
+
 static gboolean
-save(QahiraFormat *self, cairo_surface_t *surface, GOutputStream *stream,
-		GCancellable *cancel, GError **error)
+load_planes(QahiraFormat *self, GInputStream *stream,
+		QahiraFormatJpegPlanes *planes, GCancellable *cancel,
+		GError **error)
 {
 	struct Private *priv = GET_PRIVATE(self);
-	cairo_content_t content = cairo_surface_get_content(surface);
+	j_decompress_ptr cinfo = &priv->decompress;
+	gboolean allocated[3] = { FALSE, FALSE, FALSE };
 	gboolean status = TRUE;
-	guchar *buffer = NULL;
-	gint width, height;
-	qahira_surface_size(surface, &width, &height);
-	if (!width || !height) {
-		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
-				Q_("jpeg: invalid dimensions [%d x %d]"),
-				width, height);
-		goto error;
-	}
-	priv->error = error;
 	if (sigsetjmp(priv->env, 1)) {
 		goto error;
 	}
-	priv->output = g_object_ref(stream);
+	priv->error = error;
+	priv->input = g_object_ref(stream);
 	if (cancel) {
 		priv->cancel = g_object_ref(cancel);
 	}
-	guchar *data = qahira_format_surface_get_data(self, surface);
-	if (G_UNLIKELY(!data)) {
+	create_decompress(self);
+	jpeg_abort_decompress(cinfo);
+	priv->source_mgr.next_input_byte = NULL;
+	priv->source_mgr.bytes_in_buffer = 0;
+	jpeg_read_header(cinfo, TRUE);
+	switch (cinfo->jpeg_color_space) {
+	case JCS_GRAYSCALE:
+	case JCS_YCbCr:
+		break;
+	default:
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_UNSUPPORTED,
+				Q_("jpeg: colorspace %s unsupported"),
+				colorspace_name(cinfo->jpeg_color_space));
+		goto error;
+	}
+	set_profile(self);
+	// skip color conversion & upsampling
+	cinfo->raw_data_out = TRUE;
+	cinfo->out_color_space = cinfo->jpeg_color_space;
+	jpeg_start_decompress(cinfo);
+	gint components = cinfo->num_components;
+	if (planes->data[0] && (planes->width != cinfo->image_width
+				|| planes->height != cinfo->image_height
+				|| planes->components != components)) {
 		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
-				Q_("jpeg: surface data is NULL"));
+				Q_("jpeg: planes do not match the image "
+					"[%d x %d]"),
+				cinfo->image_width, cinfo->image_height);
 		goto error;
 	}
-	gint stride = 0;
-	gint components;
-	gint color_space;
-	switch (content) {
-	case CAIRO_CONTENT_COLOR:
-	case CAIRO_CONTENT_COLOR_ALPHA:
-		components = 3;
-		color_space = JCS_RGB;
-		buffer = g_try_malloc(components * width);
-		if (!buffer) {
-			g_set_error(error, QAHIRA_ERROR,
-					QAHIRA_ERROR_NO_MEMORY,
-					Q_("jpeg: out of memory"));
+	for (gint c = 0; c < components; ++c) {
+		jpeg_component_info *comp = cinfo->comp_info + c;
+		if (planes->data[c] && (planes->plane_width[c]
+					!= (gint)comp->downsampled_width
+				|| planes->plane_height[c]
+					!= (gint)comp->downsampled_height
+				|| planes->stride[c] < planes->plane_width[c])) {
+			g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
+					Q_("jpeg: plane %d does not match the "
+						"image [%d x %d]"), c,
+					comp->downsampled_width,
+					comp->downsampled_height);
 			goto error;
 		}
-		break;
-	case CAIRO_CONTENT_ALPHA:
-		components = 1;
-		color_space = JCS_GRAYSCALE;
-		stride = qahira_format_surface_get_stride(self, surface);
-		if (0 > stride) {
-			g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
-					Q_("jpeg: invalid stride"));
+	}
+	planes->width = cinfo->image_width;
+	planes->height = cinfo->image_height;
+	planes->components = components;
+	JSAMPARRAY buffers[3];
+	for (gint c = 0; c < components; ++c) {
+		jpeg_component_info *comp = cinfo->comp_info + c;
+		planes->plane_width[c] = comp->downsampled_width;
+		planes->plane_height[c] = comp->downsampled_height;
+		if (!planes->data[c]) {
+			planes->stride[c] = comp->downsampled_width;
+			planes->data[c] = g_try_malloc((gsize)planes->stride[c]
+					* comp->downsampled_height);
+			if (G_UNLIKELY(!planes->data[c])) {
+				g_set_error(error, QAHIRA_ERROR,
+						QAHIRA_ERROR_NO_MEMORY,
+						Q_("jpeg: out of memory"));
+				goto error;
+			}
+			allocated[c] = TRUE;
+		}
+		// an iMCU row, padded to whole blocks
+		buffers[c] = cinfo->mem->alloc_sarray((j_common_ptr)cinfo,
+				JPOOL_IMAGE, comp->width_in_blocks * DCTSIZE,
+				comp->v_samp_factor * DCTSIZE);
+	}
+	gint rows = cinfo->max_v_samp_factor * DCTSIZE;
+	for (gint i = 0; cinfo->output_scanline < cinfo->output_height; ++i) {
+		if (priv->cancel && g_cancellable_set_error_if_cancelled(
+					priv->cancel, error)) {
 			goto error;
 		}
+		if (!jpeg_read_raw_data(cinfo, buffers, rows)) {
+			break;
+		}
+		for (gint c = 0; c < components; ++c) {
+			gint height = cinfo->comp_info[c].v_samp_factor * DCTSIZE;
+			gint row = i * height;
+			height = MIN(height, planes->plane_height[c] - row);
+			for (gint j = 0; j < height; ++j) {
+				memcpy(planes->data[c] + (gsize)(row + j)
+						* planes->stride[c],
+						buffers[c][j],
+						planes->plane_width[c]);
+			}
+		}
+	}
+	jpeg_finish_decompress(cinfo);
+exit:
+	if (priv->input) {
+		g_object_unref(priv->input);
+		priv->input = NULL;
+	}
+	if (priv->cancel) {
+		g_object_unref(priv->cancel);
+		priv->cancel = NULL;
+	}
+	return status;
+error:
+	jpeg_abort_decompress(cinfo);
+	free_planes(planes, allocated);
+	status = FALSE;
+	goto exit;
+}
+
+static gboolean
+save_planes(QahiraFormat *self, const QahiraFormatJpegPlanes *planes,
+		GOutputStream *stream, GCancellable *cancel, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	j_compress_ptr cinfo = &priv->compress;
+	gboolean status = TRUE;
+	struct Encode encode = {
+		.self = self,
+		.width = planes->width,
+		.height = planes->height,
+		.components = planes->components
+	};
+	switch (planes->components) {
+	case 1:
+		encode.color_space = JCS_GRAYSCALE;
+		break;
+	case 3:
+		encode.color_space = JCS_YCbCr;
 		break;
 	default:
 		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_UNSUPPORTED,
-				Q_("jpeg: unsupported surface content"));
+				Q_("jpeg: %d planes unsupported"),
+				planes->components);
+		return FALSE;
+	}
+	if (0 >= planes->width || 0 >= planes->height) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
+				Q_("jpeg: invalid dimensions [%d x %d]"),
+				planes->width, planes->height);
+		return FALSE;
+	}
+	priv->error = error;
+	if (sigsetjmp(priv->env, 1)) {
 		goto error;
 	}
-	jpeg_abort_compress(&priv->compress);
-	priv->compress.image_width = width;
-	priv->compress.image_height = height;
-	priv->compress.input_components = components;
-	priv->compress.in_color_space = color_space;
-	jpeg_set_defaults(&priv->compress);
-	jpeg_set_quality(&priv->compress, priv->quality, TRUE);
-	jpeg_start_compress(&priv->compress, TRUE);
-	gint i = 0;
-	while (priv->compress.next_scanline < priv->compress.image_height) {
-		switch (content) {
-		case CAIRO_CONTENT_COLOR:
-			for (gint j = 0; j < width; ++j) {
-				buffer[3 * j + 0] = data[QAHIRA_R];
-				buffer[3 * j + 1] = data[QAHIRA_G];
-				buffer[3 * j + 2] = data[QAHIRA_B];
-				data += 4;
-			}
-		case CAIRO_CONTENT_COLOR_ALPHA:
-			for (gint j = 0; j < width; ++j) {
-				buffer[3 * j + 0] =
-					qahira_unpremultiply(data[QAHIRA_A],
-							data[QAHIRA_R]);
-				buffer[3 * j + 1] =
-					qahira_unpremultiply(data[QAHIRA_A],
-							data[QAHIRA_G]);
-				buffer[3 * j + 2] =
-					qahira_unpremultiply(data[QAHIRA_A],
-							data[QAHIRA_B]);
-				data += 4;
+	priv->output = g_object_ref(stream);
+	if (cancel) {
+		priv->cancel = g_object_ref(cancel);
+	}
+	create_compress(self);
+	jpeg_abort_compress(cinfo);
+	set_parameters(&encode, cinfo, encode.height);
+	// the planes must already be downsampled to the output sampling
+	gint max_h = 1, max_v = 1;
+	for (gint c = 0; c < cinfo->num_components; ++c) {
+		max_h = MAX(max_h, cinfo->comp_info[c].h_samp_factor);
+		max_v = MAX(max_v, cinfo->comp_info[c].v_samp_factor);
+	}
+	for (gint c = 0; c < cinfo->num_components; ++c) {
+		jpeg_component_info *comp = cinfo->comp_info + c;
+		gint width = (planes->width * comp->h_samp_factor + max_h - 1)
+			/ max_h;
+		gint height = (planes->height * comp->v_samp_factor
+				+ max_v - 1) / max_v;
+		if (!planes->data[c] || planes->plane_width[c] != width
+				|| planes->plane_height[c] != height
+				|| planes->stride[c] < width) {
+			g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
+					Q_("jpeg: plane %d does not match the "
+						"subsampling [%d x %d]"), c,
+					width, height);
+			goto error;
+		}
+	}
+	cinfo->raw_data_in = TRUE;
+	jpeg_start_compress(cinfo, TRUE);
+	JSAMPARRAY buffers[3];
+	for (gint c = 0; c < cinfo->num_components; ++c) {
+		jpeg_component_info *comp = cinfo->comp_info + c;
+		buffers[c] = cinfo->mem->alloc_sarray((j_common_ptr)cinfo,
+				JPOOL_IMAGE, comp->width_in_blocks * DCTSIZE,
+				comp->v_samp_factor * DCTSIZE);
+	}
+	gint rows = cinfo->max_v_samp_factor * DCTSIZE;
+	for (gint i = 0; cinfo->next_scanline < cinfo->image_height; ++i) {
+		if (priv->cancel && g_cancellable_set_error_if_cancelled(
+					priv->cancel, error)) {
+			goto error;
+		}
+		for (gint c = 0; c < cinfo->num_components; ++c) {
+			jpeg_component_info *comp = cinfo->comp_info + c;
+			gint width = comp->downsampled_width;
+			gint padded = comp->width_in_blocks * DCTSIZE;
+			gint height = comp->v_samp_factor * DCTSIZE;
+			for (gint j = 0; j < height; ++j) {
+				// replicate the bottom row & right column
+				gint row = MIN(i * height + j,
+						(gint)comp->downsampled_height - 1);
+				JSAMPROW out = buffers[c][j];
+				memcpy(out, planes->data[c]
+						+ (gsize)row * planes->stride[c],
+						width);
+				memset(out + width, out[width - 1],
+						padded - width);
 			}
-			break;
-		case CAIRO_CONTENT_ALPHA:
-			buffer = data + i * stride;
-			break;
-		default:
-			g_assert_not_reached();
 		}
-		jpeg_write_scanlines(&priv->compress, &buffer, 1);
-		++i;
+		jpeg_write_raw_data(cinfo, buffers, rows);
 	}
-	jpeg_finish_compress(&priv->compress);
+	jpeg_finish_compress(cinfo);
 exit:
-	switch (content) {
-	case CAIRO_CONTENT_COLOR:
-	case CAIRO_CONTENT_COLOR_ALPHA:
-		g_free(buffer);
-		break;
-	case CAIRO_CONTENT_ALPHA:
-	default:
-		break;
-	}
 	if (priv->output) {
 		g_object_unref(priv->output);
 		priv->output = NULL;
@@ -690,6 +3199,7 @@ exit:
 	}
 	return status;
 error:
+	jpeg_abort_compress(cinfo);
 	status = FALSE;
 	goto exit;
 }
@@ -734,3 +3244,240 @@ qahira_format_jpeg_get_quality(QahiraFormat *self)
 	g_return_val_if_fail(QAHIRA_IS_FORMAT_JPEG(self), 0);
 	return GET_PRIVATE(self)->quality;
 }
+
+void
+qahira_format_jpeg_set_profile(QahiraFormat *self,
+		QahiraFormatJpegProfile profile)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_JPEG(self));
+	GET_PRIVATE(self)->profile = profile;
+}
+
+QahiraFormatJpegProfile
+qahira_format_jpeg_get_profile(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_JPEG(self),
+			QAHIRA_FORMAT_JPEG_PROFILE_DEFAULT);
+	return GET_PRIVATE(self)->profile;
+}
+
+void
+qahira_format_jpeg_set_preview(QahiraFormat *self, gboolean preview)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_JPEG(self));
+	GET_PRIVATE(self)->preview = preview;
+}
+
+gboolean
+qahira_format_jpeg_get_preview(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_JPEG(self), FALSE);
+	return GET_PRIVATE(self)->preview;
+}
+
+void
+qahira_format_jpeg_set_optimize(QahiraFormat *self, gboolean optimize)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_JPEG(self));
+	GET_PRIVATE(self)->optimize = optimize;
+}
+
+gboolean
+qahira_format_jpeg_get_optimize(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_JPEG(self), FALSE);
+	return GET_PRIVATE(self)->optimize;
+}
+
+void
+qahira_format_jpeg_set_progressive(QahiraFormat *self, gboolean progressive)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_JPEG(self));
+	GET_PRIVATE(self)->progressive = progressive;
+}
+
+gboolean
+qahira_format_jpeg_get_progressive(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_JPEG(self), FALSE);
+	return GET_PRIVATE(self)->progressive;
+}
+
+void
+qahira_format_jpeg_set_subsampling(QahiraFormat *self,
+		QahiraFormatJpegSubsampling subsampling)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_JPEG(self));
+	GET_PRIVATE(self)->subsampling = subsampling;
+}
+
+QahiraFormatJpegSubsampling
+qahira_format_jpeg_get_subsampling(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_JPEG(self),
+			QAHIRA_FORMAT_JPEG_SUBSAMPLING_420);
+	return GET_PRIVATE(self)->subsampling;
+}
+
+void
+qahira_format_jpeg_set_restart_interval(QahiraFormat *self, gint rows)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_JPEG(self));
+	GET_PRIVATE(self)->restart = CLAMP(rows, 0, 65535);
+}
+
+gint
+qahira_format_jpeg_get_restart_interval(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_JPEG(self), 0);
+	return GET_PRIVATE(self)->restart;
+}
+
+void
+qahira_format_jpeg_set_dct_method(QahiraFormat *self,
+		QahiraFormatJpegDct method)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_JPEG(self));
+	GET_PRIVATE(self)->dct = method;
+}
+
+QahiraFormatJpegDct
+qahira_format_jpeg_get_dct_method(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_JPEG(self),
+			QAHIRA_FORMAT_JPEG_DCT_ISLOW);
+	return GET_PRIVATE(self)->dct;
+}
+
+void
+qahira_format_jpeg_set_target_size(QahiraFormat *self, gsize size)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_JPEG(self));
+	GET_PRIVATE(self)->target = size;
+}
+
+gsize
+qahira_format_jpeg_get_target_size(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_JPEG(self), 0);
+	return GET_PRIVATE(self)->target;
+}
+
+void
+qahira_format_jpeg_set_abbreviate(QahiraFormat *self, gboolean abbreviate)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_JPEG(self));
+	GET_PRIVATE(self)->abbreviate = abbreviate;
+}
+
+gboolean
+qahira_format_jpeg_get_abbreviate(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_JPEG(self), FALSE);
+	return GET_PRIVATE(self)->abbreviate;
+}
+
+gboolean
+qahira_format_jpeg_save_tables(QahiraFormat *self, GOutputStream *stream,
+		GCancellable *cancel, GError **error)
+{
+	qahira_return_error_if_fail(QAHIRA_IS_FORMAT_JPEG(self), FALSE, error);
+	qahira_return_error_if_fail(G_IS_OUTPUT_STREAM(stream), FALSE, error);
+	return save_tables(self, stream, cancel, error);
+}
+
+gboolean
+qahira_format_jpeg_load_tables(QahiraFormat *self, GInputStream *stream,
+		GCancellable *cancel, GError **error)
+{
+	qahira_return_error_if_fail(QAHIRA_IS_FORMAT_JPEG(self), FALSE, error);
+	qahira_return_error_if_fail(G_IS_INPUT_STREAM(stream), FALSE, error);
+	return load_tables(self, stream, cancel, error);
+}
+
+gboolean
+qahira_format_jpeg_transform(QahiraFormat *self, GInputStream *input,
+		GOutputStream *output, QahiraFormatJpegTransform transform,
+		const cairo_rectangle_int_t *crop, GCancellable *cancel,
+		GError **error)
+{
+	qahira_return_error_if_fail(QAHIRA_IS_FORMAT_JPEG(self), FALSE, error);
+	qahira_return_error_if_fail(G_IS_INPUT_STREAM(input), FALSE, error);
+	qahira_return_error_if_fail(G_IS_OUTPUT_STREAM(output), FALSE, error);
+	return transcode(self, input, output, transform, crop, cancel, error);
+}
+
+cairo_surface_t *
+qahira_format_jpeg_load_thumbnail(QahiraFormat *self, GInputStream *stream,
+		gint size, GCancellable *cancel, GError **error)
+{
+	qahira_return_error_if_fail(QAHIRA_IS_FORMAT_JPEG(self), NULL, error);
+	qahira_return_error_if_fail(G_IS_INPUT_STREAM(stream), NULL, error);
+	return load_thumbnail(self, stream, size, cancel, error);
+}
+
+void
+qahira_format_jpeg_set_auto_orient(QahiraFormat *self, gboolean auto_orient)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_JPEG(self));
+	GET_PRIVATE(self)->auto_orient = auto_orient;
+}
+
+gboolean
+qahira_format_jpeg_get_auto_orient(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_JPEG(self), FALSE);
+	return GET_PRIVATE(self)->auto_orient;
+}
+
+void
+qahira_format_jpeg_set_format(QahiraFormat *self, cairo_format_t format)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_JPEG(self));
+	g_return_if_fail(CAIRO_FORMAT_RGB24 == format
+			|| CAIRO_FORMAT_RGB16_565 == format);
+	GET_PRIVATE(self)->format = format;
+}
+
+cairo_format_t
+qahira_format_jpeg_get_format(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_JPEG(self), CAIRO_FORMAT_RGB24);
+	return GET_PRIVATE(self)->format;
+}
+
+void
+qahira_format_jpeg_set_dither(QahiraFormat *self, gboolean dither)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_JPEG(self));
+	GET_PRIVATE(self)->dither = dither;
+}
+
+gboolean
+qahira_format_jpeg_get_dither(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_JPEG(self), FALSE);
+	return GET_PRIVATE(self)->dither;
+}
+
+gboolean
+qahira_format_jpeg_load_planes(QahiraFormat *self, GInputStream *stream,
+		QahiraFormatJpegPlanes *planes, GCancellable *cancel,
+		GError **error)
+{
+	qahira_return_error_if_fail(QAHIRA_IS_FORMAT_JPEG(self), FALSE, error);
+	qahira_return_error_if_fail(G_IS_INPUT_STREAM(stream), FALSE, error);
+	qahira_return_error_if_fail(planes, FALSE, error);
+	return load_planes(self, stream, planes, cancel, error);
+}
+
+gboolean
+qahira_format_jpeg_save_planes(QahiraFormat *self,
+		const QahiraFormatJpegPlanes *planes, GOutputStream *stream,
+		GCancellable *cancel, GError **error)
+{
+	qahira_return_error_if_fail(QAHIRA_IS_FORMAT_JPEG(self), FALSE, error);
+	qahira_return_error_if_fail(planes, FALSE, error);
+	qahira_return_error_if_fail(G_IS_OUTPUT_STREAM(stream), FALSE, error);
+	return save_planes(self, planes, stream, cancel, error);
+}
@@ -23,7 +23,15 @@
 #include "qahira/error.h"
 #include "qahira/format/png.h"
 #include "qahira/format/private.h"
+#include "qahira/marshal.h"
 #include "qahira/utility.h"
+#include <string.h>
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif // HAVE_ZLIB
+#if QAHIRA_HAS_SPNG
+#include <spng.h>
+#endif // QAHIRA_HAS_SPNG
 
 G_DEFINE_TYPE(QahiraFormatPng, qahira_format_png, QAHIRA_TYPE_FORMAT)
 
@@ -34,12 +42,50 @@ G_DEFINE_TYPE(QahiraFormatPng, qahira_format_png, QAHIRA_TYPE_FORMAT)
 #define GET_PRIVATE(instance) \
 	((struct Private *)((QahiraFormatPng *)instance)->priv)
 
+enum Signals {
+	SIGNAL_PROGRESSIVE,
+	SIGNAL_LAST
+};
+
+static guint signals[SIGNAL_LAST] = { 0 };
+
+// decoder selected at configure time
+#if QAHIRA_HAS_SPNG
+#define QAHIRA_PNG_BACKEND QAHIRA_FORMAT_PNG_BACKEND_SPNG
+#else // QAHIRA_HAS_SPNG
+#define QAHIRA_PNG_BACKEND QAHIRA_FORMAT_PNG_BACKEND_LIBPNG
+#endif // QAHIRA_HAS_SPNG
+
+#if HAVE_ZLIB
+// smallest image (in pixels) compressed in parallel
+#define QAHIRA_PNG_PARALLEL_SIZE (1024 * 1024)
+
+// strips per worker thread, evens out differing complexity
+#define QAHIRA_PNG_STRIPS_PER_THREAD (2)
+
+// growth of the compressed data of a strip
+#define QAHIRA_PNG_BUFFER_SIZE (1024 * 32)
+
+// largest IDAT chunk written by the parallel encoder
+#define QAHIRA_PNG_IDAT_SIZE (1024 * 1024)
+#endif // HAVE_ZLIB
+
 struct Private {
 	GInputStream *input;
 	GOutputStream *output;
 	GCancellable *cancel;
+	QahiraFormatPngBackend backend;
 	gboolean interlace;
 	gint compression;
+	QahiraFormatPngFilter filters;
+	QahiraFormatPngStrategy strategy;
+	gint window_bits;
+	gint memory_level;
+	gint colors;
+	gboolean dither;
+#if HAVE_ZLIB
+	struct Animation *animation;
+#endif // HAVE_ZLIB
 	GError **error;
 };
 
@@ -48,8 +94,13 @@ qahira_format_png_init(QahiraFormatPng *self)
 {
 	self->priv = ASSIGN_PRIVATE(self);
 	struct Private *priv = GET_PRIVATE(self);
+	priv->backend = QAHIRA_PNG_BACKEND;
 	priv->interlace = FALSE;
 	priv->compression = 6;
+	priv->filters = QAHIRA_FORMAT_PNG_FILTER_ALL;
+	priv->strategy = QAHIRA_FORMAT_PNG_STRATEGY_AUTO;
+	priv->window_bits = 15;
+	priv->memory_level = 8;
 }
 
 static void
@@ -108,10 +159,16 @@ read_data_fn(png_structp png, png_bytep buffer, png_size_t size)
 	}
 }
 
-static void
-load_transform_fn(png_structp png, png_row_infop row, png_bytep data)
+/**
+ * \brief Convert RGBA samples to premultiplied cairo pixels in place.
+ *
+ * \return The bitwise AND of the alpha values
+ */
+static guint8
+premultiply_row(guchar *data, gint width)
 {
-	for (gint i = 0; i < row->width; ++i) {
+	guint8 mask = 0xff;
+	for (gint i = 0; i < width; ++i) {
 		gint red, green, blue;
 		gint alpha = data[3];
 		if (alpha == 0xff) {
@@ -127,17 +184,117 @@ load_transform_fn(png_structp png, png_row_infop row, png_bytep data)
 		data[QAHIRA_R] = red;
 		data[QAHIRA_G] = green;
 		data[QAHIRA_B] = blue;
+		mask &= alpha;
 		data += 4;
 	}
+	return mask;
+}
+
+static void
+load_transform_fn(png_structp png, png_row_infop row, png_bytep data)
+{
+	// track whether any pixel is translucent
+	guint8 *opaque = png_get_user_transform_ptr(png);
+	*opaque &= premultiply_row(data, row->width);
+}
+
+/**
+ * \brief Build the premultiplied pixel of each palette index or gray level.
+ *
+ * \return The surface format for the image.
+ */
+static cairo_format_t
+load_table(png_structp png, png_infop info, gint color, gint depth,
+		guint32 *table)
+{
+	cairo_format_t format = CAIRO_FORMAT_RGB24;
+	png_bytep trans_alpha = NULL;
+	int num_trans = 0;
+	png_color_16p trans_color = NULL;
+	if (png_get_valid(png, info, PNG_INFO_tRNS)) {
+		png_get_tRNS(png, info, &trans_alpha, &num_trans,
+				&trans_color);
+	}
+	// out of range indices are opaque black
+	for (gint i = 0; i < 256; ++i) {
+		table[i] = 0xff000000;
+	}
+	if (PNG_COLOR_TYPE_PALETTE == color) {
+		png_colorp palette = NULL;
+		int num_palette = 0;
+		png_get_PLTE(png, info, &palette, &num_palette);
+		for (gint i = 0; i < num_palette; ++i) {
+			guint32 alpha = trans_alpha && i < num_trans
+				? trans_alpha[i]
+				: 0xff;
+			guint32 red = palette[i].red;
+			guint32 green = palette[i].green;
+			guint32 blue = palette[i].blue;
+			if (alpha != 0xff) {
+				format = CAIRO_FORMAT_ARGB32;
+				red = qahira_premultiply(alpha, red);
+				green = qahira_premultiply(alpha, green);
+				blue = qahira_premultiply(alpha, blue);
+			}
+			table[i] = alpha << 24 | red << 16 | green << 8 | blue;
+		}
+	} else {
+		// scale gray levels to 8 bits
+		gint max = (1 << depth) - 1;
+		for (gint i = 0; i <= max; ++i) {
+			guint32 gray = i * 0xff / max;
+			table[i] = 0xff000000 | gray << 16 | gray << 8 | gray;
+		}
+		if (trans_color && trans_color->gray <= max) {
+			format = CAIRO_FORMAT_ARGB32;
+			table[trans_color->gray] = 0;
+		}
+	}
+	return format;
+}
+
+/**
+ * \brief Expand palette indices or gray levels to cairo pixels.
+ *
+ * The samples may be stored in the last quarter of the output row, each
+ * sample is read before its pixel is written.
+ *
+ * \return The bitwise AND of the alpha values
+ */
+static guint8
+load_row(const guint32 *table, const guchar *in, guint32 *out, gint width)
+{
+	guint32 mask = 0xffffffff;
+	for (gint i = 0; i < width; ++i) {
+		out[i] = table[in[i]];
+		mask &= out[i];
+	}
+	return mask >> 24;
+}
+
+/**
+ * \brief Check if the Adam7 passes will be observed.
+ */
+static inline gboolean
+has_progressive_handler(QahiraFormat *self)
+{
+	if (QAHIRA_FORMAT_PNG_GET_CLASS(self)->progressive) {
+		return TRUE;
+	}
+	return g_signal_has_handler_pending(self, signals[SIGNAL_PROGRESSIVE],
+			0, TRUE);
 }
 
+/**
+ * \brief Decode a PNG with libpng.
+ */
 static cairo_surface_t *
-load(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
+load_libpng(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
 		GError **error)
 {
 	struct Private *priv = GET_PRIVATE(self);
 	cairo_surface_t *surface = NULL;
-	png_byte **rows = NULL;
+	guchar *buffer = NULL;
 	png_structp png = NULL;
 	png_infop info = NULL;
 #ifdef PNG_USER_MEM_SUPPORTED
@@ -159,6 +316,17 @@ load(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
 		goto error;
 	}
 	png_set_read_fn(png, priv, read_data_fn);
+	if (qahira_format_get_trusted(self)) {
+		// skip checksums & everything not needed to decode pixels
+		png_set_crc_action(png, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+#ifdef PNG_IGNORE_ADLER32
+		png_set_option(png, PNG_IGNORE_ADLER32, PNG_OPTION_ON);
+#endif // PNG_IGNORE_ADLER32
+#ifdef PNG_HANDLE_AS_UNKNOWN_SUPPORTED
+		png_set_keep_unknown_chunks(png, PNG_HANDLE_CHUNK_NEVER,
+				NULL, -1);
+#endif // PNG_HANDLE_AS_UNKNOWN_SUPPORTED
+	}
 	priv->input = g_object_ref(stream);
 	if (cancel) {
 		priv->cancel = g_object_ref(cancel);
@@ -174,30 +342,34 @@ load(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
 	png_read_info(png, info);
 	png_get_IHDR(png, info, &width, &height, &depth, &color,
 			&interlace, NULL, NULL);
-	if (PNG_COLOR_TYPE_PALETTE == color) {
-		png_set_palette_to_rgb(png);
-	} else if (PNG_COLOR_TYPE_GRAY == color) {
-#if PNG_LIBPNG_VER >= 10209
-		png_set_expand_gray_1_2_4_to_8(png);
-#else // PNG_LIBPNG_VER
-		png_set_gray_1_2_4_to_8(png);
-#endif // PNG_LIBPNG_VER
-		png_set_gray_to_rgb(png);
-	} else if (PNG_COLOR_TYPE_GRAY_ALPHA) {
-		png_set_gray_to_rgb(png);
-	}
-	if (png_get_valid(png, info, PNG_INFO_tRNS)) {
-		png_set_tRNS_to_alpha(png);
-	}
-	if (16 == depth) {
-		png_set_strip_16(png);
-	} else if (8 > depth) {
-		png_set_packing(png);
+	// palette & gray images are expanded in a single pass via a table
+	gboolean lookup = PNG_COLOR_TYPE_PALETTE == color
+		|| (PNG_COLOR_TYPE_GRAY == color && 8 >= depth);
+	guint32 table[256];
+	cairo_format_t format = CAIRO_FORMAT_INVALID;
+	guint8 opaque = 0xff;
+	if (lookup) {
+		format = load_table(png, info, color, depth, table);
+		if (8 > depth) {
+			png_set_packing(png);
+		}
+	} else {
+		if (PNG_COLOR_TYPE_GRAY == color
+				|| PNG_COLOR_TYPE_GRAY_ALPHA == color) {
+			png_set_gray_to_rgb(png);
+		}
+		if (png_get_valid(png, info, PNG_INFO_tRNS)) {
+			png_set_tRNS_to_alpha(png);
+		}
+		if (16 == depth) {
+			png_set_strip_16(png);
+		}
+		png_set_filler(png, 0xff, PNG_FILLER_AFTER);
 	}
+	gint passes = 1;
 	if (PNG_INTERLACE_NONE != interlace) {
-		png_set_interlace_handling(png);
+		passes = png_set_interlace_handling(png);
 	}
-	png_set_filler(png, 0xff, PNG_FILLER_AFTER);
 	png_read_update_info(png, info);
 	png_get_IHDR(png, info, &width, &height, &depth, &color, &interlace,
 			NULL, NULL);
@@ -206,20 +378,23 @@ load(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
 				Q_("png: unsupported bit depth"));
 		goto error;
 	}
-	cairo_format_t format;
-	switch (color) {
-	case PNG_COLOR_TYPE_RGB:
-		format = CAIRO_FORMAT_RGB24;
-		break;
-	case PNG_COLOR_TYPE_RGB_ALPHA:
-		format = CAIRO_FORMAT_ARGB32;
-		break;
-	default:
-		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_UNSUPPORTED,
-				Q_("png: unsupported color format"));
-		goto error;
+	if (!lookup) {
+		switch (color) {
+		case PNG_COLOR_TYPE_RGB:
+			format = CAIRO_FORMAT_RGB24;
+			break;
+		case PNG_COLOR_TYPE_RGB_ALPHA:
+			format = CAIRO_FORMAT_ARGB32;
+			break;
+		default:
+			g_set_error(error, QAHIRA_ERROR,
+					QAHIRA_ERROR_UNSUPPORTED,
+					Q_("png: unsupported color format"));
+			goto error;
+		}
+		png_set_read_user_transform_fn(png, load_transform_fn);
+		png_set_user_transform_info(png, &opaque, 0, 0);
 	}
-	png_set_read_user_transform_fn(png, load_transform_fn);
 	surface = qahira_format_surface_create(self, format, width, height);
 	if (G_UNLIKELY(!surface)) {
 		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
@@ -243,21 +418,71 @@ load(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
 		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
 				Q_("png: invalid stride"));
 	}
-	rows = g_try_new(guchar *, height);
-	if (G_UNLIKELY(!rows)) {
-		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
-				Q_("png: out of memory"));
-		goto error;
-	}
-	for (gint i = 0; i < height; ++i) {
-		rows[i] = &data[i * stride];
+	// without a listener an interlaced image is shown after the last pass
+	gboolean progressive = 1 < passes && has_progressive_handler(self);
+	guchar *samples = data;
+	gint sample_stride = stride;
+	if (lookup) {
+		if (progressive) {
+			// every pass is expanded, keep the samples apart
+			buffer = g_try_malloc(width * height);
+			if (G_UNLIKELY(!buffer)) {
+				g_set_error(error, QAHIRA_ERROR,
+						QAHIRA_ERROR_NO_MEMORY,
+						Q_("png: out of memory"));
+				goto error;
+			}
+			samples = buffer;
+			sample_stride = width;
+		} else {
+			// decode samples into the end of the row
+			samples += 3 * width;
+		}
 	}
 	cairo_surface_flush(surface);
-	png_read_image(png, rows);
+	for (gint pass = 0; pass < passes; ++pass) {
+		for (gint i = 0; i < height; ++i) {
+			if (priv->cancel && g_cancellable_set_error_if_cancelled(
+						priv->cancel, error)) {
+				goto error;
+			}
+			guchar *row = samples + i * sample_stride;
+			if (progressive) {
+				// fill the blocks of the following passes
+				png_read_row(png, NULL, row);
+			} else {
+				png_read_row(png, row, NULL);
+			}
+			if (lookup && 1 == passes) {
+				opaque &= load_row(table, row,
+						(guint32 *)&data[i * stride],
+						width);
+			}
+		}
+		if (lookup && 1 < passes
+				&& (progressive || pass + 1 == passes)) {
+			opaque = 0xff;
+			for (gint i = 0; i < height; ++i) {
+				opaque &= load_row(table,
+						samples + i * sample_stride,
+						(guint32 *)&data[i * stride],
+						width);
+			}
+		}
+		if (progressive) {
+			cairo_surface_mark_dirty(surface);
+			g_signal_emit(self, signals[SIGNAL_PROGRESSIVE], 0,
+					surface);
+			cairo_surface_flush(surface);
+		}
+	}
 	png_read_end(png, info);
 	cairo_surface_mark_dirty(surface);
+	if (CAIRO_FORMAT_ARGB32 == format && 0xff == opaque) {
+		surface = qahira_format_surface_make_opaque(self, surface);
+	}
 exit:
-	g_free(rows);
+	g_free(buffer);
 	if (png) {
 		png_destroy_read_struct(&png, &info, NULL);
 	}
@@ -278,102 +503,87 @@ error:
 	goto exit;
 }
 
-static void
-write_data_fn(png_structp png, png_bytep buffer, png_size_t size)
+#if QAHIRA_HAS_SPNG
+static int
+read_stream_fn(spng_ctx *ctx, void *user, void *data, size_t size)
 {
-	struct Private *priv = png_get_io_ptr(png);
+	struct Private *priv = user;
+	guchar *buffer = data;
 	while (size) {
-		gssize bytes = g_output_stream_write(priv->output, buffer,
-				size, priv->cancel, priv->error);
+		gssize bytes = g_input_stream_read(priv->input, buffer, size,
+				priv->cancel, priv->error);
 		if (-1 == bytes) {
-			png_error(png, NULL);
+			return SPNG_IO_ERROR;
+		}
+		if (!bytes) {
+			return SPNG_IO_EOF;
 		}
 		size -= bytes;
 		buffer += bytes;
 	}
+	return 0;
 }
 
-static void
-output_flush_fn(png_structp png)
-{
-	struct Private *priv = png_get_io_ptr(png);
-	gboolean status = g_output_stream_flush(priv->output, priv->cancel,
-			priv->error);
-	if (!status) {
-		png_error(png, NULL);
-	}
-}
-
-static void
-save_transform_fn(png_structp png, png_row_infop row, png_bytep data)
-{
-	for (gint i = 0; i < row->width; ++i) {
-		gint red, green, blue;
-		gint alpha = data[QAHIRA_A];
-		if (alpha == 0xff) {
-			red = data[QAHIRA_R];
-			green = data[QAHIRA_G];
-			blue = data[QAHIRA_B];
-		} else {
-			red = qahira_unpremultiply(alpha, data[QAHIRA_R]);
-			green = qahira_unpremultiply(alpha, data[QAHIRA_G]);
-			blue = qahira_unpremultiply(alpha, data[QAHIRA_B]);
-		}
-		data[0] = red;
-		data[1] = green;
-		data[2] = blue;
-		data[3] = alpha;
-		data += 4;
-	}
-}
-
-static gboolean
-save(QahiraFormat *self, cairo_surface_t *surface, GOutputStream *stream,
-		GCancellable *cancel, GError **error)
+/**
+ * \brief Decode a PNG with libspng.
+ *
+ * Images are decoded to RGBA one row at a time and premultiplied, so the
+ * result matches the libpng backend.
+ */
+static cairo_surface_t *
+load_spng(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
+		GError **error)
 {
 	struct Private *priv = GET_PRIVATE(self);
-	priv->input = g_object_ref(stream);
-	gboolean status = TRUE;
-	png_structp png = NULL;
-	png_infop info = NULL;
-	png_byte **rows = NULL;
-	gint width, height;
-	qahira_surface_size(surface, &width, &height);
-	if (!width || !height) {
-		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
-				Q_("png: invalid dimensions [%d x %d]"),
-				width, height);
-		goto error;
-	}
-#ifdef PNG_USER_MEM_SUPPORTED
-	png = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, priv,
-			error_fn, warn_fn, NULL, malloc_fn, free_fn);
-#else // PNG_USER_MEM_SUPPORTED
-	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, priv,
-			error_fn, warn_fn);
-#endif // PNG_USER_MEM_SUPPORTED
-	if (G_UNLIKELY(!png)) {
+	cairo_surface_t *surface = NULL;
+	gint status = 0;
+	gboolean trusted = qahira_format_get_trusted(self);
+	spng_ctx *ctx = spng_ctx_new(trusted ? SPNG_CTX_IGNORE_ADLER32 : 0);
+	if (G_UNLIKELY(!ctx)) {
 		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
 				Q_("png: out of memory"));
 		goto error;
 	}
-	info = png_create_info_struct(png);
-	if (G_UNLIKELY(!info)) {
-		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
-				Q_("png: out of memory"));
-		goto error;
+	if (trusted) {
+		status = spng_set_crc_action(ctx, SPNG_CRC_USE, SPNG_CRC_USE);
+		if (G_UNLIKELY(status)) {
+			goto failure;
+		}
 	}
-	png_set_write_fn(png, priv, write_data_fn, output_flush_fn);
-	priv->output = g_object_ref(stream);
+	priv->input = g_object_ref(stream);
 	if (cancel) {
 		priv->cancel = g_object_ref(cancel);
 	}
 	priv->error = error;
-#ifdef PNG_SETJMP_SUPPORTED
-	if (setjmp(png_jmpbuf(png))) {
+	status = spng_set_png_stream(ctx, read_stream_fn, priv);
+	if (G_UNLIKELY(status)) {
+		goto failure;
+	}
+	struct spng_ihdr ihdr;
+	status = spng_get_ihdr(ctx, &ihdr);
+	if (G_UNLIKELY(status)) {
+		goto failure;
+	}
+	// only images with an alpha channel or tRNS can be translucent
+	struct spng_trns trns;
+	gboolean alpha = SPNG_COLOR_TYPE_GRAYSCALE_ALPHA == ihdr.color_type
+		|| SPNG_COLOR_TYPE_TRUECOLOR_ALPHA == ihdr.color_type
+		|| !spng_get_trns(ctx, &trns);
+	surface = qahira_format_surface_create(self, alpha
+				? CAIRO_FORMAT_ARGB32
+				: CAIRO_FORMAT_RGB24,
+			ihdr.width, ihdr.height);
+	if (G_UNLIKELY(!surface)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
+				Q_("png: out of memory"));
+		goto error;
+	}
+	cairo_status_t cairo_status = cairo_surface_status(surface);
+	if (G_UNLIKELY(CAIRO_STATUS_SUCCESS != cairo_status)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_CAIRO,
+				"png: %s", cairo_status_to_string(cairo_status));
 		goto error;
 	}
-#endif // PNG_SETJMP_SUPPORTED
 	guchar *data = qahira_format_surface_get_data(self, surface);
 	if (G_UNLIKELY(!data)) {
 		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
@@ -384,90 +594,1946 @@ save(QahiraFormat *self, cairo_surface_t *surface, GOutputStream *stream,
 	if (G_UNLIKELY(0 > stride)) {
 		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
 				Q_("png: invalid stride"));
-	}
-	rows = g_try_new(guchar *, height);
-	if (G_UNLIKELY(!rows)) {
-		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
-				Q_("png: out of memory"));
 		goto error;
 	}
-	for (gint i = 0; i < height; ++i) {
-		rows[i] = data + i * stride;
+	status = spng_decode_image(ctx, NULL, 0, SPNG_FMT_RGBA8,
+			SPNG_DECODE_TRNS | SPNG_DECODE_PROGRESSIVE);
+	if (G_UNLIKELY(status)) {
+		goto failure;
 	}
-	gint depth, color;
-	cairo_content_t content = cairo_surface_get_content(surface);
-	switch (content) {
-	case CAIRO_CONTENT_COLOR:
-		depth = 8;
-		color = PNG_COLOR_TYPE_RGB;
-		break;
-	case CAIRO_CONTENT_COLOR_ALPHA:
-		depth = 8;
-		color = PNG_COLOR_TYPE_RGB_ALPHA;
-#if G_BYTE_ORDER == G_LITTLE_ENDIAN
-		png_set_packswap(png);
-#endif // G_BYTE_ORDER
-		break;
-	case CAIRO_CONTENT_ALPHA:
-		depth = 1;
-		color = PNG_COLOR_TYPE_GRAY;
-		break;
-	default:
-		g_assert_not_reached();
+	cairo_surface_flush(surface);
+	guint8 opaque = 0xff;
+	struct spng_row_info row;
+	do {
+		if (priv->cancel && g_cancellable_set_error_if_cancelled(
+					priv->cancel, error)) {
+			goto error;
+		}
+		status = spng_get_row_info(ctx, &row);
+		if (G_UNLIKELY(status)) {
+			break;
+		}
+		guchar *line = data + row.row_num * stride;
+		status = spng_decode_row(ctx, line, ihdr.width * 4);
+		if (G_UNLIKELY(status && SPNG_EOI != status)) {
+			break;
+		}
+		if (!ihdr.interlace_method) {
+			opaque &= premultiply_row(line, ihdr.width);
+		}
+	} while (!status);
+	if (G_UNLIKELY(SPNG_EOI != status)) {
+		goto failure;
 	}
-	png_set_compression_level(png, priv->compression);
-	png_set_IHDR(png, info, width, height, depth, color,
-			priv->interlace
-				? PNG_INTERLACE_ADAM7
-				: PNG_INTERLACE_NONE,
-			PNG_COMPRESSION_TYPE_DEFAULT,
-			PNG_FILTER_TYPE_DEFAULT);
-	png_write_info(png, info);
-	if (PNG_COLOR_TYPE_RGB == color) {
-		png_set_filler(png, 0, PNG_FILLER_AFTER);
+	if (ihdr.interlace_method) {
+		// rows are complete after the last pass
+		for (gint i = 0; i < ihdr.height; ++i) {
+			opaque &= premultiply_row(data + i * stride,
+					ihdr.width);
+		}
+	}
+	cairo_surface_mark_dirty(surface);
+	if (alpha && 0xff == opaque) {
+		// opaque despite the alpha channel or tRNS
+		surface = qahira_format_surface_make_opaque(self, surface);
 	}
-	png_set_write_user_transform_fn(png, save_transform_fn);
-	png_write_image(png, rows);
-	png_write_end(png, info);
 exit:
-	g_free(rows);
-	if (png) {
-		png_destroy_write_struct(&png, &info);
+	if (ctx) {
+		spng_ctx_free(ctx);
 	}
-	if (priv->output) {
-		g_object_unref(priv->output);
-		priv->output = NULL;
+	if (priv->input) {
+		g_object_unref(priv->input);
+		priv->input = NULL;
 	}
 	if (priv->cancel) {
 		g_object_unref(priv->cancel);
 		priv->cancel = NULL;
 	}
-	return status;
+	return surface;
+failure:
+	if (error && *error) {
+		g_prefix_error(error, "png: ");
+	} else {
+		g_set_error(error, QAHIRA_ERROR, SPNG_EMEM == status
+					? QAHIRA_ERROR_NO_MEMORY
+					: QAHIRA_ERROR_CORRUPT_IMAGE,
+				"png: %s", spng_strerror(status));
+	}
 error:
-	status = FALSE;
+	if (surface) {
+		cairo_surface_destroy(surface);
+		surface = NULL;
+	}
 	goto exit;
 }
+#endif // QAHIRA_HAS_SPNG
 
-static void
-qahira_format_png_class_init(QahiraFormatPngClass *klass)
-{
-	QahiraFormatClass *format_class = QAHIRA_FORMAT_CLASS(klass);
-	format_class->load = load;
-	format_class->save = save;
-	g_type_class_add_private(klass, sizeof(struct Private));
-}
+/**
+ * \brief A PNG decoder.
+ */
+struct Backend {
+	QahiraFormatLoad load;
+	gboolean progressive; // Adam7 passes are signaled
+};
 
-QahiraFormat *
-qahira_format_png_new(void)
+static const struct Backend backends[] = {
+	[QAHIRA_FORMAT_PNG_BACKEND_LIBPNG] = { load_libpng, TRUE },
+#if QAHIRA_HAS_SPNG
+	[QAHIRA_FORMAT_PNG_BACKEND_SPNG] = { load_spng, FALSE },
+#endif // QAHIRA_HAS_SPNG
+};
+
+static cairo_surface_t *
+load(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
+		GError **error)
 {
-	return g_object_new(QAHIRA_TYPE_FORMAT_PNG,
-			"mime-type", "image/png",
-			NULL);
+	const struct Backend *backend =
+		&backends[GET_PRIVATE(self)->backend];
+	if (!backend->progressive && has_progressive_handler(self)) {
+		// previews are drawn by a backend that signals each pass
+		backend = &backends[QAHIRA_FORMAT_PNG_BACKEND_LIBPNG];
+	}
+	return backend->load(self, stream, cancel, error);
 }
 
-void
-qahira_format_png_set_compression(QahiraFormat *self, gint compression)
-{
+#if HAVE_ZLIB
+/**
+ * \brief APNG frame control (fcTL).
+ */
+struct Control {
+	guint32 width;
+	guint32 height;
+	guint32 x;
+	guint32 y;
+	guint delay_num;
+	guint delay_den;
+	guint8 dispose;
+	guint8 blend;
+};
+
+// APNG dispose operations
+enum Dispose {
+	DISPOSE_NONE,
+	DISPOSE_BACKGROUND, // clear the frame region
+	DISPOSE_PREVIOUS // restore the frame region
+};
+
+// APNG blend operations
+enum Blend {
+	BLEND_SOURCE,
+	BLEND_OVER
+};
+
+// a growable buffer sized from untrusted chunk lengths
+struct Buffer {
+	guchar *data;
+	gsize length;
+	gsize size;
+};
+
+/**
+ * \brief State of an APNG being decoded one frame at a time.
+ *
+ * Each frame is rebuilt as a standalone PNG (the IHDR is resized & the
+ * fdAT chunks are renamed IDAT) and decoded by the selected backend. The
+ * frame is then composited onto the canvas, only the previous canvas
+ * content of regions disposed to DISPOSE_PREVIOUS is kept.
+ */
+struct Animation {
+	GInputStream *stream;
+	guchar ihdr[13];
+	guint32 width;
+	guint32 height;
+	struct Buffer head; // chunks preceding the image data, e.g. PLTE
+	struct Buffer png; // the frame being rebuilt
+	struct Control control; // the frame being rebuilt
+	struct Control next;
+	gboolean pending; // the next frame control has been read
+	guint32 length; // data chunk read by open_frames()
+	gboolean lookahead;
+	struct Control last; // disposed before the next frame
+	gboolean composited;
+	gboolean done;
+	cairo_surface_t *canvas;
+	cairo_surface_t *previous;
+};
+
+static inline guint32
+get_uint32(const guchar *data)
+{
+	return (guint32)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+static inline void
+set_uint32(guchar *data, guint32 value)
+{
+	data[0] = (value >> 24) & 0xff;
+	data[1] = (value >> 16) & 0xff;
+	data[2] = (value >> 8) & 0xff;
+	data[3] = value & 0xff;
+}
+
+static void
+animation_free(struct Animation *animation)
+{
+	if (animation) {
+		if (animation->stream) {
+			g_object_unref(animation->stream);
+		}
+		g_free(animation->head.data);
+		g_free(animation->png.data);
+		if (animation->canvas) {
+			cairo_surface_destroy(animation->canvas);
+		}
+		if (animation->previous) {
+			cairo_surface_destroy(animation->previous);
+		}
+		g_free(animation);
+	}
+}
+
+/**
+ * \brief Extend a buffer by \e length bytes.
+ *
+ * \return The first new byte or NULL if the buffer cannot grow.
+ */
+static guchar *
+buffer_grow(struct Buffer *buffer, gsize length, GError **error)
+{
+	if (G_UNLIKELY(length > G_MAXSIZE - buffer->length)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_CORRUPT_IMAGE,
+				Q_("png: image data too large"));
+		return NULL;
+	}
+	gsize needed = buffer->length + length;
+	if (needed > buffer->size) {
+		gsize size = MAX(buffer->size, 4096);
+		while (size < needed) {
+			size = size > G_MAXSIZE / 2 ? needed : size * 2;
+		}
+		guchar *data = g_try_realloc(buffer->data, size);
+		if (G_UNLIKELY(!data)) {
+			g_set_error(error, QAHIRA_ERROR,
+					QAHIRA_ERROR_NO_MEMORY,
+					Q_("png: out of memory"));
+			return NULL;
+		}
+		buffer->data = data;
+		buffer->size = size;
+	}
+	guchar *data = buffer->data + buffer->length;
+	buffer->length = needed;
+	return data;
+}
+
+static gboolean
+buffer_append(struct Buffer *buffer, const guchar *data, gsize length,
+		GError **error)
+{
+	if (!length) {
+		return TRUE;
+	}
+	guchar *out = buffer_grow(buffer, length, error);
+	if (G_UNLIKELY(!out)) {
+		return FALSE;
+	}
+	memcpy(out, data, length);
+	return TRUE;
+}
+
+static gboolean
+read_bytes(GInputStream *stream, guchar *buffer, gsize size,
+		GCancellable *cancel, GError **error)
+{
+	while (size) {
+		gssize bytes = g_input_stream_read(stream, buffer, size,
+				cancel, error);
+		if (G_UNLIKELY(-1 == bytes)) {
+			return FALSE;
+		}
+		if (G_UNLIKELY(!bytes)) {
+			g_set_error(error, QAHIRA_ERROR,
+					QAHIRA_ERROR_CORRUPT_IMAGE,
+					Q_("png: truncated image"));
+			return FALSE;
+		}
+		size -= bytes;
+		buffer += bytes;
+	}
+	return TRUE;
+}
+
+static gboolean
+skip_bytes(GInputStream *stream, gsize size, GCancellable *cancel,
+		GError **error)
+{
+	while (size) {
+		gssize bytes = g_input_stream_skip(stream, size, cancel,
+				error);
+		if (G_UNLIKELY(-1 == bytes)) {
+			return FALSE;
+		}
+		if (G_UNLIKELY(!bytes)) {
+			g_set_error(error, QAHIRA_ERROR,
+					QAHIRA_ERROR_CORRUPT_IMAGE,
+					Q_("png: truncated image"));
+			return FALSE;
+		}
+		size -= bytes;
+	}
+	return TRUE;
+}
+
+/**
+ * \brief Read the length & type of the next chunk.
+ */
+static gboolean
+read_chunk_header(struct Animation *animation, guint32 *length,
+		guchar *type, GCancellable *cancel, GError **error)
+{
+	guchar header[8];
+	if (!read_bytes(animation->stream, header, sizeof(header), cancel,
+				error)) {
+		return FALSE;
+	}
+	*length = get_uint32(header);
+	if (G_UNLIKELY(*length > 0x7fffffff)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_CORRUPT_IMAGE,
+				Q_("png: invalid chunk length"));
+		return FALSE;
+	}
+	memcpy(type, header + 4, 4);
+	return TRUE;
+}
+
+/**
+ * \brief Read the CRC following chunk data & compare it to \e crc.
+ *
+ * Trusted input is not verified.
+ */
+static gboolean
+read_chunk_crc(QahiraFormat *self, struct Animation *animation, uLong crc,
+		GCancellable *cancel, GError **error)
+{
+	guchar footer[4];
+	if (!read_bytes(animation->stream, footer, sizeof(footer), cancel,
+				error)) {
+		return FALSE;
+	}
+	if (!qahira_format_get_trusted(self) && get_uint32(footer) != crc) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_CORRUPT_IMAGE,
+				Q_("png: CRC error"));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * \brief Read a small chunk (IHDR, acTL or fcTL) of a known size.
+ */
+static gboolean
+read_chunk(QahiraFormat *self, struct Animation *animation,
+		const guchar *type, guint32 length, guchar *data, gsize size,
+		GCancellable *cancel, GError **error)
+{
+	if (G_UNLIKELY(length != size)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_CORRUPT_IMAGE,
+				Q_("png: invalid %.4s chunk"), type);
+		return FALSE;
+	}
+	if (!read_bytes(animation->stream, data, size, cancel, error)) {
+		return FALSE;
+	}
+	uLong crc = crc32(crc32(0, type, 4), data, size);
+	return read_chunk_crc(self, animation, crc, cancel, error);
+}
+
+static gboolean
+read_control(QahiraFormat *self, struct Animation *animation,
+		guint32 length, struct Control *control, GCancellable *cancel,
+		GError **error)
+{
+	guchar data[26];
+	if (!read_chunk(self, animation, (const guchar *)"fcTL", length,
+				data, sizeof(data), cancel, error)) {
+		return FALSE;
+	}
+	control->width = get_uint32(data + 4);
+	control->height = get_uint32(data + 8);
+	control->x = get_uint32(data + 12);
+	control->y = get_uint32(data + 16);
+	control->delay_num = data[20] << 8 | data[21];
+	control->delay_den = data[22] << 8 | data[23];
+	control->dispose = data[24];
+	control->blend = data[25];
+	if (G_UNLIKELY(!control->width || !control->height
+			|| control->x >= animation->width
+			|| control->y >= animation->height
+			|| control->width > animation->width - control->x
+			|| control->height > animation->height - control->y
+			|| control->dispose > DISPOSE_PREVIOUS
+			|| control->blend > BLEND_OVER)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_CORRUPT_IMAGE,
+				Q_("png: invalid frame control"));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * \brief Append image data (the payload of an IDAT or fdAT chunk).
+ */
+static gboolean
+read_image_data(QahiraFormat *self, struct Animation *animation,
+		const guchar *type, guint32 length, GCancellable *cancel,
+		GError **error)
+{
+	uLong crc = crc32(0, type, 4);
+	if (!memcmp(type, "fdAT", 4)) {
+		// strip the sequence number
+		guchar sequence[4];
+		if (G_UNLIKELY(4 > length)) {
+			g_set_error(error, QAHIRA_ERROR,
+					QAHIRA_ERROR_CORRUPT_IMAGE,
+					Q_("png: invalid fdAT chunk"));
+			return FALSE;
+		}
+		if (!read_bytes(animation->stream, sequence, 4, cancel,
+					error)) {
+			return FALSE;
+		}
+		crc = crc32(crc, sequence, 4);
+		length -= 4;
+	}
+	guchar *data = buffer_grow(&animation->png, length, error);
+	if (G_UNLIKELY(!data)) {
+		return FALSE;
+	}
+	if (!read_bytes(animation->stream, data, length, cancel, error)) {
+		return FALSE;
+	}
+	if (!qahira_format_get_trusted(self)) {
+		crc = crc32(crc, data, length);
+	}
+	return read_chunk_crc(self, animation, crc, cancel, error);
+}
+
+/**
+ * \brief Start rebuilding a frame as a standalone PNG.
+ */
+static gboolean
+begin_frame(struct Animation *animation, GError **error)
+{
+	static const guchar signature[] = {
+		0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a
+	};
+	guchar ihdr[25];
+	set_uint32(ihdr, sizeof(animation->ihdr));
+	memcpy(ihdr + 4, "IHDR", 4);
+	memcpy(ihdr + 8, animation->ihdr, sizeof(animation->ihdr));
+	set_uint32(ihdr + 8, animation->control.width);
+	set_uint32(ihdr + 12, animation->control.height);
+	set_uint32(ihdr + 21, crc32(0, ihdr + 4, 17));
+	struct Buffer *png = &animation->png;
+	png->length = 0;
+	// the IDAT length is filled in by end_frame()
+	return buffer_append(png, signature, sizeof(signature), error)
+		&& buffer_append(png, ihdr, sizeof(ihdr), error)
+		&& buffer_append(png, animation->head.data,
+				animation->head.length, error)
+		&& buffer_append(png, (const guchar *)"\0\0\0\0IDAT", 8,
+				error);
+}
+
+/**
+ * \brief Complete the IDAT & append IEND.
+ */
+static gboolean
+end_frame(struct Animation *animation, GError **error)
+{
+	static const guchar iend[] = {
+		0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4e, 0x44,
+		0xae, 0x42, 0x60, 0x82
+	};
+	struct Buffer *png = &animation->png;
+	gsize offset = 8 + 25 + animation->head.length;
+	gsize size = png->length - offset - 8;
+	if (G_UNLIKELY(!size || size > 0x7fffffff)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_CORRUPT_IMAGE,
+				Q_("png: invalid frame data"));
+		return FALSE;
+	}
+	set_uint32(png->data + offset, size);
+	guchar crc[4];
+	set_uint32(crc, crc32(0, png->data + offset + 4, size + 4));
+	return buffer_append(png, crc, sizeof(crc), error)
+		&& buffer_append(png, iend, sizeof(iend), error);
+}
+
+static void
+close_frames(QahiraFormat *self)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	animation_free(priv->animation);
+	priv->animation = NULL;
+}
+
+/**
+ * \brief Read the chunks preceding the image data.
+ *
+ * Images without an acTL chunk are treated as a single frame.
+ */
+static gboolean
+open_frames(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
+		GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	struct Animation *animation = g_new0(struct Animation, 1);
+	priv->animation = animation;
+	animation->stream = g_object_ref(stream);
+	guchar signature[8];
+	if (!read_bytes(stream, signature, sizeof(signature), cancel,
+				error)) {
+		goto error;
+	}
+	if (png_sig_cmp(signature, 0, sizeof(signature))) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_CORRUPT_IMAGE,
+				Q_("png: invalid signature"));
+		goto error;
+	}
+	gboolean animated = FALSE, header = FALSE;
+	while (TRUE) {
+		guint32 length;
+		guchar type[4];
+		if (!read_chunk_header(animation, &length, type, cancel,
+					error)) {
+			goto error;
+		}
+		if (!header && memcmp(type, "IHDR", 4)) {
+			g_set_error(error, QAHIRA_ERROR,
+					QAHIRA_ERROR_CORRUPT_IMAGE,
+					Q_("png: missing IHDR"));
+			goto error;
+		}
+		if (!memcmp(type, "IHDR", 4)) {
+			if (!read_chunk(self, animation, type, length,
+						animation->ihdr,
+						sizeof(animation->ihdr),
+						cancel, error)) {
+				goto error;
+			}
+			animation->width = get_uint32(animation->ihdr);
+			animation->height = get_uint32(animation->ihdr + 4);
+			if (G_UNLIKELY(!animation->width || !animation->height
+					|| animation->width > G_MAXINT
+					|| animation->height > G_MAXINT)) {
+				g_set_error(error, QAHIRA_ERROR,
+						QAHIRA_ERROR_CORRUPT_IMAGE,
+						Q_("png: invalid dimensions"));
+				goto error;
+			}
+			header = TRUE;
+		} else if (!memcmp(type, "acTL", 4)) {
+			guchar data[8];
+			if (!read_chunk(self, animation, type, length, data,
+						sizeof(data), cancel, error)) {
+				goto error;
+			}
+			animated = TRUE;
+		} else if (!memcmp(type, "fcTL", 4)) {
+			if (!read_control(self, animation, length,
+						&animation->next, cancel,
+						error)) {
+				goto error;
+			}
+			animation->pending = TRUE;
+		} else if (!memcmp(type, "IDAT", 4)) {
+			// read by next_frame()
+			animation->length = length;
+			animation->lookahead = TRUE;
+			break;
+		} else if (!memcmp(type, "IEND", 4)) {
+			g_set_error(error, QAHIRA_ERROR,
+					QAHIRA_ERROR_CORRUPT_IMAGE,
+					Q_("png: missing image data"));
+			goto error;
+		} else {
+			guchar *data = buffer_grow(&animation->head,
+					(gsize)length + 12, error);
+			if (G_UNLIKELY(!data)) {
+				goto error;
+			}
+			set_uint32(data, length);
+			memcpy(data + 4, type, 4);
+			if (!read_bytes(stream, data + 8, length + 4, cancel,
+						error)) {
+				goto error;
+			}
+		}
+	}
+	if (!animated) {
+		struct Control control = {
+			.width = animation->width,
+			.height = animation->height,
+			.dispose = DISPOSE_NONE,
+			.blend = BLEND_SOURCE
+		};
+		animation->next = control;
+		animation->pending = TRUE;
+	}
+	animation->canvas = qahira_format_surface_create(self,
+			CAIRO_FORMAT_ARGB32, animation->width,
+			animation->height);
+	if (G_UNLIKELY(!animation->canvas)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
+				Q_("png: out of memory"));
+		goto error;
+	}
+	cairo_status_t status = cairo_surface_status(animation->canvas);
+	if (G_UNLIKELY(CAIRO_STATUS_SUCCESS != status)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_CAIRO,
+				"png: %s", cairo_status_to_string(status));
+		goto error;
+	}
+	cairo_t *cr = cairo_create(animation->canvas);
+	cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+	return TRUE;
+error:
+	close_frames(self);
+	return FALSE;
+}
+
+/**
+ * \brief Apply the dispose operation of the last frame.
+ */
+static void
+dispose_frame(struct Animation *animation)
+{
+	const struct Control *last = &animation->last;
+	if (DISPOSE_NONE == last->dispose) {
+		return;
+	}
+	cairo_t *cr = cairo_create(animation->canvas);
+	if (DISPOSE_PREVIOUS == last->dispose && animation->previous) {
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+		cairo_set_source_surface(cr, animation->previous, 0., 0.);
+	} else {
+		cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+	}
+	cairo_rectangle(cr, last->x, last->y, last->width, last->height);
+	cairo_fill(cr);
+	cairo_destroy(cr);
+}
+
+/**
+ * \brief Composite a frame onto the canvas.
+ */
+static gboolean
+composite_frame(QahiraFormat *self, struct Animation *animation,
+		cairo_surface_t *frame, GError **error)
+{
+	const struct Control *control = &animation->control;
+	if (DISPOSE_PREVIOUS == control->dispose && animation->composited) {
+		if (!animation->previous) {
+			animation->previous = qahira_format_surface_create(
+					self, CAIRO_FORMAT_ARGB32,
+					animation->width, animation->height);
+			if (G_UNLIKELY(!animation->previous)) {
+				g_set_error(error, QAHIRA_ERROR,
+						QAHIRA_ERROR_NO_MEMORY,
+						Q_("png: out of memory"));
+				return FALSE;
+			}
+			cairo_status_t status =
+				cairo_surface_status(animation->previous);
+			if (G_UNLIKELY(CAIRO_STATUS_SUCCESS != status)) {
+				g_set_error(error, QAHIRA_ERROR,
+						QAHIRA_ERROR_CAIRO, "png: %s",
+						cairo_status_to_string(status));
+				return FALSE;
+			}
+		}
+		cairo_t *cr = cairo_create(animation->previous);
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+		cairo_set_source_surface(cr, animation->canvas, 0., 0.);
+		cairo_rectangle(cr, control->x, control->y, control->width,
+				control->height);
+		cairo_fill(cr);
+		cairo_destroy(cr);
+	}
+	cairo_t *cr = cairo_create(animation->canvas);
+	if (BLEND_SOURCE == control->blend) {
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	}
+	cairo_set_source_surface(cr, frame, control->x, control->y);
+	cairo_rectangle(cr, control->x, control->y, control->width,
+			control->height);
+	cairo_fill(cr);
+	cairo_destroy(cr);
+	animation->last = *control;
+	if (DISPOSE_PREVIOUS == control->dispose && !animation->composited) {
+		// nothing precedes the first frame
+		animation->last.dispose = DISPOSE_BACKGROUND;
+	}
+	animation->composited = TRUE;
+	return TRUE;
+}
+
+/**
+ * \brief Decode the next frame of an APNG.
+ *
+ * The returned canvas is reused by every frame, it is owned by the
+ * format & is valid until the next call.
+ */
+static cairo_surface_t *
+next_frame(QahiraFormat *self, gint *delay, GCancellable *cancel,
+		GError **error)
+{
+	struct Animation *animation = GET_PRIVATE(self)->animation;
+	if (G_UNLIKELY(!animation)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
+				Q_("png: frames are not open"));
+		return NULL;
+	}
+	if (animation->done) {
+		return NULL;
+	}
+	gboolean frame = animation->pending;
+	if (frame) {
+		animation->control = animation->next;
+		animation->pending = FALSE;
+		if (!begin_frame(animation, error)) {
+			goto error;
+		}
+	}
+	while (TRUE) {
+		guint32 length;
+		guchar type[4];
+		if (animation->lookahead) {
+			length = animation->length;
+			memcpy(type, "IDAT", 4);
+			animation->lookahead = FALSE;
+		} else if (!read_chunk_header(animation, &length, type,
+					cancel, error)) {
+			goto error;
+		}
+		if (!memcmp(type, "IDAT", 4) || !memcmp(type, "fdAT", 4)) {
+			if (!frame) {
+				// the default image is not a frame
+				if (!skip_bytes(animation->stream, length + 4,
+							cancel, error)) {
+					goto error;
+				}
+			} else if (!read_image_data(self, animation, type,
+						length, cancel, error)) {
+				goto error;
+			}
+		} else if (!memcmp(type, "fcTL", 4)) {
+			if (!read_control(self, animation, length,
+						&animation->next, cancel,
+						error)) {
+				goto error;
+			}
+			if (frame) {
+				animation->pending = TRUE;
+				break;
+			}
+			frame = TRUE;
+			animation->control = animation->next;
+			if (!begin_frame(animation, error)) {
+				goto error;
+			}
+		} else if (!memcmp(type, "IEND", 4)) {
+			animation->done = TRUE;
+			break;
+		} else if (!skip_bytes(animation->stream, length + 4, cancel,
+					error)) {
+			goto error;
+		}
+	}
+	if (!frame) {
+		return NULL;
+	}
+	if (!end_frame(animation, error)) {
+		goto error;
+	}
+	GInputStream *input = g_memory_input_stream_new_from_data(
+			animation->png.data, animation->png.length, NULL);
+	cairo_surface_t *surface = load(self, input, cancel, error);
+	g_object_unref(input);
+	if (G_UNLIKELY(!surface)) {
+		goto error;
+	}
+	dispose_frame(animation);
+	gboolean status = composite_frame(self, animation, surface, error);
+	cairo_surface_destroy(surface);
+	if (G_UNLIKELY(!status)) {
+		goto error;
+	}
+	if (delay) {
+		// a zero denominator means 1/100 second
+		guint den = animation->control.delay_den
+			? animation->control.delay_den : 100;
+		*delay = animation->control.delay_num * 1000 / den;
+	}
+	cairo_surface_flush(animation->canvas);
+	return animation->canvas;
+error:
+	animation->done = TRUE;
+	return NULL;
+}
+#endif // HAVE_ZLIB
+
+static void
+write_data_fn(png_structp png, png_bytep buffer, png_size_t size)
+{
+	struct Private *priv = png_get_io_ptr(png);
+	while (size) {
+		gssize bytes = g_output_stream_write(priv->output, buffer,
+				size, priv->cancel, priv->error);
+		if (-1 == bytes) {
+			png_error(png, NULL);
+		}
+		size -= bytes;
+		buffer += bytes;
+	}
+}
+
+static void
+output_flush_fn(png_structp png)
+{
+	struct Private *priv = png_get_io_ptr(png);
+	gboolean status = g_output_stream_flush(priv->output, priv->cancel,
+			priv->error);
+	if (!status) {
+		png_error(png, NULL);
+	}
+}
+
+static void
+save_transform_fn(png_structp png, png_row_infop row, png_bytep data)
+{
+	for (gint i = 0; i < row->width; ++i) {
+		gint red, green, blue;
+		gint alpha = data[QAHIRA_A];
+		if (alpha == 0xff) {
+			red = data[QAHIRA_R];
+			green = data[QAHIRA_G];
+			blue = data[QAHIRA_B];
+		} else {
+			red = qahira_unpremultiply(alpha, data[QAHIRA_R]);
+			green = qahira_unpremultiply(alpha, data[QAHIRA_G]);
+			blue = qahira_unpremultiply(alpha, data[QAHIRA_B]);
+		}
+		data[0] = red;
+		data[1] = green;
+		data[2] = blue;
+		data[3] = alpha;
+		data += 4;
+	}
+}
+
+#if HAVE_ZLIB
+/**
+ * \brief Source image parameters shared by the parallel PNG encoder.
+ */
+struct Encode {
+	QahiraFormat *self;
+	const guchar *data;
+	gint width;
+	gint height;
+	gint stride;
+	gint channels; // 3 (RGB) or 4 (RGBA)
+	const guint8 *unpremultiply;
+	guint filters; // PNG_FILTER_* flags
+	gint level;
+	gint strategy; // zlib strategy
+	gint window_bits;
+	gint memory_level;
+};
+
+/**
+ * \brief Rows of an image filtered & compressed by a worker thread.
+ */
+typedef struct Strip_ {
+	GByteArray *data; // raw deflate data ending on a byte boundary
+	gint row; // first source row
+	gint height;
+	gboolean last; // the last strip ends the deflate stream
+	uLong adler; // checksum of the filtered rows
+	gsize size; // size of the filtered rows
+	GError *error;
+} Strip;
+
+static void
+strip_free(Strip *strip)
+{
+	if (strip) {
+		if (strip->data) {
+			g_byte_array_free(strip->data, TRUE);
+		}
+		g_clear_error(&strip->error);
+		g_free(strip);
+	}
+}
+
+/**
+ * \brief Convert a row of cairo pixels to PNG samples.
+ */
+static void
+pack_row(const struct Encode *encode, gint row, guchar *out)
+{
+	const guint32 *in =
+		(const guint32 *)(encode->data + row * encode->stride);
+	if (4 == encode->channels) {
+		for (gint i = 0; i < encode->width; ++i) {
+			guint32 alpha = in[i] >> 24;
+			const guint8 *table =
+				encode->unpremultiply + alpha * 256;
+			out[0] = table[(in[i] >> 16) & 0xff];
+			out[1] = table[(in[i] >> 8) & 0xff];
+			out[2] = table[in[i] & 0xff];
+			out[3] = alpha;
+			out += 4;
+		}
+	} else {
+		for (gint i = 0; i < encode->width; ++i) {
+			out[0] = (in[i] >> 16) & 0xff;
+			out[1] = (in[i] >> 8) & 0xff;
+			out[2] = in[i] & 0xff;
+			out += 3;
+		}
+	}
+}
+
+static inline gint
+paeth(gint a, gint b, gint c)
+{
+	gint p = b - c, q = a - c;
+	gint pa = ABS(p), pb = ABS(q), pc = ABS(p + q);
+	if (pa <= pb && pa <= pc) {
+		return a;
+	}
+	return pb <= pc ? b : c;
+}
+
+/**
+ * \brief Sum the absolute (signed) values of a filtered row.
+ */
+static inline guint
+sum_row(const guchar *row, gsize size)
+{
+	guint sum = 0;
+	for (gsize i = 0; i < size; ++i) {
+		sum += row[i] < 128 ? row[i] : 256 - row[i];
+	}
+	return sum;
+}
+
+/**
+ * \brief Filter a row with each selected PNG filter and keep the best.
+ *
+ * Like libpng the filter with the smallest sum of absolute (signed)
+ * values is selected.
+ *
+ * \param prior The previous row, zero for the first row of the image
+ * \param filters The PNG_FILTER_* flags to try
+ * \param out Five rows of size + 1 bytes
+ *
+ * \return The filter type byte followed by the filtered row
+ */
+static const guchar *
+filter_row(const guchar *row, const guchar *prior, gsize size, gint bpp,
+		guint filters, guchar *out)
+{
+	const guchar *best = NULL;
+	guint best_sum = G_MAXUINT;
+	for (gint type = PNG_FILTER_VALUE_NONE; type < PNG_FILTER_VALUE_LAST;
+			++type) {
+		guint filter = PNG_FILTER_NONE << type;
+		if (!(filters & filter)) {
+			continue;
+		}
+		guchar *filtered = out + type * (size + 1);
+		filtered[0] = type;
+		guchar *f = filtered + 1;
+		switch (type) {
+		case PNG_FILTER_VALUE_SUB:
+			for (gsize i = 0; i < bpp; ++i) {
+				f[i] = row[i];
+			}
+			for (gsize i = bpp; i < size; ++i) {
+				f[i] = row[i] - row[i - bpp];
+			}
+			break;
+		case PNG_FILTER_VALUE_UP:
+			for (gsize i = 0; i < size; ++i) {
+				f[i] = row[i] - prior[i];
+			}
+			break;
+		case PNG_FILTER_VALUE_AVG:
+			for (gsize i = 0; i < bpp; ++i) {
+				f[i] = row[i] - (prior[i] >> 1);
+			}
+			for (gsize i = bpp; i < size; ++i) {
+				f[i] = row[i] - ((row[i - bpp] + prior[i]) >> 1);
+			}
+			break;
+		case PNG_FILTER_VALUE_PAETH:
+			for (gsize i = 0; i < bpp; ++i) {
+				f[i] = row[i] - prior[i];
+			}
+			for (gsize i = bpp; i < size; ++i) {
+				f[i] = row[i] - paeth(row[i - bpp], prior[i],
+						prior[i - bpp]);
+			}
+			break;
+		case PNG_FILTER_VALUE_NONE:
+		default:
+			memcpy(f, row, size);
+			break;
+		}
+		if (filters == filter) {
+			// nothing to compare
+			return filtered;
+		}
+		guint sum = sum_row(f, size);
+		if (sum < best_sum) {
+			best_sum = sum;
+			best = filtered;
+		}
+	}
+	return best;
+}
+
+/**
+ * \brief Compress data into a growing array.
+ */
+static gboolean
+deflate_data(z_streamp stream, GByteArray *data, const guchar *in,
+		gsize size, gint flush)
+{
+	stream->next_in = (Bytef *)in;
+	stream->avail_in = size;
+	do {
+		guint length = data->len;
+		g_byte_array_set_size(data, length + QAHIRA_PNG_BUFFER_SIZE);
+		stream->next_out = data->data + length;
+		stream->avail_out = QAHIRA_PNG_BUFFER_SIZE;
+		gint status = deflate(stream, flush);
+		g_byte_array_set_size(data, data->len - stream->avail_out);
+		if (G_UNLIKELY(Z_STREAM_ERROR == status)) {
+			return FALSE;
+		}
+	} while (!stream->avail_out);
+	return TRUE;
+}
+
+/**
+ * \brief Filter & compress a strip into memory (worker thread).
+ *
+ * The deflate dictionary is primed with the filtered rows that precede the
+ * strip, so matches may reach back into the previous strip as they would
+ * in a serial encode. Strips other than the last end with a sync flush,
+ * leaving the raw deflate data of consecutive strips ready to be joined.
+ */
+static void
+save_strip(gpointer data, gpointer user_data)
+{
+	Strip *strip = data;
+	const struct Encode *encode = user_data;
+	struct Private *priv = GET_PRIVATE(encode->self);
+	gsize size = encode->width * encode->channels;
+	// rows needed to fill the window before the strip
+	gsize window = 1 << encode->window_bits;
+	gint before = MIN(strip->row, (window + size) / (size + 1));
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	gboolean init = FALSE;
+	guchar *dictionary = NULL;
+	guchar *buffer = g_try_malloc(2 * size + 5 * (size + 1));
+	if (G_UNLIKELY(!buffer)) {
+		goto oom;
+	}
+	if (before) {
+		dictionary = g_try_malloc(before * (size + 1));
+		if (G_UNLIKELY(!dictionary)) {
+			goto oom;
+		}
+	}
+	if (G_UNLIKELY(Z_OK != deflateInit2(&stream, encode->level,
+					Z_DEFLATED, -encode->window_bits,
+					encode->memory_level,
+					encode->strategy))) {
+		goto oom;
+	}
+	init = TRUE;
+	guchar *prior = buffer, *row = buffer + size;
+	guchar *filtered = buffer + 2 * size;
+	gint first = strip->row - before;
+	if (first) {
+		pack_row(encode, first - 1, prior);
+	} else {
+		memset(prior, 0, size);
+	}
+	for (gint i = first; i < strip->row; ++i) {
+		pack_row(encode, i, row);
+		memcpy(dictionary + (i - first) * (size + 1),
+				filter_row(row, prior, size,
+					encode->channels, encode->filters,
+					filtered),
+				size + 1);
+		guchar *swap = prior;
+		prior = row;
+		row = swap;
+	}
+	if (before) {
+		gsize length = MIN(before * (size + 1), window);
+		deflateSetDictionary(&stream, dictionary
+				+ before * (size + 1) - length, length);
+	}
+	strip->adler = adler32(0, NULL, 0);
+	for (gint i = strip->row; i < strip->row + strip->height; ++i) {
+		if (priv->cancel && g_cancellable_set_error_if_cancelled(
+					priv->cancel, &strip->error)) {
+			goto exit;
+		}
+		pack_row(encode, i, row);
+		const guchar *out = filter_row(row, prior, size,
+				encode->channels, encode->filters, filtered);
+		strip->adler = adler32(strip->adler, out, size + 1);
+		strip->size += size + 1;
+		if (G_UNLIKELY(!deflate_data(&stream, strip->data, out,
+						size + 1, Z_NO_FLUSH))) {
+			goto failure;
+		}
+		guchar *swap = prior;
+		prior = row;
+		row = swap;
+	}
+	gint flush = strip->last ? Z_FINISH : Z_SYNC_FLUSH;
+	if (G_UNLIKELY(!deflate_data(&stream, strip->data, NULL, 0, flush))) {
+		goto failure;
+	}
+exit:
+	if (init) {
+		deflateEnd(&stream);
+	}
+	g_free(dictionary);
+	g_free(buffer);
+	return;
+oom:
+	g_set_error(&strip->error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
+			Q_("png: out of memory"));
+	goto exit;
+failure:
+	g_set_error(&strip->error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
+			Q_("png: %s"), stream.msg ? stream.msg : "zlib error");
+	goto exit;
+}
+
+/**
+ * \brief Write data to the output stream.
+ */
+static gboolean
+write_data(QahiraFormat *self, const guchar *data, gsize size,
+		GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	while (size) {
+		gssize bytes = g_output_stream_write(priv->output, data,
+				size, priv->cancel, error);
+		if (G_UNLIKELY(-1 == bytes)) {
+			return FALSE;
+		}
+		size -= bytes;
+		data += bytes;
+	}
+	return TRUE;
+}
+
+/**
+ * \brief Write a PNG chunk to the output stream.
+ */
+static gboolean
+write_chunk(QahiraFormat *self, const gchar *type, const guchar *data,
+		gsize size, GError **error)
+{
+	guchar header[8] = {
+		(size >> 24) & 0xff, (size >> 16) & 0xff,
+		(size >> 8) & 0xff, size & 0xff,
+		type[0], type[1], type[2], type[3]
+	};
+	uLong crc = crc32(0, header + 4, 4);
+	if (size) {
+		crc = crc32(crc, data, size);
+	}
+	guchar footer[4] = {
+		(crc >> 24) & 0xff, (crc >> 16) & 0xff,
+		(crc >> 8) & 0xff, crc & 0xff
+	};
+	return write_data(self, header, sizeof(header), error)
+		&& write_data(self, data, size, error)
+		&& write_data(self, footer, sizeof(footer), error);
+}
+
+/**
+ * \brief Write the image data as a single zlib stream of joined strips.
+ *
+ * The zlib header is written before the first strip and the Adler-32 of
+ * the whole image, combined from the checksums of the strips, after the
+ * last. The stream is split into IDAT chunks followed by IEND.
+ */
+static gboolean
+write_strips(const struct Encode *encode, Strip **strips, gint count,
+		GError **error)
+{
+	QahiraFormat *self = encode->self;
+	// compression level flags as written by zlib
+	guint level = encode->strategy >= Z_HUFFMAN_ONLY
+		|| encode->level < 2 ? 0
+		: encode->level < 6 ? 1
+		: encode->level == 6 ? 2
+		: 3;
+	guint header = ((encode->window_bits - 8) << 12 | Z_DEFLATED << 8)
+		| level << 6;
+	header += 31 - header % 31;
+	guchar cmf[2] = { header >> 8, header & 0xff };
+	g_byte_array_prepend(strips[0]->data, cmf, sizeof(cmf));
+	uLong adler = adler32(0, NULL, 0);
+	for (gint i = 0; i < count; ++i) {
+		adler = adler32_combine(adler, strips[i]->adler,
+				strips[i]->size);
+	}
+	guchar trailer[4] = {
+		(adler >> 24) & 0xff, (adler >> 16) & 0xff,
+		(adler >> 8) & 0xff, adler & 0xff
+	};
+	g_byte_array_append(strips[count - 1]->data, trailer,
+			sizeof(trailer));
+	for (gint i = 0; i < count; ++i) {
+		const guchar *data = strips[i]->data->data;
+		gsize size = strips[i]->data->len;
+		while (size) {
+			gsize length = MIN(size, QAHIRA_PNG_IDAT_SIZE);
+			if (!write_chunk(self, "IDAT", data, length, error)) {
+				return FALSE;
+			}
+			data += length;
+			size -= length;
+		}
+	}
+	return write_chunk(self, "IEND", NULL, 0, error);
+}
+
+/**
+ * \brief Filter & compress strips of rows concurrently.
+ *
+ * Must be called after the header chunks have been written. On success
+ * the remaining chunks have been written as well.
+ *
+ * \param done [out] FALSE if the image should be compressed serially
+ */
+static gboolean
+save_parallel(const struct Encode *encode, gboolean *done, GError **error)
+{
+	*done = FALSE;
+	if ((gsize)encode->width * encode->height
+			< QAHIRA_PNG_PARALLEL_SIZE) {
+		return TRUE;
+	}
+	gint count = MIN(encode->height, QAHIRA_PNG_STRIPS_PER_THREAD
+			* qahira_format_get_thread_count(encode->self));
+	if (2 > count) {
+		return TRUE;
+	}
+	gint step = (encode->height + count - 1) / count;
+	count = (encode->height + step - 1) / step;
+	*done = TRUE;
+	gboolean status = TRUE;
+	Strip **strips = g_try_new0(Strip *, count);
+	if (G_UNLIKELY(!strips)) {
+		goto oom;
+	}
+	for (gint i = 0; i < count; ++i) {
+		Strip *strip = strips[i] = g_try_new0(Strip, 1);
+		if (G_UNLIKELY(!strip)) {
+			goto oom;
+		}
+		strip->data = g_byte_array_new();
+		strip->row = i * step;
+		strip->height = MIN(encode->height - strip->row, step);
+		strip->last = i + 1 == count;
+	}
+	qahira_format_run(encode->self, save_strip, (gpointer *)strips,
+			count, (gpointer)encode);
+	for (gint i = 0; i < count; ++i) {
+		if (strips[i]->error) {
+			g_propagate_error(error, strips[i]->error);
+			strips[i]->error = NULL;
+			status = FALSE;
+			goto exit;
+		}
+	}
+	status = write_strips(encode, strips, count, error);
+exit:
+	if (strips) {
+		for (gint i = 0; i < count; ++i) {
+			strip_free(strips[i]);
+		}
+		g_free(strips);
+	}
+	return status;
+oom:
+	g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
+			Q_("png: out of memory"));
+	status = FALSE;
+	goto exit;
+}
+
+/**
+ * \brief Get the zlib strategy for the selected filters.
+ */
+static gint
+get_strategy(QahiraFormat *self)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	switch (priv->strategy) {
+	case QAHIRA_FORMAT_PNG_STRATEGY_DEFAULT:
+		return Z_DEFAULT_STRATEGY;
+	case QAHIRA_FORMAT_PNG_STRATEGY_FILTERED:
+		return Z_FILTERED;
+	case QAHIRA_FORMAT_PNG_STRATEGY_HUFFMAN_ONLY:
+		return Z_HUFFMAN_ONLY;
+	case QAHIRA_FORMAT_PNG_STRATEGY_RLE:
+		return Z_RLE;
+	case QAHIRA_FORMAT_PNG_STRATEGY_FIXED:
+		return Z_FIXED;
+	case QAHIRA_FORMAT_PNG_STRATEGY_AUTO:
+	default:
+		// as chosen by libpng
+		return QAHIRA_FORMAT_PNG_FILTER_NONE == priv->filters
+			? Z_DEFAULT_STRATEGY
+			: Z_FILTERED;
+	}
+}
+#endif // HAVE_ZLIB
+
+/**
+ * \brief A color of the image & the number of pixels using it.
+ */
+struct Color {
+	guint32 value; // unpremultiplied RGBA, red in the high byte
+	guint count;
+};
+
+/**
+ * \brief A range of colors split by the median cut quantizer.
+ */
+struct Box {
+	gint start;
+	gint end;
+	gint channel; // widest channel
+	gint range; // extent of the widest channel
+};
+
+/**
+ * \brief The palette chosen for an image.
+ */
+struct Palette {
+	png_color colors[256];
+	png_byte trans[256];
+	guint32 values[256]; // unpremultiplied RGBA
+	gint size;
+	gint translucent; // leading entries with alpha
+};
+
+static inline gint
+get_channel(guint32 value, gint channel)
+{
+	return (value >> (24 - 8 * channel)) & 0xff;
+}
+
+/**
+ * \brief Unpremultiply a cairo pixel, fully transparent pixels are zero.
+ */
+static inline guint32
+get_color(const guint32 *row, gint x, gboolean alpha, const guint8 *table)
+{
+	if (!alpha) {
+		return row[x] << 8 | 0xff;
+	}
+	guint32 value = row[x] >> 24;
+	if (!value) {
+		return 0;
+	}
+	table += value * 256;
+	return (guint32)table[(row[x] >> 16) & 0xff] << 24
+		| table[(row[x] >> 8) & 0xff] << 16
+		| table[row[x] & 0xff] << 8
+		| value;
+}
+
+static gint
+compare_value(gconstpointer a, gconstpointer b, gpointer data)
+{
+	guint32 x = *(const guint32 *)a, y = *(const guint32 *)b;
+	return (x > y) - (x < y);
+}
+
+static gint
+compare_channel(gconstpointer a, gconstpointer b, gpointer data)
+{
+	gint channel = GPOINTER_TO_INT(data);
+	gint x = get_channel(((const struct Color *)a)->value, channel);
+	gint y = get_channel(((const struct Color *)b)->value, channel);
+	if (x == y) {
+		return compare_value(a, b, NULL);
+	}
+	return x - y;
+}
+
+/**
+ * \brief Find the widest channel of a box.
+ */
+static void
+box_shrink(struct Box *box, const struct Color *colors)
+{
+	gint min[4] = { 255, 255, 255, 255 }, max[4] = { 0, 0, 0, 0 };
+	for (gint i = box->start; i < box->end; ++i) {
+		for (gint j = 0; j < 4; ++j) {
+			gint value = get_channel(colors[i].value, j);
+			min[j] = MIN(min[j], value);
+			max[j] = MAX(max[j], value);
+		}
+	}
+	box->channel = 0;
+	box->range = -1;
+	for (gint j = 0; j < 4; ++j) {
+		if (max[j] - min[j] > box->range) {
+			box->channel = j;
+			box->range = max[j] - min[j];
+		}
+	}
+}
+
+/**
+ * \brief Choose a palette with median cut.
+ *
+ * Boxes of colors are split at the median pixel along their widest
+ * channel until there are enough boxes, each box is then replaced by its
+ * average color. Fully transparent pixels get an entry of their own, and
+ * images with few enough colors are reproduced exactly.
+ */
+static gboolean
+median_cut(struct Palette *palette, const guchar *data, gint width,
+		gint height, gint stride, gboolean alpha, gint size,
+		GError **error)
+{
+	gboolean status = TRUE;
+	const guint8 *table = qahira_unpremultiply_table();
+	struct Color *colors = NULL;
+	gsize count = (gsize)width * height;
+	guint32 *pixels = g_try_new(guint32, count);
+	if (G_UNLIKELY(!pixels)) {
+		goto error;
+	}
+	for (gint i = 0; i < height; ++i) {
+		const guint32 *row = (const guint32 *)(data + i * stride);
+		for (gint j = 0; j < width; ++j) {
+			pixels[i * width + j] = get_color(row, j, alpha, table);
+		}
+	}
+	g_qsort_with_data(pixels, count, sizeof(guint32), compare_value,
+			NULL);
+	gint unique = 0;
+	for (gsize i = 0; i < count; ++i) {
+		if (pixels[i] && (!i || pixels[i] != pixels[i - 1])) {
+			++unique;
+		}
+	}
+	colors = g_try_new(struct Color, MAX(unique, 1));
+	if (G_UNLIKELY(!colors)) {
+		goto error;
+	}
+	unique = 0;
+	for (gsize i = 0; i < count; ++i) {
+		if (!pixels[i]) {
+			continue;
+		}
+		if (unique && pixels[i] == colors[unique - 1].value) {
+			++colors[unique - 1].count;
+		} else {
+			colors[unique].value = pixels[i];
+			colors[unique++].count = 1;
+		}
+	}
+	// transparent pixels sort first
+	gboolean transparent = !pixels[0];
+	g_free(pixels);
+	pixels = NULL;
+	struct Box boxes[256];
+	gint n = 0;
+	if (unique) {
+		boxes[0].start = 0;
+		boxes[0].end = unique;
+		box_shrink(&boxes[0], colors);
+		n = 1;
+	}
+	while (n < size - (transparent ? 1 : 0)) {
+		gint best = -1;
+		for (gint i = 0; i < n; ++i) {
+			if (1 < boxes[i].end - boxes[i].start
+					&& (0 > best || boxes[i].range
+						> boxes[best].range)) {
+				best = i;
+			}
+		}
+		if (0 > best) {
+			// every color has an entry
+			break;
+		}
+		struct Box *box = &boxes[best];
+		g_qsort_with_data(colors + box->start, box->end - box->start,
+				sizeof(struct Color), compare_channel,
+				GINT_TO_POINTER(box->channel));
+		guint64 total = 0, sum = 0;
+		for (gint i = box->start; i < box->end; ++i) {
+			total += colors[i].count;
+		}
+		gint split = box->end - 1;
+		for (gint i = box->start; i < box->end - 1; ++i) {
+			sum += colors[i].count;
+			if (2 * sum >= total) {
+				split = i + 1;
+				break;
+			}
+		}
+		boxes[n].start = split;
+		boxes[n].end = box->end;
+		box->end = split;
+		box_shrink(box, colors);
+		box_shrink(&boxes[n++], colors);
+	}
+	guint32 values[256];
+	gint entries = 0;
+	if (transparent) {
+		values[entries++] = 0;
+	}
+	for (gint i = 0; i < n; ++i) {
+		guint64 total = 0, sum[4] = { 0, 0, 0, 0 };
+		for (gint j = boxes[i].start; j < boxes[i].end; ++j) {
+			total += colors[j].count;
+			for (gint k = 0; k < 4; ++k) {
+				sum[k] += (guint64)colors[j].count
+					* get_channel(colors[j].value, k);
+			}
+		}
+		guint32 value = 0;
+		for (gint k = 0; k < 4; ++k) {
+			value = value << 8 | (sum[k] + total / 2) / total;
+		}
+		values[entries++] = value;
+	}
+	// translucent entries first, tRNS covers only those
+	palette->size = 0;
+	for (gint pass = 0; pass < 2; ++pass) {
+		for (gint i = 0; i < entries; ++i) {
+			gboolean opaque = 0xff == (values[i] & 0xff);
+			if (opaque != pass) {
+				continue;
+			}
+			png_color *color = &palette->colors[palette->size];
+			color->red = get_channel(values[i], 0);
+			color->green = get_channel(values[i], 1);
+			color->blue = get_channel(values[i], 2);
+			palette->trans[palette->size] = values[i] & 0xff;
+			palette->values[palette->size++] = values[i];
+		}
+		if (!pass) {
+			palette->translucent = palette->size;
+		}
+	}
+exit:
+	g_free(pixels);
+	g_free(colors);
+	return status;
+error:
+	g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
+			Q_("png: out of memory"));
+	status = FALSE;
+	goto exit;
+}
+
+/**
+ * \brief Cached palette lookups.
+ */
+struct Nearest {
+	guint32 value;
+	gint index;
+};
+
+// entries in the palette lookup cache
+#define QAHIRA_PNG_NEAREST_SIZE (4096)
+
+/**
+ * \brief Find the closest palette entry to an unpremultiplied color.
+ */
+static gint
+nearest(const struct Palette *palette, struct Nearest *cache, guint32 value)
+{
+	struct Nearest *entry =
+		cache + ((value * 2654435761u) >> 20) % QAHIRA_PNG_NEAREST_SIZE;
+	if (0 <= entry->index && entry->value == value) {
+		return entry->index;
+	}
+	gint index = 0, best = G_MAXINT;
+	for (gint i = 0; i < palette->size; ++i) {
+		gint distance = 0;
+		for (gint j = 0; j < 4; ++j) {
+			gint delta = get_channel(value, j)
+				- get_channel(palette->values[i], j);
+			distance += delta * delta;
+		}
+		if (distance < best) {
+			best = distance;
+			index = i;
+		}
+	}
+	entry->value = value;
+	entry->index = index;
+	return index;
+}
+
+/**
+ * \brief Reduce an image to at most \e size colors.
+ *
+ * If \e dither is TRUE quantization errors are diffused to the
+ * neighboring pixels (Floyd-Steinberg).
+ *
+ * \return Palette indices (one byte per pixel) or NULL on error.
+ */
+static guchar *
+quantize(struct Palette *palette, const guchar *data, gint width,
+		gint height, gint stride, gboolean alpha, gint size,
+		gboolean dither, GError **error)
+{
+	guchar *indices = NULL;
+	gint *errors = NULL;
+	const guint8 *table = qahira_unpremultiply_table();
+	if (!median_cut(palette, data, width, height, stride, alpha, size,
+				error)) {
+		return NULL;
+	}
+	struct Nearest *cache = g_try_new(struct Nearest,
+			QAHIRA_PNG_NEAREST_SIZE);
+	if (G_UNLIKELY(!cache)) {
+		goto error;
+	}
+	for (gint i = 0; i < QAHIRA_PNG_NEAREST_SIZE; ++i) {
+		cache[i].index = -1;
+	}
+	indices = g_try_malloc((gsize)width * height);
+	if (G_UNLIKELY(!indices)) {
+		goto error;
+	}
+	// current & next row of errors (16ths), padded by a pixel
+	gint length = 4 * (width + 2);
+	if (dither) {
+		errors = g_try_new0(gint, 2 * length);
+		if (G_UNLIKELY(!errors)) {
+			goto error;
+		}
+	}
+	for (gint i = 0; i < height; ++i) {
+		const guint32 *row = (const guint32 *)(data + i * stride);
+		guchar *out = indices + i * width;
+		if (!dither) {
+			for (gint j = 0; j < width; ++j) {
+				out[j] = nearest(palette, cache,
+						get_color(row, j, alpha, table));
+			}
+			continue;
+		}
+		gint *current = errors + (i % 2) * length + 4;
+		gint *next = errors + ((i + 1) % 2) * length + 4;
+		memset(next - 4, 0, length * sizeof(gint));
+		for (gint j = 0; j < width; ++j) {
+			guint32 color = get_color(row, j, alpha, table);
+			if (!color) {
+				// leave transparent areas clean
+				out[j] = nearest(palette, cache, 0);
+				continue;
+			}
+			gint channels[4];
+			guint32 value = 0;
+			for (gint k = 0; k < 4; ++k) {
+				channels[k] = CLAMP(get_channel(color, k)
+					+ current[4 * j + k] / 16, 0, 255);
+				value = value << 8 | channels[k];
+			}
+			out[j] = nearest(palette, cache, value);
+			for (gint k = 0; k < 4; ++k) {
+				gint delta = channels[k] - get_channel(
+						palette->values[out[j]], k);
+				current[4 * (j + 1) + k] += 7 * delta;
+				next[4 * (j - 1) + k] += 3 * delta;
+				next[4 * j + k] += 5 * delta;
+				next[4 * (j + 1) + k] += delta;
+			}
+		}
+	}
+exit:
+	g_free(errors);
+	g_free(cache);
+	return indices;
+error:
+	g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
+			Q_("png: out of memory"));
+	g_free(indices);
+	indices = NULL;
+	goto exit;
+}
+
+static gboolean
+save(QahiraFormat *self, cairo_surface_t *surface, GOutputStream *stream,
+		GCancellable *cancel, GError **error)
+{
+	struct Private *priv = GET_PRIVATE(self);
+	priv->input = g_object_ref(stream);
+	gboolean status = TRUE;
+	png_structp png = NULL;
+	png_infop info = NULL;
+	png_byte **rows = NULL;
+	guchar *indices = NULL;
+	struct Palette palette;
+	gint width, height;
+	qahira_surface_size(surface, &width, &height);
+	if (!width || !height) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
+				Q_("png: invalid dimensions [%d x %d]"),
+				width, height);
+		goto error;
+	}
+#ifdef PNG_USER_MEM_SUPPORTED
+	png = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, priv,
+			error_fn, warn_fn, NULL, malloc_fn, free_fn);
+#else // PNG_USER_MEM_SUPPORTED
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, priv,
+			error_fn, warn_fn);
+#endif // PNG_USER_MEM_SUPPORTED
+	if (G_UNLIKELY(!png)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
+				Q_("png: out of memory"));
+		goto error;
+	}
+	info = png_create_info_struct(png);
+	if (G_UNLIKELY(!info)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
+				Q_("png: out of memory"));
+		goto error;
+	}
+	png_set_write_fn(png, priv, write_data_fn, output_flush_fn);
+	priv->output = g_object_ref(stream);
+	if (cancel) {
+		priv->cancel = g_object_ref(cancel);
+	}
+	priv->error = error;
+#ifdef PNG_SETJMP_SUPPORTED
+	if (setjmp(png_jmpbuf(png))) {
+		goto error;
+	}
+#endif // PNG_SETJMP_SUPPORTED
+	guchar *data = qahira_format_surface_get_data(self, surface);
+	if (G_UNLIKELY(!data)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
+				Q_("png: surface data is NULL"));
+		goto error;
+	}
+	gint stride = qahira_format_surface_get_stride(self, surface);
+	if (G_UNLIKELY(0 > stride)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_FAILURE,
+				Q_("png: invalid stride"));
+	}
+	rows = g_try_new(guchar *, height);
+	if (G_UNLIKELY(!rows)) {
+		g_set_error(error, QAHIRA_ERROR, QAHIRA_ERROR_NO_MEMORY,
+				Q_("png: out of memory"));
+		goto error;
+	}
+	for (gint i = 0; i < height; ++i) {
+		rows[i] = data + i * stride;
+	}
+	gint depth, color;
+	cairo_content_t content = cairo_surface_get_content(surface);
+	if (CAIRO_CONTENT_COLOR_ALPHA == content
+			&& qahira_format_surface_is_opaque(self, surface)) {
+		// write opaque images without alpha
+		content = CAIRO_CONTENT_COLOR;
+	}
+	switch (content) {
+	case CAIRO_CONTENT_COLOR:
+		depth = 8;
+		color = PNG_COLOR_TYPE_RGB;
+		break;
+	case CAIRO_CONTENT_COLOR_ALPHA:
+		depth = 8;
+		color = PNG_COLOR_TYPE_RGB_ALPHA;
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+		png_set_packswap(png);
+#endif // G_BYTE_ORDER
+		break;
+	case CAIRO_CONTENT_ALPHA:
+		depth = 1;
+		color = PNG_COLOR_TYPE_GRAY;
+		break;
+	default:
+		g_assert_not_reached();
+	}
+	if (priv->colors && CAIRO_CONTENT_ALPHA != content) {
+		// lossy, reduce to an 8-bit palette
+		indices = quantize(&palette, data, width, height, stride,
+				CAIRO_CONTENT_COLOR_ALPHA == content,
+				priv->colors, priv->dither, error);
+		if (G_UNLIKELY(!indices)) {
+			goto error;
+		}
+		for (gint i = 0; i < height; ++i) {
+			rows[i] = indices + i * width;
+		}
+		depth = 8;
+		color = PNG_COLOR_TYPE_PALETTE;
+	}
+	png_set_compression_level(png, priv->compression);
+	png_set_compression_window_bits(png, priv->window_bits);
+	png_set_compression_mem_level(png, priv->memory_level);
+#if HAVE_ZLIB
+	png_set_compression_strategy(png, get_strategy(self));
+#endif // HAVE_ZLIB
+	if (PNG_COLOR_TYPE_RGB == color || PNG_COLOR_TYPE_RGB_ALPHA == color) {
+		// palette images & alpha masks keep the libpng default
+		png_set_filter(png, PNG_FILTER_TYPE_BASE, priv->filters << 3);
+	}
+	png_set_IHDR(png, info, width, height, depth, color,
+			priv->interlace
+				? PNG_INTERLACE_ADAM7
+				: PNG_INTERLACE_NONE,
+			PNG_COMPRESSION_TYPE_DEFAULT,
+			PNG_FILTER_TYPE_DEFAULT);
+	if (indices) {
+		png_set_PLTE(png, info, palette.colors, palette.size);
+		if (palette.translucent) {
+			png_set_tRNS(png, info, palette.trans,
+					palette.translucent, NULL);
+		}
+	}
+	png_write_info(png, info);
+#if HAVE_ZLIB
+	// Adam7 passes are compressed serially
+	if (1 < qahira_format_get_thread_count(self) && !priv->interlace
+			&& CAIRO_CONTENT_ALPHA != content && !indices) {
+		struct Encode encode = {
+			.self = self,
+			.data = data,
+			.width = width,
+			.height = height,
+			.stride = stride,
+			.channels = PNG_COLOR_TYPE_RGB == color ? 3 : 4,
+			.unpremultiply = qahira_unpremultiply_table(),
+			.filters = priv->filters << 3,
+			.level = priv->compression,
+			.strategy = get_strategy(self),
+			.window_bits = priv->window_bits,
+			.memory_level = priv->memory_level
+		};
+		gboolean done;
+		if (!save_parallel(&encode, &done, error)) {
+			goto error;
+		}
+		if (done) {
+			goto exit;
+		}
+	}
+#endif // HAVE_ZLIB
+	if (PNG_COLOR_TYPE_RGB == color) {
+		// opaque pixels need no unpremultiply, only the byte order
+		// of the native endian xRGB words is changed
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+		png_set_filler(png, 0, PNG_FILLER_AFTER);
+		png_set_bgr(png);
+#else // G_BYTE_ORDER
+		png_set_filler(png, 0, PNG_FILLER_BEFORE);
+#endif // G_BYTE_ORDER
+	} else if (PNG_COLOR_TYPE_PALETTE != color) {
+		png_set_write_user_transform_fn(png, save_transform_fn);
+	}
+	png_write_image(png, rows);
+	png_write_end(png, info);
+exit:
+	g_free(indices);
+	g_free(rows);
+	if (png) {
+		png_destroy_write_struct(&png, &info);
+	}
+	if (priv->output) {
+		g_object_unref(priv->output);
+		priv->output = NULL;
+	}
+	if (priv->cancel) {
+		g_object_unref(priv->cancel);
+		priv->cancel = NULL;
+	}
+	return status;
+error:
+	status = FALSE;
+	goto exit;
+}
+
+static void
+finalize(GObject *base)
+{
+#if HAVE_ZLIB
+	close_frames(QAHIRA_FORMAT(base));
+#endif // HAVE_ZLIB
+	G_OBJECT_CLASS(qahira_format_png_parent_class)->finalize(base);
+}
+
+static void
+qahira_format_png_class_init(QahiraFormatPngClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS(klass);
+	object_class->finalize = finalize;
+	QahiraFormatClass *format_class = QAHIRA_FORMAT_CLASS(klass);
+	format_class->load = load;
+	format_class->save = save;
+#if HAVE_ZLIB
+	format_class->open_frames = open_frames;
+	format_class->next_frame = next_frame;
+	format_class->close_frames = close_frames;
+#endif // HAVE_ZLIB
+	g_type_class_add_private(klass, sizeof(struct Private));
+	// QahiraFormatPng::progressive
+	signals[SIGNAL_PROGRESSIVE] =
+		g_signal_new(g_intern_static_string("progressive"),
+			G_OBJECT_CLASS_TYPE(klass), G_SIGNAL_RUN_FIRST,
+			G_STRUCT_OFFSET(QahiraFormatPngClass, progressive),
+			NULL, NULL, qahira_marshal_VOID__POINTER,
+			G_TYPE_NONE, 1, G_TYPE_POINTER);
+}
+
+QahiraFormat *
+qahira_format_png_new(void)
+{
+	return g_object_new(QAHIRA_TYPE_FORMAT_PNG,
+			"mime-type", "image/png",
+			NULL);
+}
+
+void
+qahira_format_png_set_compression(QahiraFormat *self, gint compression)
+{
 	g_return_if_fail(QAHIRA_IS_FORMAT_PNG(self));
 	GET_PRIVATE(self)->compression = CLAMP(compression, 0, 9);
 }
@@ -492,3 +2558,156 @@ qahira_format_get_interlace(QahiraFormat *self)
 	g_return_val_if_fail(QAHIRA_IS_FORMAT_PNG(self), FALSE);
 	return GET_PRIVATE(self)->interlace;
 }
+
+void
+qahira_format_png_set_filters(QahiraFormat *self,
+		QahiraFormatPngFilter filters)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_PNG(self));
+	filters &= QAHIRA_FORMAT_PNG_FILTER_ALL;
+	GET_PRIVATE(self)->filters = filters
+		? filters
+		: QAHIRA_FORMAT_PNG_FILTER_NONE;
+}
+
+QahiraFormatPngFilter
+qahira_format_png_get_filters(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_PNG(self),
+			QAHIRA_FORMAT_PNG_FILTER_ALL);
+	return GET_PRIVATE(self)->filters;
+}
+
+void
+qahira_format_png_set_strategy(QahiraFormat *self,
+		QahiraFormatPngStrategy strategy)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_PNG(self));
+	GET_PRIVATE(self)->strategy = strategy;
+}
+
+QahiraFormatPngStrategy
+qahira_format_png_get_strategy(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_PNG(self),
+			QAHIRA_FORMAT_PNG_STRATEGY_AUTO);
+	return GET_PRIVATE(self)->strategy;
+}
+
+void
+qahira_format_png_set_window_bits(QahiraFormat *self, gint window_bits)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_PNG(self));
+	// zlib does not support an 8-bit window for raw deflate
+	GET_PRIVATE(self)->window_bits = CLAMP(window_bits, 9, 15);
+}
+
+gint
+qahira_format_png_get_window_bits(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_PNG(self), 15);
+	return GET_PRIVATE(self)->window_bits;
+}
+
+void
+qahira_format_png_set_memory_level(QahiraFormat *self, gint memory_level)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_PNG(self));
+	GET_PRIVATE(self)->memory_level = CLAMP(memory_level, 1, 9);
+}
+
+gint
+qahira_format_png_get_memory_level(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_PNG(self), 8);
+	return GET_PRIVATE(self)->memory_level;
+}
+
+void
+qahira_format_png_set_preset(QahiraFormat *self,
+		QahiraFormatPngPreset preset)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_PNG(self));
+	struct Private *priv = GET_PRIVATE(self);
+	switch (preset) {
+	case QAHIRA_FORMAT_PNG_PRESET_FAST:
+		// run-length coding of unfiltered rows suits flat images
+		priv->compression = 1;
+		priv->filters = QAHIRA_FORMAT_PNG_FILTER_NONE;
+		priv->strategy = QAHIRA_FORMAT_PNG_STRATEGY_RLE;
+		priv->window_bits = 15;
+		priv->memory_level = 8;
+		break;
+	case QAHIRA_FORMAT_PNG_PRESET_SMALL:
+		priv->compression = 9;
+		priv->filters = QAHIRA_FORMAT_PNG_FILTER_ALL;
+		priv->strategy = QAHIRA_FORMAT_PNG_STRATEGY_FILTERED;
+		priv->window_bits = 15;
+		priv->memory_level = 9;
+		break;
+	case QAHIRA_FORMAT_PNG_PRESET_DEFAULT:
+	default:
+		priv->compression = 6;
+		priv->filters = QAHIRA_FORMAT_PNG_FILTER_ALL;
+		priv->strategy = QAHIRA_FORMAT_PNG_STRATEGY_AUTO;
+		priv->window_bits = 15;
+		priv->memory_level = 8;
+		break;
+	}
+}
+
+void
+qahira_format_png_set_colors(QahiraFormat *self, gint colors)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_PNG(self));
+	// zero keeps true color
+	GET_PRIVATE(self)->colors = colors ? CLAMP(colors, 2, 256) : 0;
+}
+
+gint
+qahira_format_png_get_colors(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_PNG(self), 0);
+	return GET_PRIVATE(self)->colors;
+}
+
+void
+qahira_format_png_set_dither(QahiraFormat *self, gboolean dither)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_PNG(self));
+	GET_PRIVATE(self)->dither = dither ? TRUE : FALSE;
+}
+
+gboolean
+qahira_format_png_get_dither(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_PNG(self), FALSE);
+	return GET_PRIVATE(self)->dither;
+}
+
+void
+qahira_format_png_set_backend(QahiraFormat *self,
+		QahiraFormatPngBackend backend)
+{
+	g_return_if_fail(QAHIRA_IS_FORMAT_PNG(self));
+	switch (backend) {
+	case QAHIRA_FORMAT_PNG_BACKEND_LIBPNG:
+#if QAHIRA_HAS_SPNG
+	case QAHIRA_FORMAT_PNG_BACKEND_SPNG:
+#endif // QAHIRA_HAS_SPNG
+		break;
+	case QAHIRA_FORMAT_PNG_BACKEND_DEFAULT:
+	default:
+		// unavailable backends select the default
+		backend = QAHIRA_PNG_BACKEND;
+		break;
+	}
+	GET_PRIVATE(self)->backend = backend;
+}
+
+QahiraFormatPngBackend
+qahira_format_png_get_backend(QahiraFormat *self)
+{
+	g_return_val_if_fail(QAHIRA_IS_FORMAT_PNG(self), QAHIRA_PNG_BACKEND);
+	return GET_PRIVATE(self)->backend;
+}
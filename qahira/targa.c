@@ -315,7 +315,7 @@ convert_8(const guchar *in, guchar *out)
 	out[QAHIRA_B] = in[0];
 }
 
-static inline void
+static inline guchar
 convert_15(const guchar *in, guchar *out, gboolean alpha)
 {
 	gshort pixel = (in[0] << 8) | in[1];
@@ -332,7 +332,9 @@ convert_15(const guchar *in, guchar *out, gboolean alpha)
 			out[QAHIRA_B] = qahira_premultiply(out[QAHIRA_A],
 					out[QAHIRA_B]);
 		}
+		return out[QAHIRA_A];
 	}
+	return 0xff;
 }
 
 static inline void
@@ -352,7 +354,7 @@ convert_24(const guchar *in, guchar *out)
 	out[QAHIRA_B] = in[0];
 }
 
-static inline void
+static inline guchar
 convert_32(const guchar *in, guchar *out)
 {
 	out[QAHIRA_A] = in[3];
@@ -365,12 +367,19 @@ convert_32(const guchar *in, guchar *out)
 		out[QAHIRA_G] = qahira_premultiply(in[3], in[1]);
 		out[QAHIRA_B] = qahira_premultiply(in[3], in[0]);
 	}
+	return in[3];
 }
 
-static inline void
+/**
+ * \brief Convert a row of pixels.
+ *
+ * \return The bitwise AND of the alpha values
+ */
+static inline guchar
 convert_rgb(QahiraFormat *self, const guchar *in, guchar *out)
 {
 	struct Private *priv = GET_PRIVATE(self);
+	guchar alpha = 0xff;
 	for (gint i = 0; i < priv->header.width; ++i) {
 		switch (priv->header.depth) {
 		case 8:
@@ -378,7 +387,7 @@ convert_rgb(QahiraFormat *self, const guchar *in, guchar *out)
 			in += 1;
 			break;
 		case 15:
-			convert_15(in, out, priv->header.alpha);
+			alpha &= convert_15(in, out, priv->header.alpha);
 			in += 2;
 			break;
 		case 16:
@@ -390,7 +399,7 @@ convert_rgb(QahiraFormat *self, const guchar *in, guchar *out)
 			in += 3;
 			break;
 		case 32:
-			convert_32(in, out);
+			alpha &= convert_32(in, out);
 			in += 4;
 			break;
 		default:
@@ -398,6 +407,7 @@ convert_rgb(QahiraFormat *self, const guchar *in, guchar *out)
 		}
 		out += 4;
 	}
+	return alpha;
 }
 
 static cairo_surface_t *
@@ -453,6 +463,7 @@ read_scanlines(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
 		goto error;
 	}
 	cairo_surface_flush(surface);
+	guchar alpha = 0xff;
 	if (priv->header.img_t > 8 && priv->header.img_t < 12) {
 		for (gint i = 0; i < priv->header.height; ++i) {
 			status = tga_read_rle(self, stream, cancel, data,
@@ -460,7 +471,7 @@ read_scanlines(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
 			if (G_UNLIKELY(!status)) {
 				goto error;
 			}
-			convert_rgb(self, priv->buffer, data);
+			alpha &= convert_rgb(self, priv->buffer, data);
 			data += cairo_stride;
 		}
 	} else {
@@ -470,7 +481,7 @@ read_scanlines(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
 			if (G_UNLIKELY(!status)) {
 				goto error;
 			}
-			convert_rgb(self, priv->buffer, data);
+			alpha &= convert_rgb(self, priv->buffer, data);
 			data += cairo_stride;
 		}
 	}
@@ -478,6 +489,9 @@ read_scanlines(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
 		goto error;
 	}
 	cairo_surface_mark_dirty(surface);
+	if (CAIRO_FORMAT_ARGB32 == format && 0xff == alpha) {
+		surface = qahira_format_surface_make_opaque(self, surface);
+	}
 exit:
 	return surface;
 error:
@@ -499,7 +513,8 @@ load(QahiraFormat *self, GInputStream *stream, GCancellable *cancel,
 	}
 	g_free(priv->id);
 	priv->id = NULL;
-	if (priv->header.id_len) {
+	// the image ID is informational only, trusted loads skip over it
+	if (priv->header.id_len && !qahira_format_get_trusted(self)) {
 		if (!read_format_id(self, stream, cancel, error)) {
 			goto exit;
 		}
@@ -688,6 +703,11 @@ save(QahiraFormat *self, cairo_surface_t *surface, GOutputStream *stream,
 	priv->header.width = width;
 	priv->header.height = height;
 	cairo_content_t content = cairo_surface_get_content(surface);
+	if (CAIRO_CONTENT_COLOR_ALPHA == content
+			&& qahira_format_surface_is_opaque(self, surface)) {
+		// write opaque images without alpha
+		content = CAIRO_CONTENT_COLOR;
+	}
 	switch (content) {
 	case CAIRO_CONTENT_COLOR:
 		priv->header.img_t = 2;
@@ -19,7 +19,9 @@
 #include "config.h"
 #endif
 #include <glib.h>
+#include <string.h>
 #include "qahira/qahira.h"
+#include "qahira/utility.h"
 
 #define CLASS "/qahira/format"
 
@@ -55,6 +57,50 @@ open_input(const gchar *filename)
 	return stream;
 }
 
+static void
+assert_surface_equal(cairo_surface_t *a, cairo_surface_t *b)
+{
+	gint width = cairo_image_surface_get_width(a);
+	gint height = cairo_image_surface_get_height(a);
+	g_assert_cmpint(width, ==, cairo_image_surface_get_width(b));
+	g_assert_cmpint(height, ==, cairo_image_surface_get_height(b));
+	g_assert_cmpint(cairo_image_surface_get_format(a), ==,
+			cairo_image_surface_get_format(b));
+	const guchar *p = cairo_image_surface_get_data(a);
+	const guchar *q = cairo_image_surface_get_data(b);
+	gint stride_a = cairo_image_surface_get_stride(a);
+	gint stride_b = cairo_image_surface_get_stride(b);
+	for (gint y = 0; y < height; ++y) {
+		g_assert(!memcmp(p + y * stride_a, q + y * stride_b,
+					width * 4));
+	}
+}
+
+static cairo_surface_t *
+reload(QahiraFormat *format, cairo_surface_t *surface)
+{
+	GOutputStream *output = g_memory_output_stream_new(NULL, 0,
+			g_realloc, g_free);
+	g_assert(output);
+	GError *error = NULL;
+	gboolean status = qahira_format_save(format, surface, output, NULL,
+			&error);
+	g_assert(status);
+	status = g_output_stream_close(output, NULL, &error);
+	g_assert(status);
+	GMemoryOutputStream *memory = G_MEMORY_OUTPUT_STREAM(output);
+	GInputStream *input = g_memory_input_stream_new_from_data(
+			g_memory_output_stream_get_data(memory),
+			g_memory_output_stream_get_data_size(memory), NULL);
+	g_assert(input);
+	cairo_surface_t *result =
+		qahira_format_load(format, input, NULL, &error);
+	g_assert(result);
+	g_object_unref(input);
+	g_object_unref(output);
+	return result;
+}
+
 #if QAHIRA_HAS_JPEG
 #include "qahira/format/jpeg.h"
 static void
@@ -74,6 +120,856 @@ test_jpeg(GString **path, gconstpointer data)
 	g_object_unref(stream);
 	g_object_unref(jpeg);
 }
+
+static void
+test_jpeg_profile(GString **path, gconstpointer data)
+{
+	static const struct {
+		QahiraFormatJpegProfile profile;
+		const gchar *name;
+	} profiles[] = {
+		{ QAHIRA_FORMAT_JPEG_PROFILE_FAST, "fast" },
+		{ QAHIRA_FORMAT_JPEG_PROFILE_DEFAULT, "default" },
+		{ QAHIRA_FORMAT_JPEG_PROFILE_ACCURATE, "accurate" }
+	};
+	QahiraFormat *jpeg = qahira_format_jpeg_new();
+	g_assert(jpeg);
+	g_string_append(*path, "sphinx.jpg");
+	// run with `-m perf' to measure decoder throughput
+	gint iterations = g_test_perf() ? 50 : 1;
+	for (gint i = 0; i < G_N_ELEMENTS(profiles); ++i) {
+		qahira_format_jpeg_set_profile(jpeg, profiles[i].profile);
+		g_assert_cmpint(qahira_format_jpeg_get_profile(jpeg), ==,
+				profiles[i].profile);
+		gdouble pixels = 0.;
+		GTimer *timer = g_timer_new();
+		g_assert(timer);
+		for (gint j = 0; j < iterations; ++j) {
+			GInputStream *stream = open_input((*path)->str);
+			GError *error = NULL;
+			cairo_surface_t *surface =
+				qahira_format_load(jpeg, stream, NULL, &error);
+			g_assert(surface);
+			cairo_status_t status = cairo_surface_status(surface);
+			g_assert_cmpint(status, ==, CAIRO_STATUS_SUCCESS);
+			pixels += cairo_image_surface_get_width(surface)
+				* cairo_image_surface_get_height(surface);
+			cairo_surface_destroy(surface);
+			g_object_unref(stream);
+		}
+		gdouble elapsed = g_timer_elapsed(timer, NULL);
+		g_timer_destroy(timer);
+		if (g_test_perf()) {
+			g_test_minimized_result(elapsed / iterations,
+					"jpeg %s decode: %.1f Mpixel/s",
+					profiles[i].name,
+					pixels / elapsed / 1000000.);
+		}
+	}
+	g_object_unref(jpeg);
+}
+
+static void
+jpeg_progressive(QahiraFormat *jpeg, cairo_surface_t *surface,
+		gpointer data)
+{
+	gint *scans = data;
+	++*scans;
+	g_assert_cmpint(cairo_image_surface_get_width(surface), ==, 64);
+	g_assert_cmpint(cairo_image_surface_get_height(surface), ==, 48);
+}
+
+static void
+test_jpeg_progressive(GString **path, gconstpointer data)
+{
+	QahiraFormat *jpeg = qahira_format_jpeg_new();
+	g_assert(jpeg);
+	cairo_surface_t *surface =
+		cairo_image_surface_create(CAIRO_FORMAT_RGB24, 64, 48);
+	g_assert(surface);
+	cairo_t *cr = cairo_create(surface);
+	g_assert(cr);
+	cairo_set_source_rgba(cr, 0., 0., 1., 1.);
+	cairo_paint(cr);
+	cairo_set_source_rgba(cr, 1., 1., 0., 1.);
+	cairo_rectangle(cr, 5., 7., 31., 23.);
+	cairo_fill(cr);
+	cairo_destroy(cr);
+	qahira_format_jpeg_set_progressive(jpeg, TRUE);
+	GOutputStream *output = g_memory_output_stream_new(NULL, 0,
+			g_realloc, g_free);
+	g_assert(output);
+	GError *error = NULL;
+	gboolean status = qahira_format_save(jpeg, surface, output, NULL,
+			&error);
+	g_assert(status);
+	cairo_surface_destroy(surface);
+	GMemoryOutputStream *memory = G_MEMORY_OUTPUT_STREAM(output);
+	const guchar *bytes = g_memory_output_stream_get_data(memory);
+	gsize size = g_memory_output_stream_get_data_size(memory);
+	// count SOS markers, 0xff is stuffed in entropy coded data
+	gint expected = 0;
+	for (gsize i = 0; i + 1 < size; ++i) {
+		if (0xff == bytes[i] && 0xda == bytes[i + 1]) {
+			++expected;
+		}
+	}
+	g_assert_cmpint(expected, >, 1);
+	// the handler runs once per scan
+	gint scans = 0;
+	gulong handler = g_signal_connect(jpeg, "progressive",
+			G_CALLBACK(jpeg_progressive), &scans);
+	GInputStream *input = g_memory_input_stream_new_from_data(bytes,
+			size, NULL);
+	g_assert(input);
+	cairo_surface_t *multi = qahira_format_load(jpeg, input, NULL,
+			&error);
+	g_assert(multi);
+	g_assert_cmpint(scans, ==, expected);
+	g_object_unref(input);
+	// without a handler the image is decoded in a single pass
+	g_signal_handler_disconnect(jpeg, handler);
+	scans = 0;
+	input = g_memory_input_stream_new_from_data(bytes, size, NULL);
+	g_assert(input);
+	surface = qahira_format_load(jpeg, input, NULL, &error);
+	g_assert(surface);
+	g_assert_cmpint(scans, ==, 0);
+	assert_surface_equal(multi, surface);
+	cairo_surface_destroy(surface);
+	cairo_surface_destroy(multi);
+	g_object_unref(input);
+	// a preview decodes only the first scan
+	qahira_format_jpeg_set_preview(jpeg, TRUE);
+	g_assert(qahira_format_jpeg_get_preview(jpeg));
+	input = g_memory_input_stream_new_from_data(bytes, size, NULL);
+	g_assert(input);
+	surface = qahira_format_load(jpeg, input, NULL, &error);
+	g_assert(surface);
+	g_assert_cmpint(cairo_surface_status(surface), ==,
+			CAIRO_STATUS_SUCCESS);
+	g_assert_cmpint(cairo_image_surface_get_width(surface), ==, 64);
+	g_assert_cmpint(cairo_image_surface_get_height(surface), ==, 48);
+	cairo_surface_destroy(surface);
+	g_object_unref(input);
+	g_object_unref(output);
+	g_object_unref(jpeg);
+}
+
+static cairo_surface_t *
+load_jpeg(QahiraFormat *jpeg, const gchar *filename)
+{
+	GInputStream *stream = open_input(filename);
+	GError *error = NULL;
+	cairo_surface_t *surface =
+		qahira_format_load(jpeg, stream, NULL, &error);
+	g_assert(surface);
+	cairo_status_t status = cairo_surface_status(surface);
+	g_assert_cmpint(status, ==, CAIRO_STATUS_SUCCESS);
+	g_object_unref(stream);
+	return surface;
+}
+
+static GByteArray *
+insert_marker(const guchar *bytes, gsize size, const guchar *marker,
+		gsize length)
+{
+	// after SOI
+	GByteArray *array = g_byte_array_new();
+	g_assert(array);
+	g_byte_array_append(array, bytes, 2);
+	g_byte_array_append(array, marker, length);
+	g_byte_array_append(array, bytes + 2, size - 2);
+	return array;
+}
+
+// minimal big-endian EXIF with IFD0 orientation 6 (rotate 90)
+static const guchar jpeg_orientation[] = {
+	0xff, 0xe1, 0x00, 0x22, 'E', 'x', 'i', 'f', 0x00, 0x00,
+	'M', 'M', 0x00, 0x2a, 0x00, 0x00, 0x00, 0x08,
+	0x00, 0x01, 0x01, 0x12, 0x00, 0x03, 0x00, 0x00, 0x00, 0x01,
+	0x00, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static void
+test_jpeg_threads(GString **path, gconstpointer data)
+{
+	QahiraFormat *jpeg = qahira_format_jpeg_new();
+	g_assert(jpeg);
+	g_string_append(*path, "sphinx.jpg");
+	cairo_surface_t *expected = load_jpeg(jpeg, (*path)->str);
+	qahira_format_set_threads(jpeg, 4);
+	g_assert_cmpint(qahira_format_get_threads(jpeg), ==, 4);
+	cairo_surface_t *surface = load_jpeg(jpeg, (*path)->str);
+	assert_surface_equal(expected, surface);
+	cairo_surface_destroy(surface);
+	cairo_surface_destroy(expected);
+	g_object_unref(jpeg);
+}
+
+static void
+test_jpeg_threads_save(GString **path, gconstpointer data)
+{
+	QahiraFormat *jpeg = qahira_format_jpeg_new();
+	g_assert(jpeg);
+	g_string_append(*path, "sphinx.jpg");
+	cairo_surface_t *surface = load_jpeg(jpeg, (*path)->str);
+	cairo_surface_t *expected = reload(jpeg, surface);
+	qahira_format_set_threads(jpeg, 4);
+	cairo_surface_t *result = reload(jpeg, surface);
+	// strips only add restart markers, the coefficients are unchanged
+	assert_surface_equal(expected, result);
+	cairo_surface_destroy(result);
+	cairo_surface_destroy(expected);
+	cairo_surface_destroy(surface);
+	g_object_unref(jpeg);
+}
+
+static void
+test_jpeg_cmyk(GString **path, gconstpointer data)
+{
+	// 16x8 Adobe (inverted) CMYK, (255, 0, 0, 255) then (64, 128, 192, 200)
+	static const guchar cmyk[] = {
+		0xff, 0xd8, 0xff, 0xee, 0x00, 0x0e, 0x41, 0x64, 0x6f, 0x62,
+		0x65, 0x00, 0x64, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xdb,
+		0x00, 0x43, 0x00, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0xff, 0xc0, 0x00,
+		0x14, 0x08, 0x00, 0x08, 0x00, 0x10, 0x04, 0x43, 0x11, 0x00,
+		0x4d, 0x11, 0x00, 0x59, 0x11, 0x00, 0x4b, 0x11, 0x00, 0xff,
+		0xc4, 0x00, 0x16, 0x00, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x0b, 0x0a, 0x09, 0xff, 0xc4, 0x00, 0x14, 0x10, 0x01, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xda, 0x00, 0x0e, 0x04,
+		0x43, 0x00, 0x4d, 0x00, 0x59, 0x00, 0x4b, 0x00, 0x00, 0x3f,
+		0x00, 0xbf, 0x81, 0xff, 0x00, 0x8f, 0xfd, 0x7f, 0x02, 0x07,
+		0x20, 0x01, 0x80, 0x18, 0x8e, 0xff, 0xd9
+	};
+	// the same samples coded as Adobe YCCK
+	static const guchar ycck[] = {
+		0xff, 0xd8, 0xff, 0xee, 0x00, 0x0e, 0x41, 0x64, 0x6f, 0x62,
+		0x65, 0x00, 0x64, 0x00, 0x00, 0x00, 0x00, 0x02, 0xff, 0xdb,
+		0x00, 0x43, 0x00, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0xff, 0xdb, 0x00,
+		0x43, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0xff, 0xc0, 0x00, 0x14,
+		0x08, 0x00, 0x08, 0x00, 0x10, 0x04, 0x01, 0x11, 0x00, 0x02,
+		0x11, 0x01, 0x03, 0x11, 0x01, 0x04, 0x11, 0x00, 0xff, 0xc4,
+		0x00, 0x15, 0x00, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09,
+		0x0a, 0xff, 0xc4, 0x00, 0x14, 0x10, 0x01, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0xff, 0xc4, 0x00, 0x16, 0x01, 0x01, 0x01,
+		0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x0b, 0x09, 0x0a, 0xff, 0xc4, 0x00,
+		0x14, 0x11, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff,
+		0xda, 0x00, 0x0e, 0x04, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11,
+		0x04, 0x00, 0x00, 0x3f, 0x00, 0x66, 0x15, 0x60, 0x7f, 0xeb,
+		0xf8, 0x17, 0xec, 0xa7, 0x94, 0xa0, 0x23, 0xbf, 0xff, 0xd9
+	};
+	static const struct {
+		const guchar *bytes;
+		gsize size;
+		gboolean adobe; // keep the APP14 marker at offset 2
+		guint32 left;
+		guint32 right;
+	} images[] = {
+		{ cmyk, sizeof(cmyk), TRUE, 0xff0000, 0x326497 },
+		// without the Adobe marker the samples are not inverted
+		{ cmyk, sizeof(cmyk), FALSE, 0x000000, 0x291b0e },
+		{ ycck, sizeof(ycck), TRUE, 0xff0000, 0x326497 }
+	};
+	QahiraFormat *jpeg = qahira_format_jpeg_new();
+	g_assert(jpeg);
+	for (gint i = 0; i < G_N_ELEMENTS(images); ++i) {
+		GByteArray *array = g_byte_array_new();
+		g_assert(array);
+		g_byte_array_append(array, images[i].bytes, 2);
+		gsize offset = images[i].adobe ? 2 : 18;
+		g_byte_array_append(array, images[i].bytes + offset,
+				images[i].size - offset);
+		GInputStream *input = g_memory_input_stream_new_from_data(
+				array->data, array->len, NULL);
+		g_assert(input);
+		GError *error = NULL;
+		cairo_surface_t *surface =
+			qahira_format_load(jpeg, input, NULL, &error);
+		g_assert(surface);
+		g_assert_cmpint(cairo_surface_status(surface), ==,
+				CAIRO_STATUS_SUCCESS);
+		g_assert_cmpint(cairo_image_surface_get_width(surface), ==,
+				16);
+		g_assert_cmpint(cairo_image_surface_get_height(surface), ==,
+				8);
+		const guchar *pixels = cairo_image_surface_get_data(surface);
+		gint stride = cairo_image_surface_get_stride(surface);
+		for (gint y = 0; y < 8; ++y) {
+			const guint32 *row =
+				(const guint32 *)(pixels + y * stride);
+			for (gint x = 0; x < 16; ++x) {
+				g_assert_cmphex(row[x] & 0xffffff, ==, 8 > x
+						? images[i].left
+						: images[i].right);
+			}
+		}
+		cairo_surface_destroy(surface);
+		g_object_unref(input);
+		g_byte_array_free(array, TRUE);
+	}
+	g_object_unref(jpeg);
+}
+
+static void
+test_jpeg_save_argb(GString **path, gconstpointer data)
+{
+	QahiraFormat *jpeg = qahira_format_jpeg_new();
+	g_assert(jpeg);
+	cairo_surface_t *surface =
+		cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 64, 64);
+	g_assert(surface);
+	cairo_t *cr = cairo_create(surface);
+	g_assert(cr);
+	// leave the bottom half fully transparent
+	cairo_rectangle(cr, 0., 0., 64., 32.);
+	cairo_set_source_rgba(cr, 1., .5, 0., .5);
+	cairo_fill(cr);
+	cairo_destroy(cr);
+	cairo_surface_t *result = reload(jpeg, surface);
+	g_assert_cmpint(cairo_image_surface_get_width(result), ==, 64);
+	g_assert_cmpint(cairo_image_surface_get_height(result), ==, 64);
+	const guchar *pixel = cairo_image_surface_get_data(result);
+	// unpremultiplied orange, allow for compression loss
+	g_assert_cmpint(ABS(pixel[QAHIRA_R] - 255), <=, 8);
+	g_assert_cmpint(ABS(pixel[QAHIRA_G] - 128), <=, 8);
+	g_assert_cmpint(ABS(pixel[QAHIRA_B] - 0), <=, 8);
+	cairo_surface_destroy(result);
+	cairo_surface_destroy(surface);
+	g_object_unref(jpeg);
+}
+
+static void
+test_jpeg_save_options(GString **path, gconstpointer data)
+{
+	QahiraFormat *jpeg = qahira_format_jpeg_new();
+	g_assert(jpeg);
+	g_string_append(*path, "sphinx.jpg");
+	cairo_surface_t *surface = load_jpeg(jpeg, (*path)->str);
+	gint width = cairo_image_surface_get_width(surface);
+	gint height = cairo_image_surface_get_height(surface);
+	qahira_format_jpeg_set_optimize(jpeg, TRUE);
+	g_assert(qahira_format_jpeg_get_optimize(jpeg));
+	qahira_format_jpeg_set_progressive(jpeg, TRUE);
+	g_assert(qahira_format_jpeg_get_progressive(jpeg));
+	qahira_format_jpeg_set_subsampling(jpeg,
+			QAHIRA_FORMAT_JPEG_SUBSAMPLING_444);
+	g_assert_cmpint(qahira_format_jpeg_get_subsampling(jpeg), ==,
+			QAHIRA_FORMAT_JPEG_SUBSAMPLING_444);
+	qahira_format_jpeg_set_dct_method(jpeg, QAHIRA_FORMAT_JPEG_DCT_FLOAT);
+	g_assert_cmpint(qahira_format_jpeg_get_dct_method(jpeg), ==,
+			QAHIRA_FORMAT_JPEG_DCT_FLOAT);
+	cairo_surface_t *result = reload(jpeg, surface);
+	g_assert_cmpint(cairo_image_surface_get_width(result), ==, width);
+	g_assert_cmpint(cairo_image_surface_get_height(result), ==, height);
+	cairo_surface_destroy(result);
+	// restart markers every MCU row make the output decodable in bands
+	qahira_format_jpeg_set_optimize(jpeg, FALSE);
+	qahira_format_jpeg_set_progressive(jpeg, FALSE);
+	qahira_format_jpeg_set_restart_interval(jpeg, 1);
+	g_assert_cmpint(qahira_format_jpeg_get_restart_interval(jpeg), ==, 1);
+	cairo_surface_t *expected = reload(jpeg, surface);
+	qahira_format_set_threads(jpeg, 4);
+	result = reload(jpeg, surface);
+	assert_surface_equal(expected, result);
+	cairo_surface_destroy(result);
+	cairo_surface_destroy(expected);
+	cairo_surface_destroy(surface);
+	g_object_unref(jpeg);
+}
+
+static void
+test_jpeg_save_target(GString **path, gconstpointer data)
+{
+	QahiraFormat *jpeg = qahira_format_jpeg_new();
+	g_assert(jpeg);
+	g_string_append(*path, "sphinx.jpg");
+	cairo_surface_t *surface = load_jpeg(jpeg, (*path)->str);
+	qahira_format_set_threads(jpeg, 0);
+	qahira_format_jpeg_set_target_size(jpeg, 64 * 1024);
+	g_assert_cmpuint(qahira_format_jpeg_get_target_size(jpeg), ==,
+			64 * 1024);
+	GOutputStream *output = g_memory_output_stream_new(NULL, 0,
+			g_realloc, g_free);
+	g_assert(output);
+	GError *error = NULL;
+	gboolean status = qahira_format_save(jpeg, surface, output, NULL,
+			&error);
+	g_assert(status);
+	gsize size = g_memory_output_stream_get_data_size(
+			G_MEMORY_OUTPUT_STREAM(output));
+	g_assert_cmpuint(size, >, 0);
+	g_assert_cmpuint(size, <=, 64 * 1024);
+	g_object_unref(output);
+	// nothing fits in a few bytes
+	qahira_format_jpeg_set_target_size(jpeg, 64);
+	output = g_memory_output_stream_new(NULL, 0, g_realloc, g_free);
+	g_assert(output);
+	status = qahira_format_save(jpeg, surface, output, NULL, &error);
+	g_assert(!status);
+	g_assert(error);
+	g_assert_cmpint(error->code, ==, QAHIRA_ERROR_FAILURE);
+	g_error_free(error);
+	g_object_unref(output);
+	cairo_surface_destroy(surface);
+	g_object_unref(jpeg);
+}
+
+static void
+test_jpeg_transform(GString **path, gconstpointer data)
+{
+	QahiraFormat *jpeg = qahira_format_jpeg_new();
+	g_assert(jpeg);
+	g_string_append(*path, "sphinx.jpg");
+	GInputStream *input = open_input((*path)->str);
+	GOutputStream *output = g_memory_output_stream_new(NULL, 0,
+			g_realloc, g_free);
+	g_assert(output);
+	// crop to [96, 48] - [600, 450] then rotate
+	cairo_rectangle_int_t crop = { 100, 50, 500, 400 };
+	GError *error = NULL;
+	gboolean status = qahira_format_jpeg_transform(jpeg, input, output,
+			QAHIRA_FORMAT_JPEG_TRANSFORM_ROTATE_90, &crop, NULL,
+			&error);
+	g_assert(status);
+	status = g_output_stream_close(output, NULL, &error);
+	g_assert(status);
+	g_object_unref(input);
+	GMemoryOutputStream *memory = G_MEMORY_OUTPUT_STREAM(output);
+	input = g_memory_input_stream_new_from_data(
+			g_memory_output_stream_get_data(memory),
+			g_memory_output_stream_get_data_size(memory), NULL);
+	g_assert(input);
+	cairo_surface_t *surface =
+		qahira_format_load(jpeg, input, NULL, &error);
+	g_assert(surface);
+	// the partial iMCU row is trimmed before it becomes the left edge
+	g_assert_cmpint(cairo_image_surface_get_width(surface), ==, 400);
+	g_assert_cmpint(cairo_image_surface_get_height(surface), ==, 504);
+	cairo_surface_destroy(surface);
+	g_object_unref(input);
+	g_object_unref(output);
+	// a rotated image is no longer tagged with orientation 6
+	surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, 64, 32);
+	g_assert(surface);
+	output = g_memory_output_stream_new(NULL, 0, g_realloc, g_free);
+	g_assert(output);
+	status = qahira_format_save(jpeg, surface, output, NULL, &error);
+	g_assert(status);
+	cairo_surface_destroy(surface);
+	memory = G_MEMORY_OUTPUT_STREAM(output);
+	GByteArray *array = insert_marker(
+			g_memory_output_stream_get_data(memory),
+			g_memory_output_stream_get_data_size(memory),
+			jpeg_orientation, sizeof(jpeg_orientation));
+	g_object_unref(output);
+	input = g_memory_input_stream_new_from_data(array->data, array->len,
+			NULL);
+	g_assert(input);
+	output = g_memory_output_stream_new(NULL, 0, g_realloc, g_free);
+	g_assert(output);
+	status = qahira_format_jpeg_transform(jpeg, input, output,
+			QAHIRA_FORMAT_JPEG_TRANSFORM_ROTATE_90, NULL, NULL,
+			&error);
+	g_assert(status);
+	status = g_output_stream_close(output, NULL, &error);
+	g_assert(status);
+	g_object_unref(input);
+	g_byte_array_free(array, TRUE);
+	memory = G_MEMORY_OUTPUT_STREAM(output);
+	input = g_memory_input_stream_new_from_data(
+			g_memory_output_stream_get_data(memory),
+			g_memory_output_stream_get_data_size(memory), NULL);
+	g_assert(input);
+	qahira_format_jpeg_set_auto_orient(jpeg, TRUE);
+	surface = qahira_format_load(jpeg, input, NULL, &error);
+	g_assert(surface);
+	g_assert_cmpint(cairo_image_surface_get_width(surface), ==, 32);
+	g_assert_cmpint(cairo_image_surface_get_height(surface), ==, 64);
+	cairo_surface_destroy(surface);
+	g_object_unref(input);
+	g_object_unref(output);
+	g_object_unref(jpeg);
+}
+
+static void
+test_jpeg_thumbnail(GString **path, gconstpointer data)
+{
+	QahiraFormat *jpeg = qahira_format_jpeg_new();
+	g_assert(jpeg);
+	g_string_append(*path, "sphinx.jpg");
+	GInputStream *stream = open_input((*path)->str);
+	GError *error = NULL;
+	// sphinx.jpg carries an EXIF thumbnail
+	cairo_surface_t *surface = qahira_format_jpeg_load_thumbnail(jpeg,
+			stream, 0, NULL, &error);
+	g_assert(surface);
+	g_assert_cmpint(cairo_surface_status(surface), ==,
+			CAIRO_STATUS_SUCCESS);
+	g_assert_cmpint(cairo_image_surface_get_width(surface), ==, 160);
+	g_assert_cmpint(cairo_image_surface_get_height(surface), ==, 107);
+	cairo_surface_destroy(surface);
+	g_object_unref(stream);
+	// re-encoded images have no thumbnail, they are decoded scaled down
+	stream = open_input((*path)->str);
+	surface = qahira_format_load(jpeg, stream, NULL, &error);
+	g_assert(surface);
+	g_object_unref(stream);
+	GOutputStream *output = g_memory_output_stream_new(NULL, 0,
+			g_realloc, g_free);
+	g_assert(output);
+	gboolean status = qahira_format_save(jpeg, surface, output, NULL,
+			&error);
+	g_assert(status);
+	cairo_surface_destroy(surface);
+	status = g_output_stream_close(output, NULL, &error);
+	g_assert(status);
+	GMemoryOutputStream *memory = G_MEMORY_OUTPUT_STREAM(output);
+	stream = g_memory_input_stream_new_from_data(
+			g_memory_output_stream_get_data(memory),
+			g_memory_output_stream_get_data_size(memory), NULL);
+	g_assert(stream);
+	surface = qahira_format_jpeg_load_thumbnail(jpeg, stream, 0, NULL,
+			&error);
+	g_assert(!surface);
+	g_assert(error);
+	g_clear_error(&error);
+	g_object_unref(stream);
+	stream = g_memory_input_stream_new_from_data(
+			g_memory_output_stream_get_data(memory),
+			g_memory_output_stream_get_data_size(memory), NULL);
+	g_assert(stream);
+	// the smallest 1/8 multiple of 1278 x 853 covering 200 pixels
+	surface = qahira_format_jpeg_load_thumbnail(jpeg, stream, 200, NULL,
+			&error);
+	g_assert(surface);
+	g_assert_cmpint(cairo_surface_status(surface), ==,
+			CAIRO_STATUS_SUCCESS);
+	g_assert_cmpint(cairo_image_surface_get_width(surface), ==, 320);
+	g_assert_cmpint(cairo_image_surface_get_height(surface), ==, 214);
+	cairo_surface_destroy(surface);
+	g_object_unref(stream);
+	g_object_unref(output);
+	g_object_unref(jpeg);
+}
+
+static void
+test_jpeg_exif_bounds(GString **path, gconstpointer data)
+{
+	// IFD0 & IFD1 offsets pointing past the end of the EXIF data
+	static const guint32 offsets[][2] = {
+		{ 0xfffffff0, 0 },
+		{ 0xffffffff, 0 },
+		{ 8, 0xfffffff0 },
+		{ 8, 0xfffffffe }
+	};
+	QahiraFormat *jpeg = qahira_format_jpeg_new();
+	g_assert(jpeg);
+	qahira_format_jpeg_set_auto_orient(jpeg, TRUE);
+	cairo_surface_t *surface =
+		cairo_image_surface_create(CAIRO_FORMAT_RGB24, 16, 16);
+	g_assert(surface);
+	GOutputStream *output = g_memory_output_stream_new(NULL, 0,
+			g_realloc, g_free);
+	g_assert(output);
+	GError *error = NULL;
+	gboolean status = qahira_format_save(jpeg, surface, output, NULL,
+			&error);
+	g_assert(status);
+	cairo_surface_destroy(surface);
+	GMemoryOutputStream *memory = G_MEMORY_OUTPUT_STREAM(output);
+	const guchar *bytes = g_memory_output_stream_get_data(memory);
+	gsize size = g_memory_output_stream_get_data_size(memory);
+	for (gint i = 0; i < G_N_ELEMENTS(offsets); ++i) {
+		// big-endian EXIF, an empty IFD0 at 8 links to IFD1
+		guchar exif[] = {
+			0xff, 0xe1, 0x00, 0x16, 'E', 'x', 'i', 'f', 0x00, 0x00,
+			'M', 'M', 0x00, 0x2a, 0x00, 0x00, 0x00, 0x00,
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+		};
+		for (gint j = 0; j < 4; ++j) {
+			exif[14 + j] = offsets[i][0] >> (24 - 8 * j);
+			exif[20 + j] = offsets[i][1] >> (24 - 8 * j);
+		}
+		GByteArray *array = insert_marker(bytes, size, exif,
+				sizeof(exif));
+		GInputStream *input = g_memory_input_stream_new_from_data(
+				array->data, array->len, NULL);
+		g_assert(input);
+		surface = qahira_format_load(jpeg, input, NULL, &error);
+		g_assert(surface);
+		g_assert_cmpint(cairo_image_surface_get_width(surface), ==,
+				16);
+		g_assert_cmpint(cairo_image_surface_get_height(surface), ==,
+				16);
+		cairo_surface_destroy(surface);
+		g_object_unref(input);
+		input = g_memory_input_stream_new_from_data(array->data,
+				array->len, NULL);
+		g_assert(input);
+		surface = qahira_format_jpeg_load_thumbnail(jpeg, input, 0,
+				NULL, &error);
+		g_assert(!surface);
+		g_assert(error);
+		g_clear_error(&error);
+		g_object_unref(input);
+		g_byte_array_free(array, TRUE);
+	}
+	g_object_unref(output);
+	g_object_unref(jpeg);
+}
+
+static void
+test_jpeg_orientation(GString **path, gconstpointer data)
+{
+	QahiraFormat *jpeg = qahira_format_jpeg_new();
+	g_assert(jpeg);
+	// red left half, blue right half
+	cairo_surface_t *surface =
+		cairo_image_surface_create(CAIRO_FORMAT_RGB24, 64, 32);
+	g_assert(surface);
+	cairo_t *cr = cairo_create(surface);
+	g_assert(cr);
+	cairo_set_source_rgba(cr, 0., 0., 1., 1.);
+	cairo_paint(cr);
+	cairo_rectangle(cr, 0., 0., 32., 32.);
+	cairo_set_source_rgba(cr, 1., 0., 0., 1.);
+	cairo_fill(cr);
+	cairo_destroy(cr);
+	GOutputStream *output = g_memory_output_stream_new(NULL, 0,
+			g_realloc, g_free);
+	g_assert(output);
+	GError *error = NULL;
+	gboolean status = qahira_format_save(jpeg, surface, output, NULL,
+			&error);
+	g_assert(status);
+	cairo_surface_destroy(surface);
+	GMemoryOutputStream *memory = G_MEMORY_OUTPUT_STREAM(output);
+	const guchar *bytes = g_memory_output_stream_get_data(memory);
+	gsize size = g_memory_output_stream_get_data_size(memory);
+	GByteArray *array = insert_marker(bytes, size, jpeg_orientation,
+			sizeof(jpeg_orientation));
+	g_object_unref(output);
+	qahira_format_jpeg_set_auto_orient(jpeg, TRUE);
+	g_assert(qahira_format_jpeg_get_auto_orient(jpeg));
+	GInputStream *input = g_memory_input_stream_new_from_data(
+			array->data, array->len, NULL);
+	g_assert(input);
+	surface = qahira_format_load(jpeg, input, NULL, &error);
+	g_assert(surface);
+	g_assert_cmpint(cairo_image_surface_get_width(surface), ==, 32);
+	g_assert_cmpint(cairo_image_surface_get_height(surface), ==, 64);
+	const guchar *pixels = cairo_image_surface_get_data(surface);
+	gint stride = cairo_image_surface_get_stride(surface);
+	// the left half is now on top
+	const guchar *top = pixels + 16 * stride + 16 * 4;
+	const guchar *bottom = pixels + 48 * stride + 16 * 4;
+	g_assert_cmpint(top[QAHIRA_R], >, 200);
+	g_assert_cmpint(top[QAHIRA_B], <, 50);
+	g_assert_cmpint(bottom[QAHIRA_R], <, 50);
+	g_assert_cmpint(bottom[QAHIRA_B], >, 200);
+	cairo_surface_destroy(surface);
+	g_object_unref(input);
+	g_byte_array_free(array, TRUE);
+	g_object_unref(jpeg);
+}
+
+static void
+test_jpeg_planes(GString **path, gconstpointer data)
+{
+	QahiraFormat *jpeg = qahira_format_jpeg_new();
+	g_assert(jpeg);
+	g_string_append(*path, "sphinx.jpg");
+	GInputStream *input = open_input((*path)->str);
+	QahiraFormatJpegPlanes planes;
+	memset(&planes, 0, sizeof(planes));
+	GError *error = NULL;
+	gboolean status = qahira_format_jpeg_load_planes(jpeg, input,
+			&planes, NULL, &error);
+	g_assert(status);
+	g_object_unref(input);
+	g_assert_cmpint(planes.width, ==, 1278);
+	g_assert_cmpint(planes.height, ==, 853);
+	g_assert_cmpint(planes.components, ==, 3);
+	// 4:2:0 chroma
+	g_assert_cmpint(planes.plane_width[0], ==, 1278);
+	g_assert_cmpint(planes.plane_height[0], ==, 853);
+	g_assert_cmpint(planes.plane_width[1], ==, 639);
+	g_assert_cmpint(planes.plane_height[1], ==, 427);
+	GOutputStream *output = g_memory_output_stream_new(NULL, 0,
+			g_realloc, g_free);
+	g_assert(output);
+	status = qahira_format_jpeg_save_planes(jpeg, &planes, output, NULL,
+			&error);
+	g_assert(status);
+	status = g_output_stream_close(output, NULL, &error);
+	g_assert(status);
+	GMemoryOutputStream *memory = G_MEMORY_OUTPUT_STREAM(output);
+	input = g_memory_input_stream_new_from_data(
+			g_memory_output_stream_get_data(memory),
+			g_memory_output_stream_get_data_size(memory), NULL);
+	g_assert(input);
+	cairo_surface_t *surface =
+		qahira_format_load(jpeg, input, NULL, &error);
+	g_assert(surface);
+	g_assert_cmpint(cairo_image_surface_get_width(surface), ==, 1278);
+	g_assert_cmpint(cairo_image_surface_get_height(surface), ==, 853);
+	cairo_surface_destroy(surface);
+	g_object_unref(input);
+	g_object_unref(output);
+	// chroma planes that do not match the subsampling are rejected
+	planes.plane_width[1] = planes.width;
+	output = g_memory_output_stream_new(NULL, 0, g_realloc, g_free);
+	g_assert(output);
+	status = qahira_format_jpeg_save_planes(jpeg, &planes, output, NULL,
+			&error);
+	g_assert(!status);
+	g_assert(error);
+	g_error_free(error);
+	error = NULL;
+	g_object_unref(output);
+	for (gint i = 0; i < planes.components; ++i) {
+		g_free(planes.data[i]);
+	}
+	g_object_unref(jpeg);
+}
+
+static void
+test_jpeg_tables(GString **path, gconstpointer data)
+{
+	QahiraFormat *jpeg = qahira_format_jpeg_new();
+	g_assert(jpeg);
+	g_string_append(*path, "sphinx.jpg");
+	cairo_surface_t *surface = load_jpeg(jpeg, (*path)->str);
+	cairo_surface_t *expected = reload(jpeg, surface);
+	GOutputStream *tables = g_memory_output_stream_new(NULL, 0,
+			g_realloc, g_free);
+	g_assert(tables);
+	GError *error = NULL;
+	gboolean status = qahira_format_jpeg_save_tables(jpeg, tables, NULL,
+			&error);
+	g_assert(status);
+	status = g_output_stream_close(tables, NULL, &error);
+	g_assert(status);
+	qahira_format_jpeg_set_abbreviate(jpeg, TRUE);
+	g_assert(qahira_format_jpeg_get_abbreviate(jpeg));
+	GOutputStream *output = g_memory_output_stream_new(NULL, 0,
+			g_realloc, g_free);
+	g_assert(output);
+	status = qahira_format_save(jpeg, surface, output, NULL, &error);
+	g_assert(status);
+	status = g_output_stream_close(output, NULL, &error);
+	g_assert(status);
+	cairo_surface_destroy(surface);
+	g_object_unref(jpeg);
+	GMemoryOutputStream *memory = G_MEMORY_OUTPUT_STREAM(output);
+	const guchar *bytes = g_memory_output_stream_get_data(memory);
+	gsize size = g_memory_output_stream_get_data_size(memory);
+	// abbreviated images cannot be decoded without the tables
+	jpeg = qahira_format_jpeg_new();
+	g_assert(jpeg);
+	GInputStream *input =
+		g_memory_input_stream_new_from_data(bytes, size, NULL);
+	g_assert(input);
+	surface = qahira_format_load(jpeg, input, NULL, &error);
+	g_assert(!surface);
+	g_assert(error);
+	g_clear_error(&error);
+	g_object_unref(input);
+	memory = G_MEMORY_OUTPUT_STREAM(tables);
+	input = g_memory_input_stream_new_from_data(
+			g_memory_output_stream_get_data(memory),
+			g_memory_output_stream_get_data_size(memory), NULL);
+	g_assert(input);
+	status = qahira_format_jpeg_load_tables(jpeg, input, NULL, &error);
+	g_assert(status);
+	g_object_unref(input);
+	// the tables are kept across loads
+	for (gint i = 0; i < 2; ++i) {
+		input = g_memory_input_stream_new_from_data(bytes, size,
+				NULL);
+		g_assert(input);
+		surface = qahira_format_load(jpeg, input, NULL, &error);
+		g_assert(surface);
+		assert_surface_equal(expected, surface);
+		cairo_surface_destroy(surface);
+		g_object_unref(input);
+	}
+	cairo_surface_destroy(expected);
+	g_object_unref(output);
+	g_object_unref(tables);
+	g_object_unref(jpeg);
+}
+
+#if HAVE_DECL_JCS_RGB565
+static void
+test_jpeg_rgb565(GString **path, gconstpointer data)
+{
+	QahiraFormat *jpeg = qahira_format_jpeg_new();
+	g_assert(jpeg);
+	g_string_append(*path, "sphinx.jpg");
+	cairo_surface_t *expected = load_jpeg(jpeg, (*path)->str);
+	qahira_format_jpeg_set_format(jpeg, CAIRO_FORMAT_RGB16_565);
+	g_assert_cmpint(qahira_format_jpeg_get_format(jpeg), ==,
+			CAIRO_FORMAT_RGB16_565);
+	cairo_surface_t *surface = load_jpeg(jpeg, (*path)->str);
+	g_assert_cmpint(cairo_image_surface_get_format(surface), ==,
+			CAIRO_FORMAT_RGB16_565);
+	gint width = cairo_image_surface_get_width(surface);
+	gint height = cairo_image_surface_get_height(surface);
+	g_assert_cmpint(width, ==, 1278);
+	g_assert_cmpint(height, ==, 853);
+	// without dithering the pixels are truncated 24-bit pixels
+	const guchar *p = cairo_image_surface_get_data(expected);
+	const guchar *q = cairo_image_surface_get_data(surface);
+	gint stride_p = cairo_image_surface_get_stride(expected);
+	gint stride_q = cairo_image_surface_get_stride(surface);
+	for (gint i = 0; i < height; ++i) {
+		const guchar *in = p + stride_p * i;
+		const guint16 *out = (const guint16 *)(q + stride_q * i);
+		for (gint j = 0; j < width; ++j) {
+			guint16 pixel = (in[QAHIRA_R] & 0xf8) << 8
+				| (in[QAHIRA_G] & 0xfc) << 3
+				| in[QAHIRA_B] >> 3;
+			g_assert_cmpuint(out[j], ==, pixel);
+			in += 4;
+		}
+	}
+	cairo_surface_destroy(surface);
+	qahira_format_jpeg_set_dither(jpeg, TRUE);
+	g_assert(qahira_format_jpeg_get_dither(jpeg));
+	surface = load_jpeg(jpeg, (*path)->str);
+	g_assert_cmpint(cairo_image_surface_get_format(surface), ==,
+			CAIRO_FORMAT_RGB16_565);
+	cairo_surface_destroy(surface);
+	cairo_surface_destroy(expected);
+	g_object_unref(jpeg);
+}
+#endif // HAVE_DECL_JCS_RGB565
 #endif // QAHIRA_HAS_JPEG
 
 #if QAHIRA_HAS_PNG
@@ -95,6 +991,663 @@ test_png(GString **path, gconstpointer data)
 	g_object_unref(stream);
 	g_object_unref(png);
 }
+
+static cairo_surface_t *
+load_png_data(QahiraFormat *png, const guchar *bytes, gsize size)
+{
+	GInputStream *input =
+		g_memory_input_stream_new_from_data(bytes, size, NULL);
+	g_assert(input);
+	GError *error = NULL;
+	cairo_surface_t *surface = qahira_format_load(png, input, NULL, &error);
+	g_assert(surface);
+	g_object_unref(input);
+	return surface;
+}
+
+static void
+assert_png_pixels(QahiraFormat *png, const guchar *bytes, gsize size,
+		gint width, gint height, cairo_format_t format,
+		const guint32 *expected)
+{
+	cairo_surface_t *surface = load_png_data(png, bytes, size);
+	g_assert_cmpint(cairo_image_surface_get_format(surface), ==, format);
+	g_assert_cmpint(cairo_image_surface_get_width(surface), ==, width);
+	g_assert_cmpint(cairo_image_surface_get_height(surface), ==, height);
+	const guchar *data = cairo_image_surface_get_data(surface);
+	gint stride = cairo_image_surface_get_stride(surface);
+	for (gint i = 0; i < height; ++i) {
+		const guint32 *row = (const guint32 *)(data + i * stride);
+		for (gint j = 0; j < width; ++j) {
+			g_assert_cmphex(row[j], ==, expected[i * width + j]);
+		}
+	}
+	cairo_surface_destroy(surface);
+}
+
+// 4x2 interlaced, 2-bit palette (red, green, blue, white), the
+// first two entries are half & fully transparent
+static const guchar png_palette[] = {
+	0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00,
+	0x00, 0x0d, 0x49, 0x48, 0x44, 0x52, 0x00, 0x00, 0x00, 0x04,
+	0x00, 0x00, 0x00, 0x02, 0x02, 0x03, 0x00, 0x00, 0x01, 0x75,
+	0xc1, 0xa5, 0x66, 0x00, 0x00, 0x00, 0x0c, 0x50, 0x4c, 0x54,
+	0x45, 0xff, 0x00, 0x00, 0x00, 0xff, 0x00, 0x00, 0x00, 0xff,
+	0xff, 0xff, 0xff, 0xfb, 0x00, 0x60, 0xf6, 0x00, 0x00, 0x00,
+	0x02, 0x74, 0x52, 0x4e, 0x53, 0x80, 0x00, 0x4d, 0x10, 0x55,
+	0x73, 0x00, 0x00, 0x00, 0x10, 0x49, 0x44, 0x41, 0x54, 0x78,
+	0xda, 0x63, 0x60, 0x60, 0x68, 0x60, 0x28, 0x60, 0x78, 0x02,
+	0x00, 0x04, 0xbc, 0x01, 0xd5, 0x3b, 0xb1, 0x38, 0x7c, 0x00,
+	0x00, 0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae, 0x42, 0x60,
+	0x82
+};
+
+// 8x1 1-bit gray, black is transparent
+static const guchar png_gray[] = {
+	0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00,
+	0x00, 0x0d, 0x49, 0x48, 0x44, 0x52, 0x00, 0x00, 0x00, 0x08,
+	0x00, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0xcb,
+	0x7b, 0xd2, 0xee, 0x00, 0x00, 0x00, 0x02, 0x74, 0x52, 0x4e,
+	0x53, 0x00, 0x00, 0x76, 0x93, 0xcd, 0x38, 0x00, 0x00, 0x00,
+	0x0a, 0x49, 0x44, 0x41, 0x54, 0x78, 0xda, 0x63, 0xd8, 0x00,
+	0x00, 0x00, 0xb2, 0x00, 0xb1, 0xf8, 0x82, 0x92, 0xa7, 0x00,
+	0x00, 0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae, 0x42, 0x60,
+	0x82
+};
+
+static void
+test_png_palette(GString **path, gconstpointer data)
+{
+	static const guint32 palette_pixels[] = {
+		0x80800000, 0x00000000, 0xff0000ff, 0xffffffff,
+		0xffffffff, 0xff0000ff, 0x00000000, 0x80800000
+	};
+	static const guint32 gray_pixels[] = {
+		0xffffffff, 0x00000000, 0xffffffff, 0xffffffff,
+		0x00000000, 0x00000000, 0x00000000, 0x00000000
+	};
+	QahiraFormat *png = qahira_format_png_new();
+	g_assert(png);
+	assert_png_pixels(png, png_palette, sizeof(png_palette), 4, 2,
+			CAIRO_FORMAT_ARGB32, palette_pixels);
+	assert_png_pixels(png, png_gray, sizeof(png_gray), 8, 1,
+			CAIRO_FORMAT_ARGB32, gray_pixels);
+	g_object_unref(png);
+}
+
+static void
+test_png_opaque(GString **path, gconstpointer data)
+{
+	// 2x2 RGBA (red, green, blue, white), every pixel is opaque
+	static const guchar rgba[] = {
+		0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00,
+		0x00, 0x0d, 0x49, 0x48, 0x44, 0x52, 0x00, 0x00, 0x00, 0x02,
+		0x00, 0x00, 0x00, 0x02, 0x08, 0x06, 0x00, 0x00, 0x00, 0x72,
+		0xb6, 0x0d, 0x24, 0x00, 0x00, 0x00, 0x12, 0x49, 0x44, 0x41,
+		0x54, 0x78, 0xda, 0x63, 0xf8, 0xcf, 0xc0, 0xf0, 0x1f, 0x0c,
+		0x81, 0x34, 0x18, 0x00, 0x00, 0x49, 0xc8, 0x09, 0xf7, 0x03,
+		0xd9, 0x64, 0xf1, 0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4e,
+		0x44, 0xae, 0x42, 0x60, 0x82
+	};
+	static const guint32 pixels[] = {
+		0xffff0000, 0xff00ff00, 0xff0000ff, 0xffffffff
+	};
+	QahiraFormat *png = qahira_format_png_new();
+	g_assert(png);
+	assert_png_pixels(png, rgba, sizeof(rgba), 2, 2, CAIRO_FORMAT_RGB24,
+			pixels);
+	// opaque ARGB32 surfaces are saved without alpha
+	cairo_surface_t *surface =
+		cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 16, 16);
+	g_assert(surface);
+	cairo_t *cr = cairo_create(surface);
+	g_assert(cr);
+	cairo_set_source_rgba(cr, 1., 0., 0., 1.);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+	GOutputStream *output = g_memory_output_stream_new(NULL, 0,
+			g_realloc, g_free);
+	g_assert(output);
+	GError *error = NULL;
+	gboolean status = qahira_format_save(png, surface, output, NULL,
+			&error);
+	g_assert(status);
+	cairo_surface_destroy(surface);
+	GMemoryOutputStream *memory = G_MEMORY_OUTPUT_STREAM(output);
+	const guchar *bytes = g_memory_output_stream_get_data(memory);
+	g_assert_cmpuint(g_memory_output_stream_get_data_size(memory), >, 26);
+	// IHDR color type
+	g_assert_cmpint(bytes[25], ==, 2);
+	g_object_unref(output);
+	g_object_unref(png);
+}
+
+static void
+png_progressive(QahiraFormat *png, cairo_surface_t *surface, gpointer data)
+{
+	gint *passes = data;
+	if (!(*passes)++) {
+		// the first pass fills the whole image
+		const guchar *pixels = cairo_image_surface_get_data(surface);
+		gint stride = cairo_image_surface_get_stride(surface);
+		const guint32 *row = (const guint32 *)(pixels + 15 * stride);
+		g_assert_cmphex(row[15], ==, 0xff0000ff);
+	}
+}
+
+static void
+test_png_progressive(GString **path, gconstpointer data)
+{
+	QahiraFormat *png = qahira_format_png_new();
+	g_assert(png);
+	cairo_surface_t *surface =
+		cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 16, 16);
+	g_assert(surface);
+	cairo_t *cr = cairo_create(surface);
+	g_assert(cr);
+	cairo_set_source_rgba(cr, 0., 0., 1., 1.);
+	cairo_paint(cr);
+	cairo_set_source_rgba(cr, 1., 0., 0., 1.);
+	cairo_rectangle(cr, 0., 0., 5., 3.);
+	cairo_fill(cr);
+	cairo_destroy(cr);
+	qahira_format_set_interlace(png, TRUE);
+	GOutputStream *output = g_memory_output_stream_new(NULL, 0,
+			g_realloc, g_free);
+	g_assert(output);
+	GError *error = NULL;
+	gboolean status = qahira_format_save(png, surface, output, NULL,
+			&error);
+	g_assert(status);
+	gint passes = 0;
+	g_signal_connect(png, "progressive", G_CALLBACK(png_progressive),
+			&passes);
+	GMemoryOutputStream *memory = G_MEMORY_OUTPUT_STREAM(output);
+	GInputStream *input = g_memory_input_stream_new_from_data(
+			g_memory_output_stream_get_data(memory),
+			g_memory_output_stream_get_data_size(memory), NULL);
+	g_assert(input);
+	cairo_surface_t *result = qahira_format_load(png, input, NULL, &error);
+	g_assert(result);
+	g_assert_cmpint(passes, ==, 7);
+	const guchar *expected = cairo_image_surface_get_data(surface);
+	const guchar *pixels = cairo_image_surface_get_data(result);
+	gint stride = cairo_image_surface_get_stride(surface);
+	g_assert_cmpint(cairo_image_surface_get_stride(result), ==, stride);
+	for (gint i = 0; i < 16; ++i) {
+		const guint32 *a = (const guint32 *)(expected + i * stride);
+		const guint32 *b = (const guint32 *)(pixels + i * stride);
+		for (gint j = 0; j < 16; ++j) {
+			g_assert_cmphex(b[j], ==, a[j]);
+		}
+	}
+	cairo_surface_destroy(result);
+	cairo_surface_destroy(surface);
+	g_object_unref(input);
+	g_object_unref(output);
+	g_object_unref(png);
+}
+
+static void
+assert_png_backend(QahiraFormat *png, const guchar *bytes, gsize size)
+{
+	qahira_format_png_set_backend(png, QAHIRA_FORMAT_PNG_BACKEND_LIBPNG);
+	cairo_surface_t *expected = load_png_data(png, bytes, size);
+	qahira_format_png_set_backend(png, QAHIRA_FORMAT_PNG_BACKEND_DEFAULT);
+	cairo_surface_t *result = load_png_data(png, bytes, size);
+	assert_surface_equal(expected, result);
+	cairo_surface_destroy(result);
+	cairo_surface_destroy(expected);
+}
+
+static void
+test_png_save_palette(GString **path, gconstpointer data)
+{
+	QahiraFormat *png = qahira_format_png_new();
+	g_assert(png);
+	g_assert_cmpint(qahira_format_png_get_colors(png), ==, 0);
+	qahira_format_png_set_colors(png, 1000);
+	g_assert_cmpint(qahira_format_png_get_colors(png), ==, 256);
+	qahira_format_png_set_colors(png, 1);
+	g_assert_cmpint(qahira_format_png_get_colors(png), ==, 2);
+	cairo_surface_t *surface =
+		cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 32, 32);
+	g_assert(surface);
+	cairo_t *cr = cairo_create(surface);
+	g_assert(cr);
+	cairo_set_source_rgba(cr, 1., 0., 0., 1.);
+	cairo_rectangle(cr, 4., 4., 16., 16.);
+	cairo_fill(cr);
+	cairo_set_source_rgba(cr, 0., 0., 1., .5);
+	cairo_rectangle(cr, 12., 12., 16., 16.);
+	cairo_fill(cr);
+	cairo_destroy(cr);
+	// images with few colors are reproduced exactly
+	qahira_format_png_set_colors(png, 0);
+	cairo_surface_t *expected = reload(png, surface);
+	qahira_format_png_set_colors(png, 16);
+	cairo_surface_t *result = reload(png, surface);
+	assert_surface_equal(expected, result);
+	cairo_surface_destroy(result);
+	cairo_surface_destroy(expected);
+	// gradients are reduced to the requested number of colors
+	cr = cairo_create(surface);
+	g_assert(cr);
+	cairo_pattern_t *pattern = cairo_pattern_create_linear(0., 0., 32., 0.);
+	g_assert(pattern);
+	cairo_pattern_add_color_stop_rgba(pattern, 0., 0., 1., 0., 1.);
+	cairo_pattern_add_color_stop_rgba(pattern, 1., 1., 0., 1., .25);
+	cairo_set_source(cr, pattern);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(cr);
+	cairo_pattern_destroy(pattern);
+	cairo_destroy(cr);
+	qahira_format_png_set_colors(png, 4);
+	qahira_format_png_set_dither(png, TRUE);
+	g_assert(qahira_format_png_get_dither(png));
+	GOutputStream *output = g_memory_output_stream_new(NULL, 0,
+			g_realloc, g_free);
+	g_assert(output);
+	GError *error = NULL;
+	gboolean status = qahira_format_save(png, surface, output, NULL,
+			&error);
+	g_assert(status);
+	GMemoryOutputStream *memory = G_MEMORY_OUTPUT_STREAM(output);
+	const guchar *bytes = g_memory_output_stream_get_data(memory);
+	g_assert_cmpuint(g_memory_output_stream_get_data_size(memory), >, 41);
+	// IHDR color type & PLTE size
+	g_assert_cmpint(bytes[25], ==, 3);
+	g_assert(!memcmp(bytes + 37, "PLTE", 4));
+	g_assert_cmpint(bytes[36], <=, 4 * 3);
+	g_object_unref(output);
+	cairo_surface_destroy(surface);
+	g_object_unref(png);
+}
+
+static void
+test_png_save_rgb24(GString **path, gconstpointer data)
+{
+	QahiraFormat *png = qahira_format_png_new();
+	g_assert(png);
+	cairo_surface_t *surface =
+		cairo_image_surface_create(CAIRO_FORMAT_RGB24, 7, 5);
+	g_assert(surface);
+	guchar *pixels = cairo_image_surface_get_data(surface);
+	gint stride = cairo_image_surface_get_stride(surface);
+	// the unused byte holds garbage
+	for (gint i = 0; i < 5; ++i) {
+		guint32 *row = (guint32 *)(pixels + i * stride);
+		for (gint j = 0; j < 7; ++j) {
+			row[j] = (i * 7 + j) % 3 * 0x55000000
+				| (i * 50) << 16 | (j * 40) << 8 | (i + j) * 20;
+		}
+	}
+	cairo_surface_mark_dirty(surface);
+	guchar *copy = g_malloc(5 * stride);
+	memcpy(copy, pixels, 5 * stride);
+	GOutputStream *output = g_memory_output_stream_new(NULL, 0,
+			g_realloc, g_free);
+	g_assert(output);
+	GError *error = NULL;
+	gboolean status = qahira_format_save(png, surface, output, NULL,
+			&error);
+	g_assert(status);
+	// the surface is left untouched
+	g_assert(!memcmp(copy, pixels, 5 * stride));
+	g_free(copy);
+	GMemoryOutputStream *memory = G_MEMORY_OUTPUT_STREAM(output);
+	cairo_surface_t *result = load_png_data(png,
+			g_memory_output_stream_get_data(memory),
+			g_memory_output_stream_get_data_size(memory));
+	g_assert_cmpint(cairo_image_surface_get_format(result), ==,
+			CAIRO_FORMAT_RGB24);
+	guchar *result_data = cairo_image_surface_get_data(result);
+	gint result_stride = cairo_image_surface_get_stride(result);
+	for (gint i = 0; i < 5; ++i) {
+		guint32 *expected = (guint32 *)(pixels + i * stride);
+		guint32 *row = (guint32 *)(result_data + i * result_stride);
+		for (gint j = 0; j < 7; ++j) {
+			g_assert_cmphex(row[j] & 0xffffff, ==,
+					expected[j] & 0xffffff);
+		}
+	}
+	cairo_surface_destroy(result);
+	cairo_surface_destroy(surface);
+	g_object_unref(output);
+	g_object_unref(png);
+}
+
+static void
+test_png_trusted(GString **path, gconstpointer data)
+{
+	QahiraFormat *png = qahira_format_png_new();
+	g_assert(png);
+	g_assert(!qahira_format_get_trusted(png));
+	cairo_surface_t *expected =
+		load_png_data(png, png_gray, sizeof(png_gray));
+	// corrupt the IDAT CRC, then the zlib Adler-32 under a valid CRC
+	static const guchar crc[] = { 0xe5, 0x35, 0x82, 0xc3 };
+	guchar bytes[sizeof(png_gray)];
+	for (gint i = 0; i < 2; ++i) {
+		memcpy(bytes, png_gray, sizeof(png_gray));
+		if (0 == i) {
+			bytes[68] ^= 0x10;
+		} else {
+			bytes[64] ^= 0x10;
+			memcpy(bytes + 65, crc, sizeof(crc));
+		}
+		qahira_format_set_trusted(png, FALSE);
+		GInputStream *input = g_memory_input_stream_new_from_data(
+				bytes, sizeof(bytes), NULL);
+		g_assert(input);
+		GError *error = NULL;
+		cairo_surface_t *surface =
+			qahira_format_load(png, input, NULL, &error);
+		g_assert(!surface);
+		g_assert(error);
+		g_clear_error(&error);
+		g_object_unref(input);
+		qahira_format_set_trusted(png, TRUE);
+		g_assert(qahira_format_get_trusted(png));
+		surface = load_png_data(png, bytes, sizeof(bytes));
+		assert_surface_equal(expected, surface);
+		cairo_surface_destroy(surface);
+	}
+	cairo_surface_destroy(expected);
+	g_object_unref(png);
+}
+
+static void
+test_png_frames(GString **path, gconstpointer data)
+{
+	QahiraFormat *png = qahira_format_png_new();
+	g_assert(png);
+	// still images are a single frame
+	cairo_surface_t *expected =
+		load_png_data(png, png_gray, sizeof(png_gray));
+	GInputStream *input = g_memory_input_stream_new_from_data(png_gray,
+			sizeof(png_gray), NULL);
+	g_assert(input);
+	GError *error = NULL;
+	gboolean status = qahira_format_open_frames(png, input, NULL,
+			&error);
+	g_assert(status);
+	cairo_surface_t *surface =
+		qahira_format_next_frame(png, NULL, NULL, &error);
+	g_assert(surface);
+	assert_surface_equal(expected, surface);
+	g_assert(!qahira_format_next_frame(png, NULL, NULL, &error));
+	g_assert(!error);
+	cairo_surface_destroy(expected);
+	g_object_unref(input);
+	g_object_unref(png);
+}
+
+#if HAVE_ZLIB
+static void
+test_png_animation(GString **path, gconstpointer data)
+{
+	// 4x4 APNG, frames:
+	// 0: red, 100 ms
+	// 1: blue over (1, 1) & (2, 2), disposed to background, 200 ms
+	// 2: green at (0, 0), disposed to previous, 0 ms
+	// 3: white at (3, 3), 1 s
+	static const guchar animation[] = {
+		0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00,
+		0x00, 0x0d, 0x49, 0x48, 0x44, 0x52, 0x00, 0x00, 0x00, 0x04,
+		0x00, 0x00, 0x00, 0x04, 0x08, 0x06, 0x00, 0x00, 0x00, 0xa9,
+		0xf1, 0x9e, 0x7e, 0x00, 0x00, 0x00, 0x08, 0x61, 0x63, 0x54,
+		0x4c, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x7c,
+		0xcd, 0x66, 0xd0, 0x00, 0x00, 0x00, 0x1a, 0x66, 0x63, 0x54,
+		0x4c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00,
+		0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x01, 0x00, 0x0a, 0x00, 0x00, 0x57, 0x72, 0x03,
+		0xe1, 0x00, 0x00, 0x00, 0x12, 0x49, 0x44, 0x41, 0x54, 0x78,
+		0xda, 0x63, 0xf8, 0xcf, 0xc0, 0xf0, 0x1f, 0x19, 0x33, 0x90,
+		0x2e, 0x00, 0x00, 0x3c, 0x40, 0x1f, 0xe1, 0x1a, 0xf3, 0xa5,
+		0x48, 0x00, 0x00, 0x00, 0x1a, 0x66, 0x63, 0x54, 0x4c, 0x00,
+		0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00,
+		0x02, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00,
+		0x14, 0x00, 0x00, 0x01, 0x01, 0xdf, 0x55, 0x7e, 0x53, 0x00,
+		0x00, 0x00, 0x16, 0x66, 0x64, 0x41, 0x54, 0x00, 0x00, 0x00,
+		0x02, 0x78, 0xda, 0x63, 0x60, 0x60, 0xf8, 0xff, 0x9f, 0x01,
+		0x01, 0xfe, 0xff, 0x07, 0x00, 0x1f, 0xf2, 0x03, 0xfd, 0xc9,
+		0xd5, 0x6d, 0x11, 0x00, 0x00, 0x00, 0x1a, 0x66, 0x63, 0x54,
+		0x4c, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x01, 0x00,
+		0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x00, 0x2f, 0x99, 0xad,
+		0x3e, 0x00, 0x00, 0x00, 0x11, 0x66, 0x64, 0x41, 0x54, 0x00,
+		0x00, 0x00, 0x04, 0x78, 0xda, 0x63, 0x60, 0xf8, 0xcf, 0xf0,
+		0x1f, 0x00, 0x04, 0x01, 0x01, 0xff, 0x45, 0x7b, 0xb0, 0x3a,
+		0x00, 0x00, 0x00, 0x1a, 0x66, 0x63, 0x54, 0x4c, 0x00, 0x00,
+		0x00, 0x05, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01,
+		0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x03, 0x00, 0x01,
+		0x00, 0x01, 0x00, 0x00, 0x65, 0x0f, 0xe8, 0xea, 0x00, 0x00,
+		0x00, 0x0f, 0x66, 0x64, 0x41, 0x54, 0x00, 0x00, 0x00, 0x06,
+		0x78, 0xda, 0x63, 0xf8, 0x0f, 0x04, 0x00, 0x09, 0xfb, 0x03,
+		0xfd, 0xed, 0x5d, 0xea, 0x2c, 0x00, 0x00, 0x00, 0x00, 0x49,
+		0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82
+	};
+	static const guint32 pixels[][16] = {
+		{
+			0xffff0000, 0xffff0000, 0xffff0000, 0xffff0000,
+			0xffff0000, 0xffff0000, 0xffff0000, 0xffff0000,
+			0xffff0000, 0xffff0000, 0xffff0000, 0xffff0000,
+			0xffff0000, 0xffff0000, 0xffff0000, 0xffff0000
+		}, {
+			0xffff0000, 0xffff0000, 0xffff0000, 0xffff0000,
+			0xffff0000, 0xff0000ff, 0xffff0000, 0xffff0000,
+			0xffff0000, 0xffff0000, 0xff0000ff, 0xffff0000,
+			0xffff0000, 0xffff0000, 0xffff0000, 0xffff0000
+		}, {
+			0xff00ff00, 0xffff0000, 0xffff0000, 0xffff0000,
+			0xffff0000, 0x00000000, 0x00000000, 0xffff0000,
+			0xffff0000, 0x00000000, 0x00000000, 0xffff0000,
+			0xffff0000, 0xffff0000, 0xffff0000, 0xffff0000
+		}, {
+			0xffff0000, 0xffff0000, 0xffff0000, 0xffff0000,
+			0xffff0000, 0x00000000, 0x00000000, 0xffff0000,
+			0xffff0000, 0x00000000, 0x00000000, 0xffff0000,
+			0xffff0000, 0xffff0000, 0xffff0000, 0xffffffff
+		}
+	};
+	static const gint delays[] = { 100, 200, 0, 1000 };
+	QahiraFormat *png = qahira_format_png_new();
+	g_assert(png);
+	GInputStream *input = g_memory_input_stream_new_from_data(
+			animation, sizeof(animation), NULL);
+	g_assert(input);
+	GError *error = NULL;
+	gboolean status = qahira_format_open_frames(png, input, NULL,
+			&error);
+	g_assert(status);
+	cairo_surface_t *canvas = NULL;
+	for (gint i = 0; i < G_N_ELEMENTS(delays); ++i) {
+		gint delay = -1;
+		cairo_surface_t *surface = qahira_format_next_frame(png,
+				&delay, NULL, &error);
+		g_assert(surface);
+		// the canvas is reused
+		g_assert(!canvas || canvas == surface);
+		canvas = surface;
+		g_assert_cmpint(delay, ==, delays[i]);
+		g_assert_cmpint(cairo_image_surface_get_width(surface), ==, 4);
+		g_assert_cmpint(cairo_image_surface_get_height(surface), ==,
+				4);
+		const guchar *bytes = cairo_image_surface_get_data(surface);
+		gint stride = cairo_image_surface_get_stride(surface);
+		for (gint y = 0; y < 4; ++y) {
+			const guint32 *row =
+				(const guint32 *)(bytes + y * stride);
+			for (gint x = 0; x < 4; ++x) {
+				g_assert_cmphex(row[x], ==,
+						pixels[i][y * 4 + x]);
+			}
+		}
+	}
+	g_assert(!qahira_format_next_frame(png, NULL, NULL, &error));
+	g_assert(!error);
+	qahira_format_close_frames(png);
+	g_object_unref(input);
+	// a canvas too large for cairo, trusted so the IHDR CRC is ignored
+	guchar bytes[sizeof(animation)];
+	memcpy(bytes, animation, sizeof(animation));
+	bytes[17] = 0x01;
+	qahira_format_set_trusted(png, TRUE);
+	input = g_memory_input_stream_new_from_data(bytes, sizeof(bytes),
+			NULL);
+	g_assert(input);
+	status = qahira_format_open_frames(png, input, NULL, &error);
+	g_assert(!status);
+	g_assert(error);
+	g_assert_cmpint(error->code, ==, QAHIRA_ERROR_CAIRO);
+	g_clear_error(&error);
+	g_object_unref(input);
+	g_object_unref(png);
+}
+#endif // HAVE_ZLIB
+
+static void
+test_png_backend(GString **path, gconstpointer data)
+{
+	QahiraFormat *png = qahira_format_png_new();
+	g_assert(png);
+	qahira_format_png_set_backend(png, QAHIRA_FORMAT_PNG_BACKEND_LIBPNG);
+	g_assert_cmpint(qahira_format_png_get_backend(png), ==,
+			QAHIRA_FORMAT_PNG_BACKEND_LIBPNG);
+	qahira_format_png_set_backend(png, QAHIRA_FORMAT_PNG_BACKEND_DEFAULT);
+	g_assert_cmpint(qahira_format_png_get_backend(png), !=,
+			QAHIRA_FORMAT_PNG_BACKEND_DEFAULT);
+	// the configured backend decodes the same pixels as libpng
+	assert_png_backend(png, png_palette, sizeof(png_palette));
+	assert_png_backend(png, png_gray, sizeof(png_gray));
+	cairo_surface_t *surface =
+		cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 61, 37);
+	g_assert(surface);
+	gdouble alpha[] = { .5, 1. };
+	for (gint i = 0; i < G_N_ELEMENTS(alpha); ++i) {
+		cairo_t *cr = cairo_create(surface);
+		g_assert(cr);
+		for (gint j = 0; j < 16; ++j) {
+			cairo_set_source_rgba(cr, j / 16., 1. - j / 16.,
+					(j % 4) / 4., alpha[i]);
+			cairo_rectangle(cr, j * 4., (j % 5) * 8., 13., 11.);
+			cairo_fill(cr);
+		}
+		cairo_destroy(cr);
+		// progressive & interlaced images
+		for (gint j = 0; j < 2; ++j) {
+			qahira_format_set_interlace(png, j);
+			GOutputStream *output = g_memory_output_stream_new(
+					NULL, 0, g_realloc, g_free);
+			g_assert(output);
+			GError *error = NULL;
+			gboolean status = qahira_format_save(png, surface,
+					output, NULL, &error);
+			g_assert(status);
+			GMemoryOutputStream *memory =
+				G_MEMORY_OUTPUT_STREAM(output);
+			assert_png_backend(png,
+				g_memory_output_stream_get_data(memory),
+				g_memory_output_stream_get_data_size(memory));
+			g_object_unref(output);
+		}
+	}
+	cairo_surface_destroy(surface);
+	g_object_unref(png);
+}
+
+static void
+test_png_save_options(GString **path, gconstpointer data)
+{
+	QahiraFormat *png = qahira_format_png_new();
+	g_assert(png);
+	cairo_surface_t *surface =
+		cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 64, 64);
+	g_assert(surface);
+	cairo_t *cr = cairo_create(surface);
+	g_assert(cr);
+	cairo_rectangle(cr, 0., 0., 64., 32.);
+	cairo_set_source_rgba(cr, 1., .5, 0., .5);
+	cairo_fill(cr);
+	cairo_destroy(cr);
+	cairo_surface_t *expected = reload(png, surface);
+	qahira_format_png_set_preset(png, QAHIRA_FORMAT_PNG_PRESET_FAST);
+	g_assert_cmpint(qahira_format_png_get_filters(png), ==,
+			QAHIRA_FORMAT_PNG_FILTER_NONE);
+	g_assert_cmpint(qahira_format_png_get_strategy(png), ==,
+			QAHIRA_FORMAT_PNG_STRATEGY_RLE);
+	cairo_surface_t *result = reload(png, surface);
+	assert_surface_equal(expected, result);
+	cairo_surface_destroy(result);
+	qahira_format_png_set_preset(png, QAHIRA_FORMAT_PNG_PRESET_SMALL);
+	g_assert_cmpint(qahira_format_png_get_compression(png), ==, 9);
+	g_assert_cmpint(qahira_format_png_get_filters(png), ==,
+			QAHIRA_FORMAT_PNG_FILTER_ALL);
+	g_assert_cmpint(qahira_format_png_get_memory_level(png), ==, 9);
+	result = reload(png, surface);
+	assert_surface_equal(expected, result);
+	cairo_surface_destroy(result);
+	qahira_format_png_set_filters(png, QAHIRA_FORMAT_PNG_FILTER_SUB
+			| QAHIRA_FORMAT_PNG_FILTER_UP);
+	g_assert_cmpint(qahira_format_png_get_filters(png), ==,
+			QAHIRA_FORMAT_PNG_FILTER_SUB
+			| QAHIRA_FORMAT_PNG_FILTER_UP);
+	qahira_format_png_set_strategy(png,
+			QAHIRA_FORMAT_PNG_STRATEGY_HUFFMAN_ONLY);
+	g_assert_cmpint(qahira_format_png_get_strategy(png), ==,
+			QAHIRA_FORMAT_PNG_STRATEGY_HUFFMAN_ONLY);
+	qahira_format_png_set_window_bits(png, 20);
+	g_assert_cmpint(qahira_format_png_get_window_bits(png), ==, 15);
+	qahira_format_png_set_window_bits(png, 9);
+	g_assert_cmpint(qahira_format_png_get_window_bits(png), ==, 9);
+	qahira_format_png_set_memory_level(png, 1);
+	g_assert_cmpint(qahira_format_png_get_memory_level(png), ==, 1);
+	result = reload(png, surface);
+	assert_surface_equal(expected, result);
+	cairo_surface_destroy(result);
+	cairo_surface_destroy(expected);
+	cairo_surface_destroy(surface);
+	g_object_unref(png);
+}
+
+static void
+test_png_threads_save(GString **path, gconstpointer data)
+{
+	QahiraFormat *png = qahira_format_png_new();
+	g_assert(png);
+	// translucent (RGBA) and opaque (RGB) images
+	gdouble alpha[] = { .5, 1. };
+	for (gint i = 0; i < G_N_ELEMENTS(alpha); ++i) {
+		// large enough to be compressed in strips
+		cairo_surface_t *surface =
+			cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+					1024, 1024);
+		g_assert(surface);
+		cairo_t *cr = cairo_create(surface);
+		g_assert(cr);
+		cairo_set_source_rgba(cr, .2, .4, .6, alpha[i]);
+		cairo_paint(cr);
+		for (gint j = 0; j < 64; ++j) {
+			cairo_set_source_rgba(cr, j / 64., 1. - j / 64.,
+					(j % 8) / 8., alpha[i]);
+			cairo_rectangle(cr, j * 16., (j % 7) * 128.,
+					200., 300.);
+			cairo_fill(cr);
+		}
+		cairo_destroy(cr);
+		qahira_format_set_threads(png, 1);
+		cairo_surface_t *expected = reload(png, surface);
+		qahira_format_set_threads(png, 4);
+		cairo_surface_t *result = reload(png, surface);
+		// strips decode to the same pixels as a serial encode
+		assert_surface_equal(expected, result);
+		cairo_surface_destroy(result);
+		cairo_surface_destroy(expected);
+		cairo_surface_destroy(surface);
+	}
+	g_object_unref(png);
+}
 #endif // QAHIRA_HAS_PNG
 
 #if QAHIRA_HAS_TARGA
@@ -116,6 +1669,79 @@ test_targa(GString **path, gconstpointer data)
 	g_object_unref(stream);
 	g_object_unref(targa);
 }
+
+static void
+test_targa_opaque(GString **path, gconstpointer data)
+{
+	// 2x2 32-bit top-left origin (red, green, blue, white), all opaque
+	static const guchar bgra[] = {
+		0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x02, 0x00, 0x02, 0x00, 0x20, 0x28,
+		0x00, 0x00, 0xff, 0xff, 0x00, 0xff, 0x00, 0xff,
+		0xff, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff
+	};
+	static const guint32 pixels[] = {
+		0xff0000, 0x00ff00, 0x0000ff, 0xffffff
+	};
+	QahiraFormat *targa = qahira_format_targa_new();
+	g_assert(targa);
+	GInputStream *input = g_memory_input_stream_new_from_data(bgra,
+			sizeof(bgra), NULL);
+	g_assert(input);
+	GError *error = NULL;
+	cairo_surface_t *surface =
+		qahira_format_load(targa, input, NULL, &error);
+	g_assert(surface);
+	g_assert_cmpint(cairo_surface_status(surface), ==,
+			CAIRO_STATUS_SUCCESS);
+	g_assert_cmpint(cairo_image_surface_get_format(surface), ==,
+			CAIRO_FORMAT_RGB24);
+	const guchar *bytes = cairo_image_surface_get_data(surface);
+	gint stride = cairo_image_surface_get_stride(surface);
+	for (gint y = 0; y < 2; ++y) {
+		const guint32 *row = (const guint32 *)(bytes + y * stride);
+		for (gint x = 0; x < 2; ++x) {
+			g_assert_cmphex(row[x] & 0xffffff, ==,
+					pixels[y * 2 + x]);
+		}
+	}
+	cairo_surface_destroy(surface);
+	g_object_unref(input);
+	// opaque ARGB32 surfaces are saved as 24-bit images
+	surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 16, 16);
+	g_assert(surface);
+	cairo_t *cr = cairo_create(surface);
+	g_assert(cr);
+	cairo_set_source_rgba(cr, 1., 0., 0., 1.);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+	GOutputStream *output = g_memory_output_stream_new(NULL, 0,
+			g_realloc, g_free);
+	g_assert(output);
+	gboolean status = qahira_format_save(targa, surface, output, NULL,
+			&error);
+	g_assert(status);
+	cairo_surface_destroy(surface);
+	GMemoryOutputStream *memory = G_MEMORY_OUTPUT_STREAM(output);
+	bytes = g_memory_output_stream_get_data(memory);
+	gsize size = g_memory_output_stream_get_data_size(memory);
+	g_assert_cmpuint(size, >, 18);
+	// pixel depth & alpha bits
+	g_assert_cmpint(bytes[16], ==, 24);
+	g_assert_cmpint(bytes[17] & 0x0f, ==, 0);
+	input = g_memory_input_stream_new_from_data(bytes, size, NULL);
+	g_assert(input);
+	surface = qahira_format_load(targa, input, NULL, &error);
+	g_assert(surface);
+	g_assert_cmpint(cairo_image_surface_get_format(surface), ==,
+			CAIRO_FORMAT_RGB24);
+	bytes = cairo_image_surface_get_data(surface);
+	g_assert_cmphex(*(const guint32 *)bytes & 0xffffff, ==, 0xff0000);
+	cairo_surface_destroy(surface);
+	g_object_unref(input);
+	g_object_unref(output);
+	g_object_unref(targa);
+}
 #endif // QAHIRA_HAS_TARGA
 
 int
@@ -126,14 +1752,72 @@ main(int argc, char *argv[])
 #if QAHIRA_HAS_JPEG
 	g_test_add(CLASS "/jpeg", GString *, NULL,
 			setup, test_jpeg, teardown);
+	g_test_add(CLASS "/jpeg/profile", GString *, NULL,
+			setup, test_jpeg_profile, teardown);
+	g_test_add(CLASS "/jpeg/progressive", GString *, NULL,
+			setup, test_jpeg_progressive, teardown);
+	g_test_add(CLASS "/jpeg/threads", GString *, NULL,
+			setup, test_jpeg_threads, teardown);
+	g_test_add(CLASS "/jpeg/threads/save", GString *, NULL,
+			setup, test_jpeg_threads_save, teardown);
+	g_test_add(CLASS "/jpeg/cmyk", GString *, NULL,
+			setup, test_jpeg_cmyk, teardown);
+	g_test_add(CLASS "/jpeg/save/argb", GString *, NULL,
+			setup, test_jpeg_save_argb, teardown);
+	g_test_add(CLASS "/jpeg/save/options", GString *, NULL,
+			setup, test_jpeg_save_options, teardown);
+	g_test_add(CLASS "/jpeg/save/target", GString *, NULL,
+			setup, test_jpeg_save_target, teardown);
+	g_test_add(CLASS "/jpeg/transform", GString *, NULL,
+			setup, test_jpeg_transform, teardown);
+	g_test_add(CLASS "/jpeg/thumbnail", GString *, NULL,
+			setup, test_jpeg_thumbnail, teardown);
+	g_test_add(CLASS "/jpeg/exif-bounds", GString *, NULL,
+			setup, test_jpeg_exif_bounds, teardown);
+	g_test_add(CLASS "/jpeg/orientation", GString *, NULL,
+			setup, test_jpeg_orientation, teardown);
+	g_test_add(CLASS "/jpeg/planes", GString *, NULL,
+			setup, test_jpeg_planes, teardown);
+	g_test_add(CLASS "/jpeg/tables", GString *, NULL,
+			setup, test_jpeg_tables, teardown);
+#if HAVE_DECL_JCS_RGB565
+	g_test_add(CLASS "/jpeg/rgb565", GString *, NULL,
+			setup, test_jpeg_rgb565, teardown);
+#endif
 #endif // QAHIRA_HAS_JPEG
 #if QAHIRA_HAS_PNG
 	g_test_add(CLASS "/png", GString *, NULL,
 			setup, test_png, teardown);
+	g_test_add(CLASS "/png/palette", GString *, NULL,
+			setup, test_png_palette, teardown);
+	g_test_add(CLASS "/png/opaque", GString *, NULL,
+			setup, test_png_opaque, teardown);
+	g_test_add(CLASS "/png/progressive", GString *, NULL,
+			setup, test_png_progressive, teardown);
+	g_test_add(CLASS "/png/save/palette", GString *, NULL,
+			setup, test_png_save_palette, teardown);
+	g_test_add(CLASS "/png/save/rgb24", GString *, NULL,
+			setup, test_png_save_rgb24, teardown);
+	g_test_add(CLASS "/png/trusted", GString *, NULL,
+			setup, test_png_trusted, teardown);
+	g_test_add(CLASS "/png/frames", GString *, NULL,
+			setup, test_png_frames, teardown);
+#if HAVE_ZLIB
+	g_test_add(CLASS "/png/animation", GString *, NULL,
+			setup, test_png_animation, teardown);
+#endif // HAVE_ZLIB
+	g_test_add(CLASS "/png/backend", GString *, NULL,
+			setup, test_png_backend, teardown);
+	g_test_add(CLASS "/png/save/options", GString *, NULL,
+			setup, test_png_save_options, teardown);
+	g_test_add(CLASS "/png/threads/save", GString *, NULL,
+			setup, test_png_threads_save, teardown);
 #endif // QAHIRA_HAS_PNG
 #if QAHIRA_HAS_TARGA
 	g_test_add(CLASS "/targa", GString *, NULL,
 			setup, test_targa, teardown);
+	g_test_add(CLASS "/targa/opaque", GString *, NULL,
+			setup, test_targa_opaque, teardown);
 #endif // QAHIRA_HAS_TARGA
 	return g_test_run();
 }